@@ -0,0 +1,490 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "CTPP2NginxBinaryParser.hpp"
+#include <ctpp2/CTPP2Exception.hpp>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+#define CTPP2_BINARY_MAX_DEPTH  512
+
+NginxBinaryParser::NginxBinaryParser(CDT &oCDT):
+		oRoot(oCDT),
+		pStart(NULL),
+		pPos(NULL),
+		pEnd(NULL),
+		iDepth(0)
+{ ;; }
+
+NginxBinaryParser::~NginxBinaryParser() throw()
+{ ;; }
+
+void NginxBinaryParser::Start(CCHAR_P szData, CCHAR_P szEnd)
+{
+	pStart = pPos = (const UCHAR_8 *) szData;
+	pEnd = (const UCHAR_8 *) szEnd;
+	iDepth = 0;
+}
+
+void NginxBinaryParser::Enter()
+{
+	if (++iDepth > CTPP2_BINARY_MAX_DEPTH) Error("too deep nesting");
+}
+
+void NginxBinaryParser::Need(const UINT_64 iSize)
+{
+	if ((UINT_64) (pEnd - pPos) < iSize) Error("truncated data");
+}
+
+/* every item takes at least one byte, so huge counts can't be valid */
+void NginxBinaryParser::Count(const UINT_64 iCount, const UINT_32 iItems)
+{
+	if (iCount > (UINT_64) (pEnd - pPos) / iItems) Error("truncated data");
+}
+
+UINT_64 NginxBinaryParser::ReadBE(const UINT_32 iSize)
+{
+	UINT_64  iValue = 0;
+	UINT_32  i;
+
+	Need(iSize);
+	for (i = 0; i < iSize; i++) {
+		iValue = (iValue << 8) | *pPos++;
+	}
+
+	return iValue;
+}
+
+void NginxBinaryParser::Error(CCHAR_P szMsg)
+{
+	throw CTPPParserSyntaxError(szMsg, 1, (UINT_32) (pPos - pStart));
+}
+
+static void
+IntToKey(STLW::string &sKey, const INT_64 iValue)
+{
+	CHAR_8  szBuf[32];
+
+	snprintf(szBuf, sizeof(szBuf), "%lld", (long long) iValue);
+	sKey.assign(szBuf);
+}
+
+static W_FLOAT
+Float32(const UINT_32 iBits)
+{
+	float  fValue;
+
+	memcpy(&fValue, &iBits, sizeof(fValue));
+	return fValue;
+}
+
+static W_FLOAT
+Float64(const UINT_64 iBits)
+{
+	double  dValue;
+
+	memcpy(&dValue, &iBits, sizeof(dValue));
+	return dValue;
+}
+
+static void
+SetUnsigned(CDT &oValue, const UINT_64 iValue)
+{
+	if (iValue > 0x7FFFFFFFFFFFFFFFull) {
+		oValue = (W_FLOAT) iValue;
+	} else {
+		oValue = (INT_64) iValue;
+	}
+}
+
+
+// MessagePack
+
+void NginxBinaryParser::ParseMsgPack(CCHAR_P szData, CCHAR_P szEnd)
+{
+	Start(szData, szEnd);
+
+	Need(1);
+	if (!((*pPos >= 0x80 && *pPos <= 0x8F) || *pPos == 0xDE || *pPos == 0xDF)) {
+		Error("root item is not a map");
+	}
+
+	MsgPackValue(oRoot);
+
+	if (pPos != pEnd) Error("unexpected data after the root map");
+}
+
+void NginxBinaryParser::MsgPackValue(CDT &oValue)
+{
+	UCHAR_8  iByte;
+	UINT_64  iSize;
+
+	Need(1);
+	iByte = *pPos++;
+
+	if (iByte <= 0x7F) { oValue = (INT_64) iByte; return; }
+	if (iByte >= 0xE0) { oValue = (INT_64) (iByte - 0x100); return; }
+	if (iByte <= 0x8F) { MsgPackMap(oValue, iByte & 0x0F); return; }
+	if (iByte <= 0x9F) { MsgPackArray(oValue, iByte & 0x0F); return; }
+
+	if (iByte <= 0xBF) {
+		iSize = iByte & 0x1F;
+		goto string;
+	}
+
+	switch (iByte) {
+		case 0xC0: oValue = CDT(); return;
+		case 0xC2: oValue = (INT_64) 0; return;
+		case 0xC3: oValue = (INT_64) 1; return;
+
+		case 0xC4: case 0xD9: iSize = ReadBE(1); goto string;
+		case 0xC5: case 0xDA: iSize = ReadBE(2); goto string;
+		case 0xC6: case 0xDB: iSize = ReadBE(4); goto string;
+
+		case 0xC7: iSize = ReadBE(1); goto ext;
+		case 0xC8: iSize = ReadBE(2); goto ext;
+		case 0xC9: iSize = ReadBE(4); goto ext;
+		case 0xD4: iSize = 1;  goto ext;
+		case 0xD5: iSize = 2;  goto ext;
+		case 0xD6: iSize = 4;  goto ext;
+		case 0xD7: iSize = 8;  goto ext;
+		case 0xD8: iSize = 16; goto ext;
+
+		case 0xCA: oValue = Float32((UINT_32) ReadBE(4)); return;
+		case 0xCB: oValue = Float64(ReadBE(8)); return;
+
+		case 0xCC: oValue = (INT_64) ReadBE(1); return;
+		case 0xCD: oValue = (INT_64) ReadBE(2); return;
+		case 0xCE: oValue = (INT_64) ReadBE(4); return;
+		case 0xCF: SetUnsigned(oValue, ReadBE(8)); return;
+
+		case 0xD0: oValue = (INT_64) (int8_t) ReadBE(1); return;
+		case 0xD1: oValue = (INT_64) (int16_t) ReadBE(2); return;
+		case 0xD2: oValue = (INT_64) (int32_t) ReadBE(4); return;
+		case 0xD3: oValue = (INT_64) ReadBE(8); return;
+
+		case 0xDC: MsgPackArray(oValue, ReadBE(2)); return;
+		case 0xDD: MsgPackArray(oValue, ReadBE(4)); return;
+		case 0xDE: MsgPackMap(oValue, ReadBE(2)); return;
+		case 0xDF: MsgPackMap(oValue, ReadBE(4)); return;
+	}
+
+	Error("invalid type");
+
+string:
+	Need(iSize);
+	oValue = STLW::string((CCHAR_P) pPos, (size_t) iSize);
+	pPos += iSize;
+	return;
+
+ext:
+	Need(iSize + 1);
+	pPos += iSize + 1;
+	oValue = CDT();
+}
+
+void NginxBinaryParser::MsgPackMap(CDT &oValue, UINT_64 iCount)
+{
+	STLW::string  sKey;
+
+	Count(iCount, 2);
+	Enter();
+
+	oValue = CDT(CDT::HASH_VAL);
+	while (iCount--) {
+		MsgPackKey(sKey);
+		MsgPackValue(oValue[sKey]);
+	}
+
+	iDepth--;
+}
+
+void NginxBinaryParser::MsgPackArray(CDT &oValue, UINT_64 iCount)
+{
+	Count(iCount, 1);
+	Enter();
+
+	oValue = CDT(CDT::ARRAY_VAL);
+	while (iCount--) {
+		oValue.PushBack(CDT());
+		MsgPackValue(oValue[oValue.Size() - 1]);
+	}
+
+	iDepth--;
+}
+
+void NginxBinaryParser::MsgPackKey(STLW::string &sKey)
+{
+	UCHAR_8  iByte;
+	UINT_64  iSize;
+
+	Need(1);
+	iByte = *pPos++;
+
+	if (iByte >= 0xA0 && iByte <= 0xBF) {
+		iSize = iByte & 0x1F;
+	} else if (iByte <= 0x7F) {
+		IntToKey(sKey, iByte);
+		return;
+	} else if (iByte >= 0xE0) {
+		IntToKey(sKey, iByte - 0x100);
+		return;
+	} else {
+		switch (iByte) {
+			case 0xC4: case 0xD9: iSize = ReadBE(1); break;
+			case 0xC5: case 0xDA: iSize = ReadBE(2); break;
+			case 0xC6: case 0xDB: iSize = ReadBE(4); break;
+			case 0xCC: IntToKey(sKey, ReadBE(1)); return;
+			case 0xCD: IntToKey(sKey, ReadBE(2)); return;
+			case 0xCE: IntToKey(sKey, ReadBE(4)); return;
+			case 0xCF: IntToKey(sKey, ReadBE(8)); return;
+			case 0xD0: IntToKey(sKey, (int8_t) ReadBE(1)); return;
+			case 0xD1: IntToKey(sKey, (int16_t) ReadBE(2)); return;
+			case 0xD2: IntToKey(sKey, (int32_t) ReadBE(4)); return;
+			case 0xD3: IntToKey(sKey, ReadBE(8)); return;
+			default: Error("unsupported map key");
+		}
+	}
+
+	Need(iSize);
+	sKey.assign((CCHAR_P) pPos, (size_t) iSize);
+	pPos += iSize;
+}
+
+
+// CBOR
+
+#define CBOR_INDEFINITE  ((UINT_64) -1)
+#define CBOR_BREAK       0xFF
+
+void NginxBinaryParser::ParseCBOR(CCHAR_P szData, CCHAR_P szEnd)
+{
+	Start(szData, szEnd);
+
+	/* self-described CBOR tag 55799 */
+	if (pEnd - pPos >= 3 && pPos[0] == 0xD9 && pPos[1] == 0xD9 && pPos[2] == 0xF7) {
+		pPos += 3;
+	}
+
+	Need(1);
+	if ((*pPos >> 5) != 5) Error("root item is not a map");
+
+	CBORValue(oRoot);
+
+	if (pPos != pEnd) Error("unexpected data after the root map");
+}
+
+UINT_64 NginxBinaryParser::CBORArgument(const UCHAR_8 iInfo)
+{
+	if (iInfo < 24) return iInfo;
+
+	switch (iInfo) {
+		case 24: return ReadBE(1);
+		case 25: return ReadBE(2);
+		case 26: return ReadBE(4);
+		case 27: return ReadBE(8);
+		case 31: return CBOR_INDEFINITE;
+	}
+
+	Error("invalid additional information");
+	return 0;
+}
+
+void NginxBinaryParser::CBORValue(CDT &oValue)
+{
+	UCHAR_8       iByte, iInfo;
+	UINT_64       iArg;
+	UINT_32       iHalf, iExp, iMant;
+	W_FLOAT       dValue;
+	STLW::string  sKey;
+
+	Need(1);
+	iByte = *pPos++;
+	iInfo = iByte & 0x1F;
+
+	switch (iByte >> 5) {
+		case 0:
+			iArg = CBORArgument(iInfo);
+			if (iArg == CBOR_INDEFINITE) Error("invalid integer");
+			SetUnsigned(oValue, iArg);
+			return;
+
+		case 1:
+			iArg = CBORArgument(iInfo);
+			if (iArg == CBOR_INDEFINITE) Error("invalid integer");
+			if (iArg > 0x7FFFFFFFFFFFFFFFull) {
+				oValue = -1.0 - (W_FLOAT) iArg;
+			} else {
+				oValue = -1 - (INT_64) iArg;
+			}
+			return;
+
+		case 2:
+		case 3:
+			pPos--;
+			CBORString(iByte, sKey);
+			oValue = sKey;
+			return;
+
+		case 4:
+			iArg = CBORArgument(iInfo);
+			Enter();
+			oValue = CDT(CDT::ARRAY_VAL);
+			if (iArg == CBOR_INDEFINITE) {
+				for ( ;; ) {
+					Need(1);
+					if (*pPos == CBOR_BREAK) break;
+					oValue.PushBack(CDT());
+					CBORValue(oValue[oValue.Size() - 1]);
+				}
+				pPos++;
+			} else {
+				Count(iArg, 1);
+				while (iArg--) {
+					oValue.PushBack(CDT());
+					CBORValue(oValue[oValue.Size() - 1]);
+				}
+			}
+			iDepth--;
+			return;
+
+		case 5:
+			iArg = CBORArgument(iInfo);
+			Enter();
+			oValue = CDT(CDT::HASH_VAL);
+			if (iArg == CBOR_INDEFINITE) {
+				for ( ;; ) {
+					Need(1);
+					if (*pPos == CBOR_BREAK) break;
+					CBORKey(sKey);
+					CBORValue(oValue[sKey]);
+				}
+				pPos++;
+			} else {
+				Count(iArg, 2);
+				while (iArg--) {
+					CBORKey(sKey);
+					CBORValue(oValue[sKey]);
+				}
+			}
+			iDepth--;
+			return;
+
+		case 6:
+			/* tags are ignored */
+			iArg = CBORArgument(iInfo);
+			if (iArg == CBOR_INDEFINITE) Error("invalid tag");
+			Enter();
+			CBORValue(oValue);
+			iDepth--;
+			return;
+	}
+
+	switch (iInfo) {
+		case 20: oValue = (INT_64) 0; return;
+		case 21: oValue = (INT_64) 1; return;
+		case 22:
+		case 23: oValue = CDT(); return;
+
+		case 24:
+			/* simple value */
+			ReadBE(1);
+			oValue = CDT();
+			return;
+
+		case 25:
+			iHalf = (UINT_32) ReadBE(2);
+			iExp = (iHalf >> 10) & 0x1F;
+			iMant = iHalf & 0x3FF;
+			if (iExp == 0) {
+				dValue = ldexp((W_FLOAT) iMant, -24);
+			} else if (iExp != 31) {
+				dValue = ldexp((W_FLOAT) (iMant + 1024), iExp - 25);
+			} else {
+				dValue = iMant ? NAN : INFINITY;
+			}
+			oValue = (iHalf & 0x8000) ? -dValue : dValue;
+			return;
+
+		case 26: oValue = Float32((UINT_32) ReadBE(4)); return;
+		case 27: oValue = Float64(ReadBE(8)); return;
+	}
+
+	if (iInfo < 20) {
+		oValue = CDT();
+		return;
+	}
+
+	Error("invalid simple value");
+}
+
+void NginxBinaryParser::CBORString(const UCHAR_8 iByte, STLW::string &sValue)
+{
+	UINT_64  iSize;
+
+	pPos++;
+	iSize = CBORArgument(iByte & 0x1F);
+	sValue.clear();
+
+	if (iSize != CBOR_INDEFINITE) {
+		Need(iSize);
+		sValue.assign((CCHAR_P) pPos, (size_t) iSize);
+		pPos += iSize;
+		return;
+	}
+
+	/* chunks of the same major type */
+	for ( ;; ) {
+		Need(1);
+		if (*pPos == CBOR_BREAK) break;
+		if ((*pPos & 0xE0) != (iByte & 0xE0) || (*pPos & 0x1F) == 31) {
+			Error("invalid string chunk");
+		}
+		pPos++;
+		iSize = CBORArgument(pPos[-1] & 0x1F);
+		Need(iSize);
+		sValue.append((CCHAR_P) pPos, (size_t) iSize);
+		pPos += iSize;
+	}
+	pPos++;
+}
+
+void NginxBinaryParser::CBORKey(STLW::string &sKey)
+{
+	UCHAR_8  iByte;
+	UINT_64  iArg;
+
+	Need(1);
+	iByte = *pPos;
+
+	switch (iByte >> 5) {
+		case 0:
+		case 1:
+			pPos++;
+			iArg = CBORArgument(iByte & 0x1F);
+			if (iArg == CBOR_INDEFINITE || iArg > 0x7FFFFFFFFFFFFFFFull) {
+				Error("unsupported map key");
+			}
+			IntToKey(sKey, (iByte >> 5) ? -1 - (INT_64) iArg : (INT_64) iArg);
+			return;
+
+		case 2:
+		case 3:
+			CBORString(iByte, sKey);
+			return;
+	}
+
+	Error("unsupported map key");
+}
+
+} // namespace CTPPNginx
@@ -0,0 +1,57 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _CTPP2_NGINX_BINARY_PARSER_HPP__
+#define _CTPP2_NGINX_BINARY_PARSER_HPP__ 1
+
+#include <ctpp2/CDT.hpp>
+#include <ctpp2/STLString.hpp>
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+/*
+ * MessagePack and CBOR decoders, the root item must be a map.  Values are
+ * mapped to CDT as JSON ones: booleans become 1/0, nil/null and undefined
+ * are undefined, byte strings are strings.  Unknown extension types are
+ * decoded as undefined values, CBOR tags are ignored.
+ */
+class NginxBinaryParser {
+	public:
+		NginxBinaryParser(CDT &oCDT);
+		~NginxBinaryParser() throw();
+
+		void ParseMsgPack(CCHAR_P szData, CCHAR_P szEnd);
+		void ParseCBOR(CCHAR_P szData, CCHAR_P szEnd);
+
+	private:
+		CDT            &oRoot;
+		const UCHAR_8  *pStart;
+		const UCHAR_8  *pPos;
+		const UCHAR_8  *pEnd;
+		UINT_32         iDepth;
+
+		void MsgPackValue(CDT &oValue);
+		void MsgPackMap(CDT &oValue, UINT_64 iCount);
+		void MsgPackArray(CDT &oValue, UINT_64 iCount);
+		void MsgPackKey(STLW::string &sKey);
+
+		void CBORValue(CDT &oValue);
+		UINT_64 CBORArgument(const UCHAR_8 iInfo);
+		void CBORString(const UCHAR_8 iByte, STLW::string &sValue);
+		void CBORKey(STLW::string &sKey);
+
+		void Start(CCHAR_P szData, CCHAR_P szEnd);
+		void Enter();
+		void Need(const UINT_64 iSize);
+		void Count(const UINT_64 iCount, const UINT_32 iItems);
+		UINT_64 ReadBE(const UINT_32 iSize);
+		void Error(CCHAR_P szMsg);
+};
+
+} // namespace CTPPNginx
+#endif // _CTPP2_NGINX_BINARY_PARSER_HPP__
@@ -0,0 +1,182 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "CTPP2NginxFragmentCache.hpp"
+#include <ctpp2/CTPP2Logger.hpp>
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+/* memory taken by a fragment besides the key and the output */
+#define FRAGMENT_OVERHEAD  128
+
+void NginxCapturingCollector::StopCapture(STLW::string &sOut)
+{
+	sOut.swap(vCaptures.back());
+	vCaptures.pop_back();
+}
+
+void NginxCapturingCollector::Capture(const void *vData, const UINT_32 iDataLength)
+{
+	STLW::vector<STLW::string>::iterator  itCapture;
+
+	for (itCapture = vCaptures.begin(); itCapture != vCaptures.end(); ++itCapture) {
+		itCapture->append((CCHAR_P) vData, iDataLength);
+	}
+}
+
+NginxFragmentCache::NginxFragmentCache() throw():
+		iMaxSize(0),
+		iSize(0),
+		pCollector(NULL)
+{ ;; }
+
+NginxFragmentCache::~NginxFragmentCache() throw()
+{ ;; }
+
+void NginxFragmentCache::SetSize(const size_t iSize)
+{
+	iMaxSize = iSize;
+
+	while (this->iSize > iMaxSize) Evict(--lFragments.end());
+}
+
+void NginxFragmentCache::Attach(NginxCapturingCollector *pCollector) throw()
+{
+	this->pCollector = pCollector;
+}
+
+void NginxFragmentCache::Detach() throw()
+{
+	pCollector = NULL;
+}
+
+bool NginxFragmentCache::Begin(const STLW::string &sKey, const INT_64 iTTL)
+{
+	STLW::map<STLW::string, FragmentList::iterator>::iterator  itIndex;
+	NginxCapturingCollector::Fragment                         oFragment;
+
+	if (iMaxSize) {
+		itIndex = mIndex.find(sKey);
+
+		if (itIndex != mIndex.end()) {
+			FragmentList::iterator itFragment = itIndex->second;
+
+			if (itFragment->iExpire > time(NULL)) {
+				lFragments.splice(lFragments.begin(), lFragments, itFragment);
+				pCollector->Collect(itFragment->sOut.data(), itFragment->sOut.size());
+				return false;
+			}
+
+			Evict(itFragment);
+		}
+
+		pCollector->StartCapture();
+	}
+
+	oFragment.sKey = sKey;
+	oFragment.iTTL = iTTL;
+	pCollector->Fragments().push_back(oFragment);
+
+	return true;
+}
+
+bool NginxFragmentCache::End()
+{
+	STLW::vector<NginxCapturingCollector::Fragment>  &vFragments = pCollector->Fragments();
+	STLW::string                                     sOut;
+
+	if (vFragments.empty()) return false;
+
+	if (iMaxSize) {
+		pCollector->StopCapture(sOut);
+		if (vFragments.back().iTTL > 0) Put(vFragments.back().sKey, sOut, vFragments.back().iTTL);
+	}
+
+	vFragments.pop_back();
+
+	return true;
+}
+
+void NginxFragmentCache::Uncacheable() throw()
+{
+	STLW::vector<NginxCapturingCollector::Fragment>::iterator  itFragment;
+
+	if (pCollector == NULL) return;
+
+	for (itFragment = pCollector->Fragments().begin();
+	     itFragment != pCollector->Fragments().end(); ++itFragment)
+	{
+		itFragment->iTTL = 0;
+	}
+}
+
+void NginxFragmentCache::Put(const STLW::string &sKey, STLW::string &sOut, const INT_64 iTTL)
+{
+	STLW::map<STLW::string, FragmentList::iterator>::iterator  itIndex;
+	size_t                                                    iFragmentSize;
+
+	iFragmentSize = sKey.size() + sOut.size() + FRAGMENT_OVERHEAD;
+	if (iFragmentSize > iMaxSize) return;
+
+	/* the same fragment may be rendered again by an inner block */
+	itIndex = mIndex.find(sKey);
+	if (itIndex != mIndex.end()) Evict(itIndex->second);
+
+	while (iSize + iFragmentSize > iMaxSize) Evict(--lFragments.end());
+
+	lFragments.push_front(Fragment());
+	lFragments.front().sKey = sKey;
+	lFragments.front().sOut.swap(sOut);
+	lFragments.front().iExpire = time(NULL) + iTTL;
+
+	mIndex[sKey] = lFragments.begin();
+	iSize += iFragmentSize;
+}
+
+void NginxFragmentCache::Evict(FragmentList::iterator itFragment)
+{
+	iSize -= itFragment->sKey.size() + itFragment->sOut.size() + FRAGMENT_OVERHEAD;
+	mIndex.erase(itFragment->sKey);
+	lFragments.erase(itFragment);
+}
+
+/*
+ * Arguments are passed in reverse order.
+ */
+INT_32 FnFragmentBegin::Handler(CDT *aArguments, const UINT_32 iArgNum, CDT &oCDTRetVal,
+	Logger &oLogger)
+{
+	if (iArgNum != 2) {
+		oLogger.Emerg("Usage: FRAGMENT_BEGIN(key, ttl)");
+		return -1;
+	}
+
+	oCDTRetVal = oCache.Begin(aArguments[1].GetString(), aArguments[0].GetInt()) ? INT_64(1) : INT_64(0);
+
+	return 0;
+}
+
+INT_32 FnFragmentEnd::Handler(CDT *aArguments, const UINT_32 iArgNum, CDT &oCDTRetVal,
+	Logger &oLogger)
+{
+	if (iArgNum != 0) {
+		oLogger.Emerg("Usage: FRAGMENT_END()");
+		return -1;
+	}
+
+	if (!oCache.End()) {
+		oLogger.Emerg("FRAGMENT_END() without FRAGMENT_BEGIN()");
+		return -1;
+	}
+
+	oCDTRetVal = "";
+
+	return 0;
+}
+
+} // namespace CTPPNginx
@@ -0,0 +1,129 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _CTPP2_NGINX_FRAGMENT_CACHE_HPP__
+#define _CTPP2_NGINX_FRAGMENT_CACHE_HPP__ 1
+
+#include <ctpp2/CDT.hpp>
+#include <ctpp2/CTPP2OutputCollector.hpp>
+#include <ctpp2/CTPP2SyscallHandler.hpp>
+#include <ctpp2/STLMap.hpp>
+#include <ctpp2/STLString.hpp>
+#include <ctpp2/STLVector.hpp>
+
+#include <list>
+#include <time.h>
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+/*
+ * Output collector able to record parts of the output, captures may be
+ * nested.  Collect() of a subclass must call Capture().  It also keeps
+ * the fragments being rendered, as the render may be suspended.
+ */
+class NginxCapturingCollector : public OutputCollector {
+	public:
+		struct Fragment {
+			STLW::string  sKey;
+			INT_64        iTTL;
+		};
+
+		NginxCapturingCollector() throw() { ;; }
+		~NginxCapturingCollector() throw() { ;; }
+
+		void StartCapture() { vCaptures.push_back(STLW::string()); }
+		void StopCapture(STLW::string &sOut);
+		bool Capturing() const throw() { return !vCaptures.empty(); }
+
+		STLW::vector<Fragment> &Fragments() throw() { return vFragments; }
+
+	protected:
+		void Capture(const void *vData, const UINT_32 iDataLength);
+
+	private:
+		STLW::vector<STLW::string>  vCaptures;
+		STLW::vector<Fragment>      vFragments;
+};
+
+/*
+ * Per-worker storage of rendered template fragments.  The least recently
+ * used fragments are evicted when the total size exceeds the limit, zero
+ * limit disables caching.
+ */
+class NginxFragmentCache {
+	public:
+		NginxFragmentCache() throw();
+		~NginxFragmentCache() throw();
+
+		void SetSize(const size_t iSize);
+
+		/* called around every template execution */
+		void Attach(NginxCapturingCollector *pCollector) throw();
+		void Detach() throw();
+
+		bool Begin(const STLW::string &sKey, const INT_64 iTTL);
+		bool End();
+
+		/* the fragments being rendered depend on the request, none is stored */
+		void Uncacheable() throw();
+
+	private:
+		struct Fragment {
+			STLW::string  sKey;
+			STLW::string  sOut;
+			time_t        iExpire;
+		};
+
+		typedef std::list<Fragment>  FragmentList;
+
+		size_t                                        iMaxSize;
+		size_t                                        iSize;
+		FragmentList                                  lFragments;
+		STLW::map<STLW::string, FragmentList::iterator>  mIndex;
+		NginxCapturingCollector                      *pCollector;
+
+		void Put(const STLW::string &sKey, STLW::string &sOut, const INT_64 iTTL);
+		void Evict(FragmentList::iterator itFragment);
+};
+
+/*
+ * FRAGMENT_BEGIN(key, ttl) emits the cached output and returns 0, or returns
+ * 1 and starts recording the output, FRAGMENT_END() stores it:
+ *
+ * <TMPL_if FRAGMENT_BEGIN("footer", 60)>...<TMPL_var FRAGMENT_END()></TMPL_if>
+ */
+class FnFragmentBegin : public SyscallHandler {
+	public:
+		FnFragmentBegin(NginxFragmentCache &oCache) throw() : oCache(oCache) { ;; }
+		~FnFragmentBegin() throw() { ;; }
+
+	private:
+		NginxFragmentCache  &oCache;
+
+		INT_32 InitHandler(CDT &oCDT) { return 0; }
+		INT_32 Handler(CDT *aArguments, const UINT_32 iArgNum, CDT &oCDTRetVal, Logger &oLogger);
+		CCHAR_P GetName() const { return "fragment_begin"; }
+		INT_32 DestroyHandler() throw() { return 0; }
+};
+
+class FnFragmentEnd : public SyscallHandler {
+	public:
+		FnFragmentEnd(NginxFragmentCache &oCache) throw() : oCache(oCache) { ;; }
+		~FnFragmentEnd() throw() { ;; }
+
+	private:
+		NginxFragmentCache  &oCache;
+
+		INT_32 InitHandler(CDT &oCDT) { return 0; }
+		INT_32 Handler(CDT *aArguments, const UINT_32 iArgNum, CDT &oCDTRetVal, Logger &oLogger);
+		CCHAR_P GetName() const { return "fragment_end"; }
+		INT_32 DestroyHandler() throw() { return 0; }
+};
+
+} // namespace CTPPNginx
+#endif // _CTPP2_NGINX_FRAGMENT_CACHE_HPP__
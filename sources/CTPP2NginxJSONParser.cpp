@@ -0,0 +1,361 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "CTPP2NginxJSONParser.hpp"
+#include <ctpp2/CTPP2Exception.hpp>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+static inline bool
+IsSpace(const CHAR_8 ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+NginxJSONParser::NginxJSONParser(CDT &oCDT, const bool bSIMD, const bool bUTF8):
+		oRoot(oCDT),
+		pScanner(GetJSONScanner(bSIMD)),
+		bValidate(bUTF8),
+		iState(ROOT),
+		bKey(false),
+		iUnicode(0),
+		iDigits(0),
+		iSurrogate(0),
+		iLine(1),
+		iPos(1)
+{ ;; }
+
+NginxJSONParser::~NginxJSONParser() throw()
+{ ;; }
+
+void NginxJSONParser::Parse(CCHAR_P szData, CCHAR_P szEnd)
+{
+	CCHAR_P  p = szData;
+	CCHAR_P  s;
+	CHAR_8   ch;
+
+	if (bValidate && !oUTF8.Check(szData, szEnd)) Error("invalid UTF-8 sequence");
+
+	while (p != szEnd) {
+		ch = *p;
+
+		switch (iState) {
+			case STRING:
+				s = pScanner->String(p, szEnd);
+				if (s != p) {
+					FlushSurrogate();
+					sToken.append(p, s - p);
+					iPos += s - p;
+					p = s;
+					continue;
+				}
+				if (ch == '"') {
+					FlushSurrogate();
+					EndString();
+				} else if (ch == '\\') {
+					iState = STRING_ESCAPE;
+				} else {
+					Error("unescaped control character in string");
+				}
+				break;
+
+			case STRING_ESCAPE:
+				iState = STRING;
+				if (ch == 'u') {
+					iState = STRING_UNICODE;
+					iUnicode = 0;
+					iDigits = 0;
+					break;
+				}
+				FlushSurrogate();
+				switch (ch) {
+					case '"':  sToken.push_back('"');  break;
+					case '\\': sToken.push_back('\\'); break;
+					case '/':  sToken.push_back('/');  break;
+					case 'b':  sToken.push_back('\b'); break;
+					case 'f':  sToken.push_back('\f'); break;
+					case 'n':  sToken.push_back('\n'); break;
+					case 'r':  sToken.push_back('\r'); break;
+					case 't':  sToken.push_back('\t'); break;
+					default: Error("invalid escape sequence");
+				}
+				break;
+
+			case STRING_UNICODE:
+				iUnicode <<= 4;
+				if      (ch >= '0' && ch <= '9') { iUnicode |= ch - '0'; }
+				else if (ch >= 'a' && ch <= 'f') { iUnicode |= ch - 'a' + 10; }
+				else if (ch >= 'A' && ch <= 'F') { iUnicode |= ch - 'A' + 10; }
+				else { Error("invalid unicode escape sequence"); }
+
+				if (++iDigits == 4) {
+					AppendUnicode(iUnicode);
+					iState = STRING;
+				}
+				break;
+
+			case NUMBER:
+				if ((ch >= '0' && ch <= '9') || ch == '.' || ch == 'e' || ch == 'E' || ch == '-' || ch == '+') {
+					sToken.push_back(ch);
+					break;
+				}
+				EndNumber();
+				continue;
+
+			case LITERAL:
+				if (ch >= 'a' && ch <= 'z') {
+					sToken.push_back(ch);
+					break;
+				}
+				EndLiteral();
+				continue;
+
+			default:
+				if (IsSpace(ch)) {
+					if (ch == '\n') {
+						iLine++;
+						iPos = 1;
+					} else {
+						iPos++;
+					}
+					p++;
+					continue;
+				}
+
+				switch (iState) {
+					case ROOT:
+						if (ch != '{') Error("not an JSON object");
+						oRoot = CDT(CDT::HASH_VAL);
+						Push(&oRoot, true);
+						iState = KEY_OR_END;
+						break;
+
+					case KEY_OR_END:
+						if (ch == '}') {
+							Close(ch);
+							break;
+						}
+						// fall through
+					case KEY:
+						if (ch != '"') Error("expected key");
+						sToken.clear();
+						bKey = true;
+						iState = STRING;
+						break;
+
+					case COLON:
+						if (ch != ':') Error("expected ':'");
+						iState = VALUE;
+						break;
+
+					case VALUE_OR_END:
+						if (ch == ']') {
+							Close(ch);
+							break;
+						}
+						// fall through
+					case VALUE:
+						StartValue(ch);
+						break;
+
+					case AFTER_VALUE:
+						if (ch == ',') {
+							iState = vStack.back().bHash ? KEY : VALUE;
+						} else if (ch == '}' || ch == ']') {
+							Close(ch);
+						} else {
+							Error("expected ',' or end of object");
+						}
+						break;
+
+					default:
+						Error("unexpected data after JSON object");
+				}
+		}
+
+		iPos++;
+		p++;
+	}
+}
+
+void NginxJSONParser::Finish()
+{
+	if (bValidate && !oUTF8.Finish()) Error("incomplete UTF-8 sequence");
+
+	if (iState == NUMBER) { EndNumber(); }
+	if (iState == LITERAL) { EndLiteral(); }
+
+	if (iState != DONE) Error("unexpected end of JSON data");
+}
+
+CDT &NginxJSONParser::NewValue()
+{
+	CDT &oNode = *vStack.back().pNode;
+
+	if (vStack.back().bHash) return oNode[sKey];
+
+	oNode.PushBack(CDT());
+	return oNode[oNode.Size() - 1];
+}
+
+void NginxJSONParser::StartValue(const CHAR_8 ch)
+{
+	CDT  *pNode;
+
+	switch (ch) {
+		case '{':
+		case '[':
+			pNode = &NewValue();
+			*pNode = CDT(ch == '{' ? CDT::HASH_VAL : CDT::ARRAY_VAL);
+			Push(pNode, ch == '{');
+			iState = (ch == '{') ? KEY_OR_END : VALUE_OR_END;
+			return;
+
+		case '"':
+			sToken.clear();
+			bKey = false;
+			iState = STRING;
+			return;
+
+		case 't':
+		case 'f':
+		case 'n':
+			sToken.assign(1, ch);
+			iState = LITERAL;
+			return;
+	}
+
+	if ((ch >= '0' && ch <= '9') || ch == '-') {
+		sToken.assign(1, ch);
+		iState = NUMBER;
+		return;
+	}
+
+	Error("unexpected character");
+}
+
+void NginxJSONParser::Push(CDT *pNode, const bool bHash)
+{
+	Level  oLevel;
+
+	oLevel.pNode = pNode;
+	oLevel.bHash = bHash;
+	vStack.push_back(oLevel);
+}
+
+void NginxJSONParser::Close(const CHAR_8 ch)
+{
+	if (vStack.back().bHash != (ch == '}')) Error("brackets mismatch");
+
+	vStack.pop_back();
+	iState = vStack.empty() ? DONE : AFTER_VALUE;
+}
+
+void NginxJSONParser::EndString()
+{
+	if (bKey) {
+		sKey.swap(sToken);
+		iState = COLON;
+		return;
+	}
+
+	NewValue() = sToken;
+	iState = AFTER_VALUE;
+}
+
+void NginxJSONParser::EndNumber()
+{
+	CHAR_P   szEnd;
+	CCHAR_P  szToken = sToken.c_str();
+
+	if (sToken.find_first_of(".eE") == STLW::string::npos) {
+		errno = 0;
+		INT_64 iValue = strtoll(szToken, &szEnd, 10);
+		if (*szEnd == '\0' && errno == 0) {
+			NewValue() = iValue;
+			iState = AFTER_VALUE;
+			return;
+		}
+	}
+
+	W_FLOAT dValue = strtod(szToken, &szEnd);
+	if (*szEnd != '\0' || szEnd == szToken) Error("invalid number");
+
+	NewValue() = dValue;
+	iState = AFTER_VALUE;
+}
+
+void NginxJSONParser::EndLiteral()
+{
+	if (sToken == "true") {
+		NewValue() = INT_64(1);
+	} else if (sToken == "false") {
+		NewValue() = INT_64(0);
+	} else if (sToken == "null") {
+		NewValue() = CDT();
+	} else {
+		Error("unexpected literal");
+	}
+
+	iState = AFTER_VALUE;
+}
+
+void NginxJSONParser::AppendUnicode(UINT_32 iChar)
+{
+	if (iChar >= 0xDC00 && iChar <= 0xDFFF && iSurrogate) {
+		iChar = 0x10000 + ((iSurrogate - 0xD800) << 10) + (iChar - 0xDC00);
+		iSurrogate = 0;
+	} else {
+		FlushSurrogate();
+		if (iChar >= 0xD800 && iChar <= 0xDBFF) {
+			iSurrogate = iChar;
+			return;
+		}
+	}
+
+	AppendUTF8(iChar);
+}
+
+void NginxJSONParser::AppendUTF8(const UINT_32 iChar)
+{
+	if (iChar < 0x80) {
+		sToken.push_back((CHAR_8) iChar);
+	} else if (iChar < 0x800) {
+		sToken.push_back((CHAR_8) (0xC0 | (iChar >> 6)));
+		sToken.push_back((CHAR_8) (0x80 | (iChar & 0x3F)));
+	} else if (iChar < 0x10000) {
+		sToken.push_back((CHAR_8) (0xE0 | (iChar >> 12)));
+		sToken.push_back((CHAR_8) (0x80 | ((iChar >> 6) & 0x3F)));
+		sToken.push_back((CHAR_8) (0x80 | (iChar & 0x3F)));
+	} else {
+		sToken.push_back((CHAR_8) (0xF0 | (iChar >> 18)));
+		sToken.push_back((CHAR_8) (0x80 | ((iChar >> 12) & 0x3F)));
+		sToken.push_back((CHAR_8) (0x80 | ((iChar >> 6) & 0x3F)));
+		sToken.push_back((CHAR_8) (0x80 | (iChar & 0x3F)));
+	}
+}
+
+void NginxJSONParser::FlushSurrogate()
+{
+	if (iSurrogate) {
+		/* unpaired high surrogate is kept as is */
+		AppendUTF8(iSurrogate);
+		iSurrogate = 0;
+	}
+}
+
+void NginxJSONParser::Error(CCHAR_P szMsg)
+{
+	throw CTPPParserSyntaxError(szMsg, iLine, iPos);
+}
+
+} // namespace CTPPNginx
@@ -0,0 +1,85 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _CTPP2_NGINX_JSON_PARSER_HPP__
+#define _CTPP2_NGINX_JSON_PARSER_HPP__ 1
+
+#include <ctpp2/CDT.hpp>
+#include <ctpp2/STLString.hpp>
+#include <ctpp2/STLVector.hpp>
+
+#include "CTPP2NginxJSONScan.hpp"
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+/*
+ * Push JSON parser: data are passed by pieces as they are received,
+ * a token may be split between any two of them.  With bSIMD strings are
+ * scanned by vector instructions, with bUTF8 every piece is checked to be
+ * valid UTF-8 before parsing.
+ */
+class NginxJSONParser {
+	public:
+		NginxJSONParser(CDT &oCDT, const bool bSIMD = false, const bool bUTF8 = false);
+		~NginxJSONParser() throw();
+
+		void Parse(CCHAR_P szData, CCHAR_P szEnd);
+		void Finish();
+
+	private:
+		enum eState {
+			ROOT,
+			KEY_OR_END,
+			KEY,
+			COLON,
+			VALUE_OR_END,
+			VALUE,
+			AFTER_VALUE,
+			STRING,
+			STRING_ESCAPE,
+			STRING_UNICODE,
+			NUMBER,
+			LITERAL,
+			DONE
+		};
+
+		struct Level {
+			CDT   *pNode;
+			bool   bHash;
+		};
+
+		CDT                  &oRoot;
+		const NginxJSONScanner  *pScanner;
+		const bool            bValidate;
+		NginxUTF8Validator    oUTF8;
+		STLW::vector<Level>   vStack;
+		STLW::string          sKey;
+		STLW::string          sToken;
+		eState                iState;
+		bool                  bKey;
+		UINT_32               iUnicode;
+		UINT_32               iDigits;
+		UINT_32               iSurrogate;
+		UINT_32               iLine;
+		UINT_32               iPos;
+
+		CDT &NewValue();
+		void StartValue(const CHAR_8 ch);
+		void Push(CDT *pNode, const bool bHash);
+		void Close(const CHAR_8 ch);
+		void EndString();
+		void EndNumber();
+		void EndLiteral();
+		void AppendUnicode(UINT_32 iChar);
+		void AppendUTF8(const UINT_32 iChar);
+		void FlushSurrogate();
+		void Error(CCHAR_P szMsg);
+};
+
+} // namespace CTPPNginx
+#endif // _CTPP2_NGINX_JSON_PARSER_HPP__
@@ -0,0 +1,194 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "CTPP2NginxJSONScan.hpp"
+
+#if (defined __x86_64__ || (defined __i386__ && defined __SSE2__)) && defined __GNUC__
+#define CTPP2_HAVE_SSE2  1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+static CCHAR_P
+ScanStringScalar(CCHAR_P szData, CCHAR_P szEnd)
+{
+	while (szData != szEnd && *szData != '"' && *szData != '\\' && (UCHAR_8) *szData >= 0x20) {
+		szData++;
+	}
+
+	return szData;
+}
+
+static CCHAR_P
+ScanNonASCIIScalar(CCHAR_P szData, CCHAR_P szEnd)
+{
+	while (szData != szEnd && (*szData & 0x80) == 0) {
+		szData++;
+	}
+
+	return szData;
+}
+
+static const NginxJSONScanner oScalarScanner = {
+	ScanStringScalar, ScanNonASCIIScalar
+};
+
+#ifdef CTPP2_HAVE_SSE2
+
+static CCHAR_P
+ScanStringSSE2(CCHAR_P szData, CCHAR_P szEnd)
+{
+	const __m128i  vQuote = _mm_set1_epi8('"');
+	const __m128i  vSlash = _mm_set1_epi8('\\');
+	const __m128i  vCtrl = _mm_set1_epi8(0x1F);
+	__m128i        vData;
+	int            iMask;
+
+	while (szEnd - szData >= 16) {
+		vData = _mm_loadu_si128((const __m128i *) szData);
+		/* control characters are the bytes not above 0x1F */
+		iMask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(vData, vQuote),
+		                                                    _mm_cmpeq_epi8(vData, vSlash)),
+		                          _mm_cmpeq_epi8(_mm_min_epu8(vData, vCtrl), vData)));
+		if (iMask) return szData + __builtin_ctz(iMask);
+		szData += 16;
+	}
+
+	return ScanStringScalar(szData, szEnd);
+}
+
+static CCHAR_P
+ScanNonASCIISSE2(CCHAR_P szData, CCHAR_P szEnd)
+{
+	int  iMask;
+
+	while (szEnd - szData >= 16) {
+		iMask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) szData));
+		if (iMask) return szData + __builtin_ctz(iMask);
+		szData += 16;
+	}
+
+	return ScanNonASCIIScalar(szData, szEnd);
+}
+
+static const NginxJSONScanner oSSE2Scanner = {
+	ScanStringSSE2, ScanNonASCIISSE2
+};
+
+__attribute__((target("avx2"))) static CCHAR_P
+ScanStringAVX2(CCHAR_P szData, CCHAR_P szEnd)
+{
+	const __m256i  vQuote = _mm256_set1_epi8('"');
+	const __m256i  vSlash = _mm256_set1_epi8('\\');
+	const __m256i  vCtrl = _mm256_set1_epi8(0x1F);
+	__m256i        vData;
+	UINT_32        iMask;
+
+	while (szEnd - szData >= 32) {
+		vData = _mm256_loadu_si256((const __m256i *) szData);
+		iMask = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(vData, vQuote), _mm256_cmpeq_epi8(vData, vSlash)),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(vData, vCtrl), vData)));
+		if (iMask) return szData + __builtin_ctz(iMask);
+		szData += 32;
+	}
+
+	return ScanStringSSE2(szData, szEnd);
+}
+
+__attribute__((target("avx2"))) static CCHAR_P
+ScanNonASCIIAVX2(CCHAR_P szData, CCHAR_P szEnd)
+{
+	UINT_32  iMask;
+
+	while (szEnd - szData >= 32) {
+		iMask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) szData));
+		if (iMask) return szData + __builtin_ctz(iMask);
+		szData += 32;
+	}
+
+	return ScanNonASCIISSE2(szData, szEnd);
+}
+
+static const NginxJSONScanner oAVX2Scanner = {
+	ScanStringAVX2, ScanNonASCIIAVX2
+};
+
+#endif
+
+const NginxJSONScanner *GetJSONScanner(const bool bSIMD)
+{
+	if (!bSIMD) return &oScalarScanner;
+
+#ifdef CTPP2_HAVE_SSE2
+	static const NginxJSONScanner *pScanner = NULL;
+
+	if (pScanner == NULL) {
+		__builtin_cpu_init();
+		pScanner = __builtin_cpu_supports("avx2") ? &oAVX2Scanner : &oSSE2Scanner;
+	}
+
+	return pScanner;
+#else
+	return &oScalarScanner;
+#endif
+}
+
+NginxUTF8Validator::NginxUTF8Validator():
+		pScanner(GetJSONScanner(true)),
+		iNeed(0),
+		iLow(0x80),
+		iHigh(0xBF)
+{ ;; }
+
+bool NginxUTF8Validator::Check(CCHAR_P szData, CCHAR_P szEnd)
+{
+	UCHAR_8  ch;
+
+	while (szData != szEnd) {
+		if (iNeed) {
+			ch = *szData++;
+			if (ch < iLow || ch > iHigh) return false;
+
+			iLow = 0x80;
+			iHigh = 0xBF;
+			iNeed--;
+			continue;
+		}
+
+		szData = pScanner->NonASCII(szData, szEnd);
+		if (szData == szEnd) break;
+
+		ch = *szData++;
+		if (ch >= 0xC2 && ch <= 0xDF) {
+			iNeed = 1;
+		} else if (ch == 0xE0) {
+			iNeed = 2;
+			iLow = 0xA0;
+		} else if (ch == 0xED) {
+			iNeed = 2;
+			iHigh = 0x9F;
+		} else if (ch >= 0xE1 && ch <= 0xEF) {
+			iNeed = 2;
+		} else if (ch == 0xF0) {
+			iNeed = 3;
+			iLow = 0x90;
+		} else if (ch == 0xF4) {
+			iNeed = 3;
+			iHigh = 0x8F;
+		} else if (ch >= 0xF1 && ch <= 0xF3) {
+			iNeed = 3;
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+} // namespace CTPPNginx
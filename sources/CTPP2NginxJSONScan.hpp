@@ -0,0 +1,52 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _CTPP2_NGINX_JSON_SCAN_HPP__
+#define _CTPP2_NGINX_JSON_SCAN_HPP__ 1
+
+#include <ctpp2/CTPP2Types.h>
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+/*
+ * Bulk scanning primitives of the JSON parser.  Every function returns
+ * the first matching position or szEnd.  Only string bodies and ASCII runs
+ * are scanned this way, structure is still parsed byte by byte: the parser
+ * is fed by pieces of network buffers, a structural index of a whole
+ * document wouldn't fit there.
+ */
+struct NginxJSONScanner {
+	/* '"', '\\' or a control character */
+	CCHAR_P (*String)(CCHAR_P szData, CCHAR_P szEnd);
+	/* byte with the high bit set */
+	CCHAR_P (*NonASCII)(CCHAR_P szData, CCHAR_P szEnd);
+};
+
+/* the best implementation supported by CPU, or plain C one */
+const NginxJSONScanner *GetJSONScanner(const bool bSIMD);
+
+/*
+ * UTF-8 validation (RFC 3629, no overlong forms and surrogates) of data
+ * passed by pieces, a sequence may be split between any two of them.
+ */
+class NginxUTF8Validator {
+	public:
+		NginxUTF8Validator();
+
+		/* false if the piece is invalid */
+		bool Check(CCHAR_P szData, CCHAR_P szEnd);
+		/* false if the last sequence is incomplete */
+		bool Finish() const { return iNeed == 0; }
+
+	private:
+		const NginxJSONScanner  *pScanner;
+		UINT_32                  iNeed;
+		UCHAR_8                  iLow;
+		UCHAR_8                  iHigh;
+};
+
+} // namespace CTPPNginx
+#endif // _CTPP2_NGINX_JSON_SCAN_HPP__
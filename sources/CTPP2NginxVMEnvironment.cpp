@@ -6,6 +6,7 @@
 
 #include "CTPP2NginxVMEnvironment.hpp"
 #include <ctpp2/CTPP2VMSTDLib.hpp>
+#include <ctpp2/CTPP2VMException.hpp>
 
 using namespace CTPP;
 
@@ -21,37 +22,161 @@ NginxVMEnvironment::NginxVMEnvironment(
 		iIMaxHandlers(iIMaxHandlers),
 		iIMaxArgStackSize(iIMaxArgStackSize),
 		iIMaxCodeStackSize(iIMaxCodeStackSize),
-		oSyscallFactory(iIMaxHandlers)
+		oSyscallFactory(iIMaxHandlers),
+		iSliceSteps(0),
+		oFragmentBegin(oFragmentCache),
+		oFragmentEnd(oFragmentCache),
+		oNginxVar(oFragmentCache)
 {
 	STDLibInitializer::InitLibrary(oSyscallFactory);
+	oSyscallFactory.RegisterHandler(&oFragmentBegin);
+	oSyscallFactory.RegisterHandler(&oFragmentEnd);
+	oSyscallFactory.RegisterHandler(&oNginxVar);
 	oVM = new VM(&oSyscallFactory, iIMaxArgStackSize, iIMaxCodeStackSize, iStepsLimit);
 }
 
 NginxVMEnvironment::~NginxVMEnvironment() throw()
 {
+	SetSliceSteps(0);
 	delete oVM;
+	oSyscallFactory.RemoveHandler(oNginxVar.GetName());
+	oSyscallFactory.RemoveHandler(oFragmentEnd.GetName());
+	oSyscallFactory.RemoveHandler(oFragmentBegin.GetName());
 	STDLibInitializer::DestroyLibrary(oSyscallFactory);
 }
 
-void NginxVMEnvironment::Process(
-		VMMemoryCore const  &pVMMemoryCore,
-		CDT                 &oHash,
-		OutputCollector     &oOutputCollector,
-		Logger              &oLogger
+void NginxVMEnvironment::SetFragmentCacheSize(const size_t iSize)
+{
+	oFragmentCache.SetSize(iSize);
+}
+
+void NginxVMEnvironment::SetSliceSteps(const UINT_32 iSteps)
+{
+	STLW::vector<VM *>::iterator  itVM;
+	
+	if (iSteps == iSliceSteps) return;
+	
+	/* the limit is fixed by the constructor of VM */
+	for (itVM = vSliceVMs.begin(); itVM != vSliceVMs.end(); ++itVM) delete *itVM;
+	vSliceVMs.clear();
+	
+	iSliceSteps = iSteps;
+}
+
+VM *NginxVMEnvironment::AcquireSliceVM()
+{
+	VM  *oSliceVM;
+	
+	if (vSliceVMs.empty()) {
+		return new VM(&oSyscallFactory, iIMaxArgStackSize, iIMaxCodeStackSize, iSliceSteps);
+	}
+	
+	oSliceVM = vSliceVMs.back();
+	vSliceVMs.pop_back();
+	
+	return oSliceVM;
+}
+
+void NginxVMEnvironment::ReleaseSliceVM(VM *oSliceVM) throw()
+{
+	oSliceVM->Reset();
+	
+	try {
+		vSliceVMs.push_back(oSliceVM);
+	}
+	catch(...) {
+		delete oSliceVM;
+	}
+}
+
+UINT_32 NginxVMEnvironment::Process(
+		VMMemoryCore const       &pVMMemoryCore,
+		CDT                      &oHash,
+		NginxCapturingCollector  &oOutputCollector,
+		NginxVariableSource      &oVariables,
+		Logger                   &oLogger
 	)
 {
 	UINT_32 iIP = 0;
+	UINT_32 iSteps;
+	
+	oFragmentCache.Attach(&oOutputCollector);
+	oNginxVar.SetSource(&oVariables);
 	
 	try {
 		oVM->Init(&pVMMemoryCore, &oOutputCollector, &oLogger);
-		oVM->Run(&pVMMemoryCore, &oOutputCollector, iIP, oHash, &oLogger);
+		iSteps = oVM->Run(&pVMMemoryCore, &oOutputCollector, iIP, oHash, &oLogger);
 	}
 	catch(...) {
+		oFragmentCache.Detach();
+		oNginxVar.SetSource(NULL);
 		oVM->Reset();
 		throw;
 	}
 	
+	oFragmentCache.Detach();
+	oNginxVar.SetSource(NULL);
 	oVM->Reset();
+	
+	return iSteps;
+}
+
+NginxVMSlices::NginxVMSlices(NginxVMEnvironment &oEnvironment) throw():
+		oEnvironment(oEnvironment),
+		oVM(NULL),
+		iIP(0),
+		iSteps(0)
+{ ;; }
+
+NginxVMSlices::~NginxVMSlices() throw()
+{
+	if (oVM) oEnvironment.ReleaseSliceVM(oVM);
+}
+
+bool NginxVMSlices::Run(
+		VMMemoryCore const       &pVMMemoryCore,
+		CDT                      &oHash,
+		NginxCapturingCollector  &oOutputCollector,
+		NginxVariableSource      &oVariables,
+		Logger                   &oLogger
+	)
+{
+	bool  bDone = true;
+	
+	if (oVM == NULL) {
+		oVM = oEnvironment.AcquireSliceVM();
+		oVM->Init(&pVMMemoryCore, &oOutputCollector, &oLogger);
+	}
+	
+	/* other templates may have been executed since the previous slice */
+	oEnvironment.oFragmentCache.Attach(&oOutputCollector);
+	oEnvironment.oNginxVar.SetSource(&oVariables);
+	
+	try {
+		iSteps += oVM->Run(&pVMMemoryCore, &oOutputCollector, iIP, oHash, &oLogger);
+	}
+	catch(ExecutionLimitReached & e) {
+		iSteps += oEnvironment.iSliceSteps;
+		if (oEnvironment.iStepsLimit && iSteps >= oEnvironment.iStepsLimit) {
+			oEnvironment.oFragmentCache.Detach();
+			oEnvironment.oNginxVar.SetSource(NULL);
+			throw;
+		}
+		
+		/* the instruction hasn't been executed yet */
+		iIP = e.GetIP();
+		bDone = false;
+	}
+	catch(...) {
+		oEnvironment.oFragmentCache.Detach();
+		oEnvironment.oNginxVar.SetSource(NULL);
+		throw;
+	}
+	
+	oEnvironment.oFragmentCache.Detach();
+	oEnvironment.oNginxVar.SetSource(NULL);
+	
+	return bDone;
 }
 
-} // namespace CTPPNginx 
+} // namespace CTPPNginx
@@ -9,11 +9,17 @@
 
 #include <ctpp2/CTPP2SyscallFactory.hpp>
 #include <ctpp2/CTPP2VM.hpp>
+#include <ctpp2/STLVector.hpp>
+
+#include "CTPP2NginxFragmentCache.hpp"
+#include "CTPP2NginxVariables.hpp"
 
 using namespace CTPP;
 
 namespace CTPPNginx { // CT++ Module for Nginx
 
+class NginxVMSlices;
+
 class NginxVMEnvironment {
 	public:
 		NginxVMEnvironment(
@@ -24,14 +30,22 @@ class NginxVMEnvironment {
 		);
 		~NginxVMEnvironment() throw();
 		
-		void Process(
-			VMMemoryCore const  &pVMMemoryCore,
-			CDT                 &oHash,
-			OutputCollector     &oOutputCollector,
-			Logger              &oLogger
+		void SetFragmentCacheSize(const size_t iSize);
+		void SetSliceSteps(const UINT_32 iSteps);
+		UINT_32 GetSliceSteps() const throw() { return iSliceSteps; }
+		
+		/* returns the number of steps executed */
+		UINT_32 Process(
+			VMMemoryCore const       &pVMMemoryCore,
+			CDT                      &oHash,
+			NginxCapturingCollector  &oOutputCollector,
+			NginxVariableSource      &oVariables,
+			Logger                   &oLogger
 		);
 	
 	private:
+		friend class NginxVMSlices;
+		
 		const UINT_32  iStepsLimit;
 		const UINT_32  iIMaxHandlers;
 		const UINT_32  iIMaxArgStackSize;
@@ -39,6 +53,45 @@ class NginxVMEnvironment {
 		
 		SyscallFactory oSyscallFactory;
 		VM *oVM;
+		
+		/* VMs of suspended templates stop every iSliceSteps steps */
+		UINT_32             iSliceSteps;
+		STLW::vector<VM *>  vSliceVMs;
+		
+		VM *AcquireSliceVM();
+		void ReleaseSliceVM(VM *oSliceVM) throw();
+		
+		NginxFragmentCache  oFragmentCache;
+		FnFragmentBegin     oFragmentBegin;
+		FnFragmentEnd       oFragmentEnd;
+		FnNginxVar          oNginxVar;
+};
+
+/*
+ * Template execution yielding every GetSliceSteps() steps.  Run() returns
+ * false if it has been suspended and has to be called again, the VM with
+ * its stacks is kept by the object until then.
+ */
+class NginxVMSlices {
+	public:
+		NginxVMSlices(NginxVMEnvironment &oEnvironment) throw();
+		~NginxVMSlices() throw();
+		
+		bool Run(
+			VMMemoryCore const       &pVMMemoryCore,
+			CDT                      &oHash,
+			NginxCapturingCollector  &oOutputCollector,
+			NginxVariableSource      &oVariables,
+			Logger                   &oLogger
+		);
+		
+		UINT_32 GetSteps() const throw() { return iSteps; }
+	
+	private:
+		NginxVMEnvironment  &oEnvironment;
+		VM                  *oVM;
+		UINT_32              iIP;
+		UINT_32              iSteps;
 };
 
 } // namespace CTPPMODNginx
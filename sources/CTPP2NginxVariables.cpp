@@ -0,0 +1,44 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "CTPP2NginxVariables.hpp"
+#include <ctpp2/CTPP2Logger.hpp>
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+INT_32 FnNginxVar::Handler(CDT *aArguments, const UINT_32 iArgNum, CDT &oCDTRetVal,
+	Logger &oLogger)
+{
+	STLW::string  sValue;
+
+	if (iArgNum != 1) {
+		oLogger.Emerg("Usage: NGINX_VAR(name)");
+		return -1;
+	}
+
+	oCache.Uncacheable();
+
+	if (pSource == NULL) {
+		oCDTRetVal = CDT();
+		return 0;
+	}
+
+	switch (pSource->GetVariable(aArguments[0].GetString(), sValue)) {
+		case 1:
+			oCDTRetVal = sValue;
+			return 0;
+		case 0:
+			oCDTRetVal = CDT();
+			return 0;
+	}
+
+	oLogger.Emerg("NGINX_VAR(): could not evaluate variable");
+	return -1;
+}
+
+} // namespace CTPPNginx
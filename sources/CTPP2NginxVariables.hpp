@@ -0,0 +1,54 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _CTPP2_NGINX_VARIABLES_HPP__
+#define _CTPP2_NGINX_VARIABLES_HPP__ 1
+
+#include <ctpp2/CDT.hpp>
+#include <ctpp2/CTPP2SyscallHandler.hpp>
+#include <ctpp2/STLString.hpp>
+
+#include "CTPP2NginxFragmentCache.hpp"
+
+using namespace CTPP;
+
+namespace CTPPNginx { // CT++ Module for Nginx
+
+/*
+ * Variables of the request being rendered.  GetVariable() returns 1 if
+ * the variable is found, 0 if not and -1 on error.
+ */
+class NginxVariableSource {
+	public:
+		virtual ~NginxVariableSource() throw() { ;; }
+
+		virtual INT_32 GetVariable(const STLW::string &sName, STLW::string &sValue) = 0;
+};
+
+/*
+ * NGINX_VAR(name) returns the value of $name or undef.  Variables are
+ * evaluated only when the template asks for them, the fragments enclosing
+ * the call aren't cached then.
+ */
+class FnNginxVar : public SyscallHandler {
+	public:
+		FnNginxVar(NginxFragmentCache &oCache) throw() : oCache(oCache), pSource(NULL) { ;; }
+		~FnNginxVar() throw() { ;; }
+
+		void SetSource(NginxVariableSource *pSource) throw() { this->pSource = pSource; }
+
+	private:
+		NginxFragmentCache   &oCache;
+		NginxVariableSource  *pSource;
+
+		INT_32 InitHandler(CDT &oCDT) { return 0; }
+		INT_32 Handler(CDT *aArguments, const UINT_32 iArgNum, CDT &oCDTRetVal, Logger &oLogger);
+		CCHAR_P GetName() const { return "nginx_var"; }
+		INT_32 DestroyHandler() throw() { return 0; }
+};
+
+} // namespace CTPPNginx
+#endif // _CTPP2_NGINX_VARIABLES_HPP__
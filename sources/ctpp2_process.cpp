@@ -5,6 +5,7 @@
 
 
 #include "ctpp2_process.h"
+#include "ngx_http_ctpp2_crc32.h"
 
 #include <ctpp2/CTPP2Util.hpp>
 #include <ctpp2/CTPP2JSONParser.hpp>
@@ -16,29 +17,105 @@
 #include <ctpp2/CTPP2VMMemoryCore.hpp>
 
 #include "CTPP2NginxVMEnvironment.hpp"
+#include "CTPP2NginxJSONParser.hpp"
+#include "CTPP2NginxBinaryParser.hpp"
 
 
 using namespace CTPP;
 using namespace CTPPNginx;
 
-static NginxVMEnvironment *oNginxVMEnvironment = NULL;
+/* every thread rendering templates gets its own VM */
+#if (NGX_THREADS)
+static __thread NginxVMEnvironment *oNginxVMEnvironment = NULL;
+static pthread_key_t                ctpp2_vm_key;
+static pthread_once_t               ctpp2_vm_once = PTHREAD_ONCE_INIT;
+static int                          ctpp2_vm_key_err;
+#else
+static NginxVMEnvironment          *oNginxVMEnvironment = NULL;
+#endif
 
-class NginxOutputCollector : public OutputCollector {
+/*
+ * Streamed renders check whether the output is blocked that often, unless
+ * "ctpp2_slice_steps" are set.  Every check costs an exception thrown by the
+ * VM, a blocked render collects up to the rest of the slice.
+ */
+#define CTPP2_STREAM_SLICE  65536
+
+static struct {
+	ngx_uint_t  args;
+	ngx_uint_t  code;
+	ngx_uint_t  funcs;
+	ngx_uint_t  steps;
+	ngx_uint_t  slice;
+	size_t      fragments;
+} ctpp2_vm_conf;
+
+struct ctpp2_json_s {
+	CDT                 oHash;
+	NginxJSONParser     oParser;
+	
+	ctpp2_json_s(const bool bSIMD = false, const bool bUTF8 = false) :
+		oHash(CDT::HASH_VAL), oParser(oHash, bSIMD, bUTF8) { ;; }
+};
+
+/* allocated from the heap only, it outlives requests */
+struct ctpp2_global_s {
+	CDT                 oHash;
+	
+	ctpp2_global_s() : oHash(CDT::HASH_VAL) { ;; }
+};
+
+class NginxOutputCollector : public NginxCapturingCollector {
 	public:
-		NginxOutputCollector(ngx_pool_t *pool, ngx_chain_t *out) throw() :
-			nginxPool(pool), nginxOutput(out), total(0) { ;; }
-		~NginxOutputCollector() throw() { nginxOutput->next = NULL; }
+		NginxOutputCollector(ctpp2_render_t *render) throw() :
+			nginxRender(render), nginxFirst(NULL), nginxOutput(NULL), total(0) { ;; }
+		~NginxOutputCollector() throw() { if (nginxOutput) nginxOutput->next = NULL; }
+		
+		void Start(ngx_chain_t *out) throw() { nginxFirst = nginxOutput = out; }
 		
 		size_t getSize() const throw() { return total; }
+		ngx_chain_t *getFirst() const throw() { return nginxFirst; }
+		ngx_chain_t *getLast() const throw() { return nginxOutput; }
+		
+		static ngx_chain_t *NewBuffer(ctpp2_render_t *render) /*throw(ngx_int_t)*/;
 
 	private:
-		ngx_pool_t   *nginxPool;
-		ngx_chain_t  *nginxOutput;
-		size_t        total;
+		ctpp2_render_t  *nginxRender;
+		ngx_chain_t     *nginxFirst;
+		ngx_chain_t     *nginxOutput;
+		size_t           total;
 		
 		INT_32 Collect(const void *vData, UINT_32 iDataLength) /*throw(ngx_int_t)*/;
 };
 
+class NginxRenderVariables : public NginxVariableSource {
+	public:
+		NginxRenderVariables(ctpp2_render_t *render) throw() : nginxRender(render) { ;; }
+		~NginxRenderVariables() throw() { ;; }
+		
+		INT_32 GetVariable(const STLW::string &sName, STLW::string &sValue)
+		{
+			ngx_str_t  name, value;
+			
+			if (nginxRender->variable == NULL) return 0;
+			
+			name.len = sName.size();
+			name.data = (u_char *) sName.data();
+			
+			switch (nginxRender->variable(nginxRender->data, &name, &value)) {
+				case NGX_OK:
+					sValue.assign((CCHAR_P) value.data, value.len);
+					return 1;
+				case NGX_DECLINED:
+					return 0;
+			}
+			return -1;
+		}
+	
+	private:
+		ctpp2_render_t  *nginxRender;
+};
+
 class NginxLogger : public Logger {
 	public:
 		NginxLogger(ngx_log_t  *log) throw() : Log(log)
@@ -86,29 +163,114 @@ class NginxLogger : public Logger {
 		}
 };
 
+/* everything a template execution needs, kept while it is suspended */
+struct ctpp2_vm_s {
+	CDT                   oData;
+	CDT                  &oHash;
+	VMMemoryCore const    oMemoryCore;
+	NginxOutputCollector  oOutputCollector;
+	NginxRenderVariables  oVariables;
+	NginxLogger           oLogger;
+	NginxVMSlices         oSlices;
+	
+	ctpp2_vm_s(ngx_buf_t *tmpl, ctpp2_json_t *json, ctpp2_render_t *render) :
+		oData(CDT::HASH_VAL),
+		oHash(json ? json->oHash : oData),
+		oMemoryCore((VMExecutable *) tmpl->pos),
+		oOutputCollector(render),
+		oVariables(render),
+		oLogger(render->log),
+		oSlices(*oNginxVMEnvironment)
+	{ ;; }
+};
+
+static ngx_int_t ctpp2_run(ngx_buf_t *tmpl, ngx_buf_t *data, ctpp2_json_t *json,
+	ctpp2_render_t *render);
+static void ctpp2_vm_cleanup(void *data);
+#if (NGX_THREADS)
+static NginxVMEnvironment *ctpp2_thread_environment(void);
+static void ctpp2_thread_key_create(void);
+static void ctpp2_thread_environment_free(void *data);
+#endif
+static void ctpp2_copy(const CDT & oSource, CDT & oCopy);
+
 
 ngx_int_t
-ctpp2_init(ngx_uint_t args, ngx_uint_t code, ngx_uint_t funcs, ngx_uint_t steps)
+ctpp2_init(ngx_uint_t args, ngx_uint_t code, ngx_uint_t funcs, ngx_uint_t steps,
+	ngx_uint_t slice, size_t fragments)
 {
-	if (oNginxVMEnvironment == NULL) {
-		try {
+	ctpp2_vm_conf.args = args;
+	ctpp2_vm_conf.code = code;
+	ctpp2_vm_conf.funcs = funcs;
+	ctpp2_vm_conf.steps = steps;
+	ctpp2_vm_conf.slice = slice;
+	ctpp2_vm_conf.fragments = fragments;
+	
+	try {
+		if (oNginxVMEnvironment == NULL) {
 			oNginxVMEnvironment = new NginxVMEnvironment(steps, funcs, args, code);
 		}
-		catch(...) {
-			return NGX_ERROR;
-		}
+		oNginxVMEnvironment->SetFragmentCacheSize(fragments);
+		oNginxVMEnvironment->SetSliceSteps(slice ? slice : CTPP2_STREAM_SLICE);
+	}
+	catch(...) {
+		return NGX_ERROR;
 	}
 	
 	return NGX_OK;
 }
 
 
+uint64_t
+ctpp2_time(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+	struct timespec  ts;
+	
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval  tv;
+	
+	ngx_gettimeofday(&tv);
+	
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+/*
+ * CRC32 of the image as it was computed by the compiler, i.e. with the crc
+ * field zeroed.  The image itself is never modified, it may be mapped read-only.
+ */
+static UINT_32
+ctpp2_tmplcrc(u_char *start, u_char *end)
+{
+	static u_char  zero[sizeof(((VMExecutable *) NULL)->crc)];
+	
+	uint32_t  crc;
+	size_t    off;
+	
+	off = offsetof(VMExecutable, crc);
+	
+	ngx_crc32_init(crc);
+	ngx_http_ctpp2_crc32_update(&crc, start, off);
+	ngx_http_ctpp2_crc32_update(&crc, zero, sizeof(zero));
+	ngx_http_ctpp2_crc32_update(&crc, start + off + sizeof(zero), end - start - off - sizeof(zero));
+	ngx_crc32_final(crc);
+	
+	return crc;
+}
+
+
 ngx_int_t
 ctpp2_tmpltest(ngx_buf_t *tmpl, ngx_flag_t check, ngx_log_t *log)
 {
-	VMExecutable *oCore = (VMExecutable *) tmpl->pos;
+	const VMExecutable *oCore = (const VMExecutable *) tmpl->pos;
 	
-	if (oCore->magic[0] == 'C' &&
+	if ((size_t) (tmpl->last - tmpl->pos) >= sizeof(VMExecutable) &&
+	    oCore->magic[0] == 'C' &&
 	    oCore->magic[1] == 'T' &&
 	    oCore->magic[2] == 'P' &&
 	    oCore->magic[3] == 'P')
@@ -116,10 +278,7 @@ ctpp2_tmpltest(ngx_buf_t *tmpl, ngx_flag_t check, ngx_log_t *log)
 		if (oCore->version[0] >= 1) {
 			if (oCore->platform == 0x4142434445464748ull) {
 				if (check) {
-					UINT_32 Size = tmpl->last - tmpl->pos;
-					UINT_32 iCRC = oCore->crc;
-					oCore->crc = 0;
-					if (iCRC != crc32((UCCHAR_P) oCore, Size)) {
+					if (oCore->crc != ctpp2_tmplcrc(tmpl->pos, tmpl->last)) {
 						ngx_log_error(NGX_LOG_ERR, log, 0,
 							"CTPP2 template test: CRC checksum invalid");
 						return NGX_ERROR;
@@ -148,67 +307,459 @@ ctpp2_tmpltest(ngx_buf_t *tmpl, ngx_flag_t check, ngx_log_t *log)
 }
 
 
+static void
+ctpp2_json_cleanup(void *data)
+{
+	delete (ctpp2_json_t *) data;
+}
+
+
+ctpp2_json_t *
+ctpp2_json_create(ngx_pool_t *pool, ngx_flag_t simd, ngx_flag_t utf8)
+{
+	ngx_pool_cleanup_t  *cln;
+	
+	cln = ngx_pool_cleanup_add(pool, 0);
+	if (cln == NULL) return NULL;
+	
+	try {
+		cln->data = new ctpp2_json_t(simd != 0, utf8 != 0);
+	}
+	catch(...) {
+		return NULL;
+	}
+	cln->handler = ctpp2_json_cleanup;
+	
+	return (ctpp2_json_t *) cln->data;
+}
+
+
 ngx_int_t
-ctpp2_process(
-	ngx_buf_t     *tmpl,
-	ngx_buf_t     *data,
-	ngx_pool_t    *pool,
-	ngx_chain_t  **out,
-	size_t        *out_size,
-	ngx_log_t     *log
-)
+ctpp2_json_parse(ctpp2_json_t *json, u_char *start, u_char *end, ngx_log_t *log)
+{
+	try {
+		json->oParser.Parse((CCHAR_P) start, (CCHAR_P) end);
+		return NGX_OK;
+	}
+	catch(CTPPParserSyntaxError & e) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"JSON error: %s at line %D, pos %D", e.what(), e.GetLine(), e.GetLinePos());
+	}
+	catch(...) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"NginxCTPP module error: Unknown exception catched");
+	}
+	
+	return NGX_ERROR;
+}
+
+
+ngx_int_t
+ctpp2_utf8_check(u_char *start, u_char *end, ngx_log_t *log)
+{
+	NginxUTF8Validator  oUTF8;
+	
+	if (oUTF8.Check((CCHAR_P) start, (CCHAR_P) end) && oUTF8.Finish()) return NGX_OK;
+	
+	ngx_log_error(NGX_LOG_ERR, log, 0, "JSON error: invalid UTF-8 sequence");
+	
+	return NGX_ERROR;
+}
+
+
+ngx_int_t
+ctpp2_json_done(ctpp2_json_t *json, ngx_log_t *log)
+{
+	try {
+		json->oParser.Finish();
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 json data parsed");
+		return NGX_OK;
+	}
+	catch(CTPPParserSyntaxError & e) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"JSON error: %s at line %D, pos %D", e.what(), e.GetLine(), e.GetLinePos());
+	}
+	catch(...) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"NginxCTPP module error: Unknown exception catched");
+	}
+	
+	return NGX_ERROR;
+}
+
+
+ngx_int_t
+ctpp2_data_decode(ctpp2_json_t *json, ngx_uint_t format, u_char *start, u_char *end,
+	ngx_log_t *log)
+{
+	try {
+		NginxBinaryParser oParser(json->oHash);
+		
+		if (format == CTPP2_DATA_MSGPACK) {
+			oParser.ParseMsgPack((CCHAR_P) start, (CCHAR_P) end);
+		} else {
+			oParser.ParseCBOR((CCHAR_P) start, (CCHAR_P) end);
+		}
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 binary data decoded");
+		
+		return NGX_OK;
+	}
+	catch(CTPPParserSyntaxError & e) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"%s error: %s at byte %D", (format == CTPP2_DATA_MSGPACK) ? "MessagePack" : "CBOR",
+			e.what(), e.GetLinePos());
+	}
+	catch(...) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"NginxCTPP module error: Unknown exception catched");
+	}
+	
+	return NGX_ERROR;
+}
+
+
+ngx_int_t
+ctpp2_json_branch(ctpp2_json_t *json, ngx_str_t *name, ctpp2_json_t *branch, ngx_log_t *log)
+{
+	try {
+		/* the branch is shared, CDT copies are references counted */
+		json->oHash[STLW::string((CCHAR_P) name->data, name->len)] = branch->oHash;
+		return NGX_OK;
+	}
+	catch(CDTAccessException & e) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"Data branch \"%V\" can't be added, the root isn't a hash", name);
+	}
+	catch(...) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"NginxCTPP module error: Unknown exception catched");
+	}
+	
+	return NGX_ERROR;
+}
+
+
+static void
+ctpp2_global_cleanup(void *data)
+{
+	delete (ctpp2_global_t *) data;
+}
+
+
+ctpp2_global_t *
+ctpp2_global_create(ngx_pool_t *pool, u_char *start, u_char *end, ngx_log_t *log)
 {
+	ngx_pool_cleanup_t  *cln;
+	ctpp2_global_t      *global;
+	
+	cln = ngx_pool_cleanup_add(pool, 0);
+	if (cln == NULL) return NULL;
+	
+	global = NULL;
+	
 	try {
-		CDT oHash(CDT::HASH_VAL);
-		CTPP2JSONParser oJSONParser(oHash);
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 template processing (1/3): some inits - DONE");
+		global = new ctpp2_global_t;
 		
-		oJSONParser.Parse((char *) data->pos, (char *) data->last);
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 template processing (2/3): parsing json data - DONE");
+		NginxJSONParser oParser(global->oHash);
+		oParser.Parse((CCHAR_P) start, (CCHAR_P) end);
+		oParser.Finish();
 		
-		const VMMemoryCore pVMMemoryCore((VMExecutable *) tmpl->pos);
+		if (global->oHash.GetType() == CDT::HASH_VAL) {
+			cln->handler = ctpp2_global_cleanup;
+			cln->data = global;
+			return global;
+		}
 		
-		ngx_chain_t *chain = ngx_alloc_chain_link(pool);
-		if (chain == NULL) throw NGX_ERROR;
+		ngx_log_error(NGX_LOG_ERR, log, 0, "Global data aren't a JSON object");
+	}
+	catch(CTPPParserSyntaxError & e) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"JSON error: %s at line %D, pos %D", e.what(), e.GetLine(), e.GetLinePos());
+	}
+	catch(...) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"NginxCTPP module error: Unknown exception catched");
+	}
+	
+	delete global;
+	
+	return NULL;
+}
+
+
+ngx_int_t
+ctpp2_json_overlay(ctpp2_json_t *json, ctpp2_global_t *global, ngx_flag_t copy, ngx_log_t *log)
+{
+	const CDT  &oGlobal = global->oHash;
+	
+	try {
+		if (json->oHash.GetType() != CDT::HASH_VAL) {
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 global data: root isn't a hash");
+			return NGX_OK;
+		}
+		
+		for (CDT::ConstIterator itHash = oGlobal.Begin(); itHash != oGlobal.End(); ++itHash) {
+			/* keys of the request take precedence */
+			if (json->oHash.Exists(itHash->first)) continue;
+			
+			if (copy) {
+				ctpp2_copy(itHash->second, json->oHash[itHash->first]);
+			} else {
+				json->oHash[itHash->first] = itHash->second;
+			}
+		}
+		
+		return NGX_OK;
+	}
+	catch(...) {
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"NginxCTPP module error: Unknown exception catched");
+	}
+	
+	return NGX_ERROR;
+}
+
+
+/*
+ * A deep copy, nothing is shared with the source.
+ */
+static void
+ctpp2_copy(const CDT & oSource, CDT & oCopy)
+{
+	UINT_32  i;
+	
+	switch (oSource.GetType()) {
+		case CDT::ARRAY_VAL:
+			oCopy = CDT(CDT::ARRAY_VAL);
+			for (i = 0; i < oSource.Size(); ++i) {
+				oCopy.PushBack(CDT());
+				ctpp2_copy(oSource.GetCDT(i), oCopy[i]);
+			}
+			break;
 		
-		data->last = data->start;
-		chain->buf = data;
+		case CDT::HASH_VAL:
+			oCopy = CDT(CDT::HASH_VAL);
+			for (CDT::ConstIterator itHash = oSource.Begin(); itHash != oSource.End(); ++itHash) {
+				ctpp2_copy(itHash->second, oCopy[itHash->first]);
+			}
+			break;
 		
-		NginxOutputCollector oOutputCollector(pool, chain);
-		NginxLogger oLogger(log);
+		case CDT::STRING_VAL:
+		case CDT::STRING_INT_VAL:
+		case CDT::STRING_REAL_VAL:
+			oCopy = oSource.GetString();
+			break;
 		
-		oNginxVMEnvironment->Process(pVMMemoryCore, oHash, oOutputCollector, oLogger);
+		default:
+			oCopy = oSource;
+	}
+}
+
+
+ngx_int_t
+ctpp2_process(
+	ngx_buf_t       *tmpl,
+	ngx_buf_t       *data,
+	ctpp2_json_t    *json,
+	ctpp2_render_t  *render
+)
+{
+	ngx_pool_cleanup_t  *cln;
+	ngx_int_t            rc;
+	
+	cln = NULL;
+	if (render->vm == NULL && render->pool && (ctpp2_vm_conf.slice || render->flush)) {
+		/* the execution may be suspended, it is freed with the pool then */
+		cln = ngx_pool_cleanup_add(render->pool, 0);
+		if (cln == NULL) return NGX_ERROR;
+	}
+	
+	rc = ctpp2_run(tmpl, data, json, render);
+	
+	if (rc == NGX_AGAIN) {
+		if (cln) {
+			cln->handler = ctpp2_vm_cleanup;
+			cln->data = render;
+		}
+		return rc;
+	}
+	
+	delete render->vm;
+	render->vm = NULL;
+	
+	return rc;
+}
+
+
+static void
+ctpp2_vm_cleanup(void *data)
+{
+	ctpp2_render_t  *render = (ctpp2_render_t *) data;
+	
+	delete render->vm;
+	render->vm = NULL;
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * VMs of thread pool threads are freed as the threads exit, the one of
+ * the worker lives as long as the process.
+ */
+static NginxVMEnvironment *
+ctpp2_thread_environment(void)
+{
+	NginxVMEnvironment  *oEnvironment;
+	
+	(void) pthread_once(&ctpp2_vm_once, ctpp2_thread_key_create);
+	if (ctpp2_vm_key_err) throw NGX_ERROR;
+	
+	oEnvironment = new NginxVMEnvironment(ctpp2_vm_conf.steps, ctpp2_vm_conf.funcs,
+		ctpp2_vm_conf.args, ctpp2_vm_conf.code);
+	oEnvironment->SetFragmentCacheSize(ctpp2_vm_conf.fragments);
+	
+	if (pthread_setspecific(ctpp2_vm_key, oEnvironment) != 0) {
+		delete oEnvironment;
+		throw NGX_ERROR;
+	}
+	
+	return oEnvironment;
+}
+
+
+static void
+ctpp2_thread_key_create(void)
+{
+	ctpp2_vm_key_err = pthread_key_create(&ctpp2_vm_key, ctpp2_thread_environment_free);
+}
+
+
+static void
+ctpp2_thread_environment_free(void *data)
+{
+	delete (NginxVMEnvironment *) data;
+}
+
+#endif
+
+
+/*
+ * Returns NGX_AGAIN if the execution has been suspended, render->vm keeps
+ * it until the next call.
+ */
+static ngx_int_t
+ctpp2_run(
+	ngx_buf_t       *tmpl,
+	ngx_buf_t       *data,
+	ctpp2_json_t    *json,
+	ctpp2_render_t  *render
+)
+{
+	ngx_log_t    *log = render->log;
+	ctpp2_vm_t   *vm = render->vm;
+	ngx_chain_t  *chain;
+	uint64_t      start;
+	
+	try {
+		if (vm == NULL) {
+#if (NGX_THREADS)
+			if (oNginxVMEnvironment == NULL) {
+				/* the first template rendered by a thread pool thread */
+				oNginxVMEnvironment = ctpp2_thread_environment();
+			}
+#endif
+			
+			vm = new ctpp2_vm_t(tmpl, json, render);
+			render->vm = vm;
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 template processing (1/3): some inits - DONE");
+			
+			if (json == NULL) {
+				CTPP2JSONParser oJSONParser(vm->oData);
+				
+				start = ctpp2_time();
+				oJSONParser.Parse((char *) data->pos, (char *) data->last);
+				render->parse_time += ctpp2_time() - start;
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 template processing (2/3): parsing json data - DONE");
+			}
+			
+			if (data && render->pool) {
+				chain = ngx_alloc_chain_link(render->pool);
+				if (chain == NULL) throw NGX_ERROR;
+				
+				data->pos = data->start;
+				data->last = data->start;
+				data->tag = render->tag;
+				chain->buf = data;
+			} else {
+				chain = NginxOutputCollector::NewBuffer(render);
+			}
+			
+			vm->oOutputCollector.Start(chain);
+		}
+		
+		start = ctpp2_time();
+		
+		if (render->pool && (ctpp2_vm_conf.slice || render->flush)) {
+			/* streamed output isn't sliced but may be blocked */
+			while (!vm->oSlices.Run(vm->oMemoryCore, vm->oHash, vm->oOutputCollector,
+			                        vm->oVariables, vm->oLogger))
+			{
+				if (ctpp2_vm_conf.slice || render->blocked) {
+					render->render_time += ctpp2_time() - start;
+					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 template processing suspended");
+					return NGX_AGAIN;
+				}
+			}
+			render->steps = vm->oSlices.GetSteps();
+		} else {
+			render->steps = oNginxVMEnvironment->Process(vm->oMemoryCore, vm->oHash,
+				vm->oOutputCollector, vm->oVariables, vm->oLogger);
+		}
+		
+		render->render_time += ctpp2_time() - start;
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ctpp2 template processing (3/3): VM executing - DONE");
 		
-		if (data->last - data->start) {
-			*out = chain;
-			*out_size = oOutputCollector.getSize();
+		render->out_size = vm->oOutputCollector.getSize();
+		chain = vm->oOutputCollector.getFirst();
+		
+		if (render->flush) {
+			/* everything but the last buffer has been flushed already */
+			chain = vm->oOutputCollector.getLast();
+			render->out = (chain->buf->last != chain->buf->pos) ? chain : NULL;
+		} else if (chain->buf->last - chain->buf->start) {
+			render->out = chain;
 		} else {
-			*out = NULL;
-			*out_size = 0;
-			chain->buf = NULL;
-			ngx_free_chain(pool, chain);
-			ngx_pfree(pool, data->start);
+			render->out = NULL;
+			if (render->pool) {
+				ngx_pfree(render->pool, chain->buf->start);
+				chain->buf = NULL;
+				ngx_free_chain(render->pool, chain);
+			}
 		}
 		
 		return NGX_DONE;
 	}
 	// CDT
 	catch(CDTTypeCastException  & e) { 
+		render->error = CTPP2_ERROR_DATA;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"CDT error: Type Cast %s", e.what());
 	}
 	catch(CDTAccessException    & e) { 
+		render->error = CTPP2_ERROR_DATA;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"CDT error: Array index out of bounds: %s", e.what());
 	}
 
 	// Virtual machine
 	catch(IllegalOpcode         & e) { 
+		render->error = CTPP2_ERROR_VM;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"VM error: Illegal opcode 0x%08XD at 0x%08XD", e.GetOpcode(), e.GetIP());
 	}
 	catch(InvalidSyscall        & e) { 
+		render->error = CTPP2_ERROR_VM;
 		if (e.GetIP() != 0) {
 			VMDebugInfo oVMDebugInfo(e.GetDebugInfo());
 			ngx_log_error(
@@ -222,6 +773,7 @@ ctpp2_process(
 		}
 	}
 	catch(InvalidCall           & e) {
+		render->error = CTPP2_ERROR_VM;
 		VMDebugInfo oVMDebugInfo(e.GetDebugInfo());
 		ngx_log_error(
 			NGX_LOG_ERR, log, 0,
@@ -230,36 +782,44 @@ ctpp2_process(
 		);
 	}
 	catch(CodeSegmentOverrun    & e) { 
+		render->error = CTPP2_ERROR_VM;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"VM error: %s at 0x%08XD", e.what(),  e.GetIP());
 	}
 	catch(StackOverflow         & e) { 
+		render->error = CTPP2_ERROR_STACK;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"VM error: Stack overflow at 0x%08XD", e.GetIP());
 	}
 	catch(StackUnderflow        & e) { 
+		render->error = CTPP2_ERROR_STACK;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"VM error: Stack underflow at 0x%08XD", e.GetIP());
 	}
 	catch(ExecutionLimitReached & e) { 
+		render->error = CTPP2_ERROR_STEPS;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"VM error: Execution limit of steps reached at 0x%08XD", e.GetIP());
 	}
 	catch(VMException           & e) { 
+		render->error = CTPP2_ERROR_VM;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"VM generic exception: %s at 0x%08XD", e.what(), e.GetIP());
 	}
 
 	// CTPP
 	catch(CTPPLogicError        & e) { 
+		render->error = CTPP2_ERROR_CTPP;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"CTPP error: %s", e.what());
 	}
 	catch(CTPPUnixException     & e) { 
+		render->error = CTPP2_ERROR_CTPP;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"CTPP I/O error in %s: %s", e.what(), strerror(e.ErrNo())); 
 	}
 	catch(CTPPException         & e) { 
+		render->error = CTPP2_ERROR_CTPP;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"CTPP generic exception: %s", e.what());
 	}
@@ -267,6 +827,7 @@ ctpp2_process(
 	// Nginx
 	catch(ngx_int_t  & rc) { return rc; }
 	catch(...) {
+		render->error = CTPP2_ERROR_OTHER;
 		ngx_log_error(NGX_LOG_ERR, log, 0,
 			"NginxCTPP module error: Unknown exception catched");
 	}
@@ -284,6 +845,8 @@ NginxOutputCollector::Collect(const void *vData, UINT_32 iDataLength) /*throw(ng
 	u_char       *charData;
 	ngx_chain_t  *chain;
 	
+	if (Capturing()) Capture(vData, iDataLength);
+	
 	charData = (u_char *) vData;
 	total += iDataLength;
 	buffer = nginxOutput->buf;
@@ -297,15 +860,56 @@ NginxOutputCollector::Collect(const void *vData, UINT_32 iDataLength) /*throw(ng
 		
 		charData += size;
 		
-		freeSpace = ngx_pagesize;
-		buffer = ngx_create_temp_buf(nginxPool, freeSpace);
-		if (buffer == NULL) throw NGX_ERROR;
+		chain = NewBuffer(nginxRender);
 		
-		chain = ngx_alloc_chain_link(nginxPool);
-		if (chain == NULL) throw NGX_ERROR;
-		chain->buf = buffer;
+		if (nginxRender->flush) {
+			nginxOutput->next = NULL;
+			switch (nginxRender->flush(nginxRender->data, nginxOutput)) {
+				case NGX_ERROR:
+					throw NGX_ERROR;
+				case NGX_AGAIN:
+					/* the rest of the slice is still collected */
+					nginxRender->blocked = 1;
+			}
+		} else {
+			nginxOutput->next = chain;
+		}
 		
-		nginxOutput->next = chain;
 		nginxOutput = chain;
+		buffer = chain->buf;
+		freeSpace = buffer->end - buffer->last;
 	} while (true);
 }
+
+
+ngx_chain_t *
+NginxOutputCollector::NewBuffer(ctpp2_render_t *render) /*throw(ngx_int_t)*/
+{
+	ngx_buf_t    *buffer;
+	ngx_chain_t  *chain;
+	
+	chain = render->free;
+	if (chain) {
+		/* a buffer already sent by the next filters */
+		render->free = chain->next;
+		chain->buf->pos = chain->buf->start;
+		chain->buf->last = chain->buf->start;
+		
+	} else if (render->alloc) {
+		chain = render->alloc(render->data);
+		if (chain == NULL) throw NGX_ERROR;
+		chain->buf->tag = render->tag;
+		
+	} else {
+		buffer = ngx_create_temp_buf(render->pool, ngx_pagesize);
+		if (buffer == NULL) throw NGX_ERROR;
+		buffer->tag = render->tag;
+		
+		chain = ngx_alloc_chain_link(render->pool);
+		if (chain == NULL) throw NGX_ERROR;
+		chain->buf = buffer;
+	}
+	
+	chain->next = NULL;
+	return chain;
+}
@@ -4,6 +4,9 @@
  */
 
 
+#ifndef _CTPP2_PROCESS_H_INCLUDED_
+#define _CTPP2_PROCESS_H_INCLUDED_
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,24 +14,117 @@ extern "C" {
 #include <ngx_config.h>
 #include <ngx_core.h>
 
+typedef ngx_int_t (*ctpp2_flush_pt)(void *data, ngx_chain_t *out);
+typedef ngx_chain_t *(*ctpp2_alloc_pt)(void *data);
+typedef ngx_int_t (*ctpp2_variable_pt)(void *data, ngx_str_t *name, ngx_str_t *value);
+
+typedef struct ctpp2_vm_s  ctpp2_vm_t;
+
+/*
+ * Without pool the render doesn't touch anything but the heap, output buffers
+ * have to be provided by alloc() then.  That's the way it runs in threads.
+ */
+typedef struct {
+	ngx_pool_t      *pool;
+	ngx_log_t       *log;
+
+	ngx_chain_t     *out;       /* output that hasn't been flushed */
+	size_t           out_size;  /* total size of output */
+
+	/* gets output buffers, ngx_pagesize buffers are allocated if NULL */
+	ctpp2_alloc_pt   alloc;
+
+	/* gets a variable for NGINX_VAR(), NGX_DECLINED if not found */
+	ctpp2_variable_pt  variable;
+
+	/*
+	 * streaming: full buffers are passed to flush() as soon as possible,
+	 * NGX_AGAIN from it blocks the render, it is suspended after the current
+	 * slice of steps until the flag is cleared
+	 */
+	ctpp2_flush_pt   flush;
+	void            *data;
+	ngx_chain_t     *free;
+	ngx_buf_tag_t    tag;
+	ngx_uint_t       blocked;
+
+	/* execution suspended after a slice of steps, it is freed with the pool */
+	ctpp2_vm_t      *vm;
+
+	/* statistics, times are in microseconds and are added up */
+	uint64_t         parse_time;
+	uint64_t         render_time;
+	ngx_uint_t       steps;
+	ngx_uint_t       error;     /* class of the exception that stopped it */
+} ctpp2_render_t;
+
+/* classes of render errors */
+#define CTPP2_ERROR_NONE    0
+#define CTPP2_ERROR_DATA    1   /* CDT type casts and access */
+#define CTPP2_ERROR_VM      2   /* opcodes, syscalls, calls, code segment */
+#define CTPP2_ERROR_STACK   3
+#define CTPP2_ERROR_STEPS   4   /* execution limit reached */
+#define CTPP2_ERROR_CTPP    5   /* parsing of data, I/O and the rest of CTPP */
+#define CTPP2_ERROR_OTHER   6
+#define CTPP2_ERRORS        7
+
+typedef struct ctpp2_json_s  ctpp2_json_t;
+typedef struct ctpp2_global_s  ctpp2_global_t;
+
+/* formats of data */
+#define CTPP2_DATA_JSON     0
+#define CTPP2_DATA_MSGPACK  1
+#define CTPP2_DATA_CBOR     2
+
 ngx_int_t ctpp2_init(
 	ngx_uint_t  args,
 	ngx_uint_t  code,
 	ngx_uint_t  funcs,
-	ngx_uint_t  steps
+	ngx_uint_t  steps,
+	ngx_uint_t  slice,
+	size_t      fragments
 );
 
+/* monotonic time in microseconds */
+uint64_t ctpp2_time(void);
+
 ngx_int_t ctpp2_tmpltest(ngx_buf_t *tmpl, ngx_flag_t check, ngx_log_t *log);
 
+ctpp2_json_t *ctpp2_json_create(ngx_pool_t *pool, ngx_flag_t simd, ngx_flag_t utf8);
+ngx_int_t ctpp2_json_parse(ctpp2_json_t *json, u_char *start, u_char *end, ngx_log_t *log);
+ngx_int_t ctpp2_json_done(ctpp2_json_t *json, ngx_log_t *log);
+/* for the classic parser, the incremental ones check pieces themselves */
+ngx_int_t ctpp2_utf8_check(u_char *start, u_char *end, ngx_log_t *log);
+ngx_int_t ctpp2_data_decode(ctpp2_json_t *json, ngx_uint_t format, u_char *start, u_char *end,
+	ngx_log_t *log);
+
+/* json[name] becomes the data of branch, it isn't copied */
+ngx_int_t ctpp2_json_branch(ctpp2_json_t *json, ngx_str_t *name, ctpp2_json_t *branch,
+	ngx_log_t *log);
+
+/*
+ * Global data are parsed once and shared by requests: keys missing in json
+ * are added as references.  Renders in threads need a copy, as reference
+ * counters of CDT aren't atomic.
+ */
+ctpp2_global_t *ctpp2_global_create(ngx_pool_t *pool, u_char *start, u_char *end,
+	ngx_log_t *log);
+ngx_int_t ctpp2_json_overlay(ctpp2_json_t *json, ctpp2_global_t *global, ngx_flag_t copy,
+	ngx_log_t *log);
+
+/*
+ * Returns NGX_AGAIN if the execution has been suspended, call it again with
+ * the same arguments to resume.
+ */
 ngx_int_t ctpp2_process(
-	ngx_buf_t    *tmpl,
-	ngx_buf_t    *data,
-	ngx_pool_t   *pool,
-	ngx_chain_t **out,
-	size_t       *out_size,
-	ngx_log_t    *log
+	ngx_buf_t       *tmpl,
+	ngx_buf_t       *data,
+	ctpp2_json_t    *json,
+	ctpp2_render_t  *render
 );
 
 #ifdef __cplusplus
 }
 #endif
+
+#endif /* _CTPP2_PROCESS_H_INCLUDED_ */
@@ -0,0 +1,87 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_crc32.h"
+
+
+static void ngx_http_ctpp2_crc32_init_tables(void);
+
+
+static uint32_t    ngx_http_ctpp2_crc32_table[8][256];
+static ngx_uint_t  ngx_http_ctpp2_crc32_tables_ready;
+
+
+void
+ngx_http_ctpp2_crc32_update(uint32_t *crc, u_char *p, size_t len)
+{
+	uint32_t   c;
+#if (NGX_HAVE_LITTLE_ENDIAN)
+	uint32_t   one, two;
+#endif
+	uint32_t (*t)[256];
+
+	if (!ngx_http_ctpp2_crc32_tables_ready) {
+		ngx_http_ctpp2_crc32_init_tables();
+	}
+
+	t = ngx_http_ctpp2_crc32_table;
+	c = *crc;
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+
+	while (len && ((uintptr_t) p & 7)) {
+		c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+		len--;
+	}
+
+	/* slicing-by-8 */
+	while (len >= 8) {
+		one = *(uint32_t *) p ^ c;
+		two = *(uint32_t *) (p + 4);
+
+		c = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff]
+		  ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24]
+		  ^ t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff]
+		  ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+
+		p += 8;
+		len -= 8;
+	}
+
+#endif
+
+	while (len--) {
+		c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	}
+
+	*crc = c;
+}
+
+
+static void
+ngx_http_ctpp2_crc32_init_tables(void)
+{
+	uint32_t    c;
+	ngx_uint_t  i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		}
+		ngx_http_ctpp2_crc32_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		c = ngx_http_ctpp2_crc32_table[0][i];
+		for (k = 1; k < 8; k++) {
+			c = ngx_http_ctpp2_crc32_table[0][c & 0xff] ^ (c >> 8);
+			ngx_http_ctpp2_crc32_table[k][i] = c;
+		}
+	}
+
+	ngx_http_ctpp2_crc32_tables_ready = 1;
+}
@@ -0,0 +1,30 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_CRC32_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_CRC32_H_INCLUDED_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * The same CRC32 as ngx_crc32_update() and CTPP2 crc32() (IEEE 802.3,
+ * reflected), eight bytes per iteration.  Use ngx_crc32_init() and
+ * ngx_crc32_final() around it.
+ */
+void ngx_http_ctpp2_crc32_update(uint32_t *crc, u_char *p, size_t len);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _NGX_HTTP_CTPP2_CRC32_H_INCLUDED_ */
@@ -0,0 +1,293 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_data_uri.h"
+
+
+/*
+ * Branches of "ctpp2_data" are fetched by subrequests issued all at once
+ * from the header filter, each response is parsed as it comes.  The render
+ * starts when all of them are done or "ctpp2_data_timeout" expires, the
+ * branches are put into the root hash of the data then.  Failed ones are
+ * left out, templates see them undefined.
+ */
+
+#if defined nginx_version && nginx_version >= 1013001
+/* so the output isn't held by subrequests that have timed out */
+#define NGX_HTTP_CTPP2_DATA_URI_FLAGS  NGX_HTTP_SUBREQUEST_BACKGROUND
+#else
+#define NGX_HTTP_CTPP2_DATA_URI_FLAGS  NGX_HTTP_SUBREQUEST_WAITED
+#endif
+
+
+static ngx_int_t ngx_http_ctpp2_data_uri_done(ngx_http_request_t *r,
+	ngx_http_ctpp2_fetch_t *fetch, ngx_int_t rc);
+static void ngx_http_ctpp2_data_uri_timeout(ngx_event_t *ev);
+static void ngx_http_ctpp2_data_uri_cleanup(void *data);
+
+
+char *
+ngx_http_ctpp2_data_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_loc_conf_t *lcf = conf;
+
+	ngx_str_t                         *value;
+	ngx_uint_t                         i;
+	ngx_http_ctpp2_data_uri_t         *du;
+	ngx_http_compile_complex_value_t   ccv;
+
+	value = cf->args->elts;
+
+	if (lcf->data_uris == NULL) {
+		lcf->data_uris = ngx_array_create(cf->pool, 4, sizeof(ngx_http_ctpp2_data_uri_t));
+		if (lcf->data_uris == NULL) return NGX_CONF_ERROR;
+	}
+
+	du = lcf->data_uris->elts;
+	for (i = 0; i < lcf->data_uris->nelts; i++) {
+		if (du[i].name.len == value[1].len
+		    && ngx_strncmp(du[i].name.data, value[1].data, value[1].len) == 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"duplicate data branch \"%V\"", &value[1]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	du = ngx_array_push(lcf->data_uris);
+	if (du == NULL) return NGX_CONF_ERROR;
+
+	du->name = value[1];
+
+	ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+	ccv.cf = cf;
+	ccv.value = &value[2];
+	ccv.complex_value = &du->uri;
+
+	if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_data_uri_fetch(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	ngx_http_ctpp2_data_uri_t  *du;
+	ngx_http_ctpp2_branches_t  *branches;
+	ngx_http_ctpp2_branch_t    *branch;
+	ngx_http_ctpp2_fetch_t     *fetch;
+	ngx_pool_cleanup_t         *cln;
+	ngx_str_t                   uri;
+	ngx_uint_t                  i;
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+
+	branches = ngx_pcalloc(r->pool, sizeof(ngx_http_ctpp2_branches_t));
+	if (branches == NULL) return NGX_ERROR;
+
+	branches->nelts = conf->data_uris->nelts;
+	branches->branch = ngx_pcalloc(r->pool, branches->nelts * sizeof(ngx_http_ctpp2_branch_t));
+	if (branches->branch == NULL) return NGX_ERROR;
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) return NGX_ERROR;
+
+	cln->handler = ngx_http_ctpp2_data_uri_cleanup;
+	cln->data = branches;
+
+	branches->request = r;
+	ctx->branches = branches;
+
+	du = conf->data_uris->elts;
+
+	for (i = 0; i < branches->nelts; i++) {
+		branch = &branches->branch[i];
+		branch->name = du[i].name;
+
+		if (ngx_http_complex_value(r, &du[i].uri, &uri) != NGX_OK) return NGX_ERROR;
+
+		fetch = ngx_http_ctpp2_fetch_create(r, ctx, &uri);
+		if (fetch == NULL) return NGX_ERROR;
+
+		fetch->max_size = conf->max_data_size;
+		fetch->handler = ngx_http_ctpp2_data_uri_done;
+		fetch->data = branch;
+
+		if (ngx_http_ctpp2_fetch(r, fetch, NGX_HTTP_CTPP2_DATA_URI_FLAGS) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		branch->fetch = fetch;
+		branches->pending++;
+
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http ctpp2 data uri: \"%V\" is fetched from \"%V\"", &branch->name, &uri);
+	}
+
+	if (conf->data_timeout) {
+		branches->timer.handler = ngx_http_ctpp2_data_uri_timeout;
+		branches->timer.data = branches;
+		branches->timer.log = r->connection->log;
+
+		ngx_add_timer(&branches->timer, conf->data_timeout);
+	}
+
+	return NGX_OK;
+}
+
+
+/*
+ * The fetch handler, parses the response into the branch.
+ */
+static ngx_int_t
+ngx_http_ctpp2_data_uri_done(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch,
+	ngx_int_t rc)
+{
+	ngx_http_ctpp2_branch_t *branch = fetch->data;
+
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	ngx_http_ctpp2_branches_t  *branches;
+	ngx_http_ctpp2_ctx_t       *ctx;
+	ngx_log_t                  *log;
+	ngx_uint_t                  format;
+	ngx_int_t                   status, prc;
+	uint64_t                    start;
+
+	ctx = fetch->ctx;
+	branches = ctx->branches;
+	log = r->connection->log;
+
+	if (branches->closed) {
+		ngx_log_error(NGX_LOG_INFO, log, 0,
+			"Data \"%V\" has been fetched too late", &branch->name);
+		return rc;
+	}
+
+	branches->pending--;
+
+	status = (rc == NGX_OK) ? (ngx_int_t) r->headers_out.status : rc;
+
+	if (status != NGX_HTTP_OK || fetch->failed) {
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"Fetching data \"%V\" failed (%i), the branch is left out", &branch->name, status);
+		return rc;
+	}
+
+	conf = ngx_http_get_module_loc_conf(r->parent, ngx_http_ctpp2_filter_module);
+	format = ngx_http_ctpp2_data_format(r);
+
+	branch->json = ctpp2_json_create(r->pool,
+		format == CTPP2_DATA_JSON && conf->json_parser == NGX_HTTP_CTPP2_JSON_SIMD,
+		format == CTPP2_DATA_JSON && conf->json_utf8);
+	if (branch->json == NULL) return NGX_ERROR;
+
+	start = ctpp2_time();
+
+	if (format == CTPP2_DATA_JSON) {
+		prc = ctpp2_json_parse(branch->json, fetch->start, fetch->last, log);
+		if (prc == NGX_OK) prc = ctpp2_json_done(branch->json, log);
+
+	} else {
+		prc = ctpp2_data_decode(branch->json, format, fetch->start, fetch->last, log);
+	}
+
+	ctx->render.parse_time += ctpp2_time() - start;
+
+	if (prc != NGX_OK) {
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"Data \"%V\" can't be parsed, the branch is left out", &branch->name);
+		branch->json = NULL;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+		"http ctpp2 data uri: \"%V\" done, %uz bytes", &branch->name,
+		(size_t) (fetch->last - fetch->start));
+
+	/* the response isn't needed anymore */
+	if (fetch->start) {
+		ngx_free(fetch->start);
+		fetch->start = NULL;
+	}
+
+	return rc;
+}
+
+
+/*
+ * Puts the branches into the root hash, ctx->json has to be parsed already.
+ */
+ngx_int_t
+ngx_http_ctpp2_data_uri_merge(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_branches_t  *branches;
+	ngx_http_ctpp2_branch_t    *branch;
+	ngx_uint_t                  i;
+
+	branches = ctx->branches;
+	branches->closed = 1;
+
+	if (branches->timer.timer_set) ngx_del_timer(&branches->timer);
+
+	for (i = 0; i < branches->nelts; i++) {
+		branch = &branches->branch[i];
+		if (branch->json == NULL) continue;
+
+		if (ctpp2_json_branch(ctx->json, &branch->name, branch->json, r->connection->log)
+		    != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_data_uri_timeout(ngx_event_t *ev)
+{
+	ngx_http_ctpp2_branches_t  *branches;
+	ngx_http_ctpp2_ctx_t       *ctx;
+	ngx_http_request_t         *r;
+	ngx_connection_t           *c;
+	ngx_uint_t                  i;
+
+	branches = ev->data;
+	r = branches->request;
+	c = r->connection;
+
+	for (i = 0; i < branches->nelts; i++) {
+		if (branches->branch[i].fetch->done) continue;
+
+		ngx_log_error(NGX_LOG_WARN, c->log, 0,
+			"Fetching data \"%V\" timed out, the branch is left out",
+			&branches->branch[i].name);
+	}
+
+	branches->timedout = 1;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	if (ctx == NULL || !ctx->waiting) return;
+
+	/* the render is started by the body filter called from the writer */
+	r->write_event_handler(r);
+
+	ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_ctpp2_data_uri_cleanup(void *data)
+{
+	ngx_http_ctpp2_branches_t  *branches = data;
+
+	if (branches->timer.timer_set) ngx_del_timer(&branches->timer);
+}
@@ -0,0 +1,44 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_DATA_URI_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_DATA_URI_H_INCLUDED_
+
+
+#include "ngx_http_ctpp2_fetch.h"
+
+
+/* "ctpp2_data" */
+typedef struct {
+	ngx_str_t                  name;
+	ngx_http_complex_value_t   uri;
+} ngx_http_ctpp2_data_uri_t;
+
+typedef struct {
+	ngx_str_t                  name;
+	ngx_http_ctpp2_fetch_t    *fetch;
+	ctpp2_json_t              *json;     /* NULL if it has failed */
+} ngx_http_ctpp2_branch_t;
+
+/* branches of the data fetched by a request */
+struct ngx_http_ctpp2_branches_s {
+	ngx_http_ctpp2_branch_t   *branch;
+	ngx_uint_t                 nelts;
+	ngx_uint_t                 pending;
+	ngx_http_request_t        *request;
+	ngx_event_t                timer;    /* of "ctpp2_data_timeout" */
+	unsigned                   timedout:1;
+	unsigned                   closed:1; /* merged, late responses are dropped */
+};
+
+
+char *ngx_http_ctpp2_data_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_ctpp2_data_uri_fetch(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+ngx_int_t ngx_http_ctpp2_data_uri_merge(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+
+
+#endif /* _NGX_HTTP_CTPP2_DATA_URI_H_INCLUDED_ */
@@ -0,0 +1,339 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_fetch.h"
+
+
+/*
+ * Responses of subrequests are taken into memory rather than output, then
+ * the fetch handler gets them.  The subrequests of "template_uri" are waited
+ * for by nginx, the ones of "ctpp2_data" run in background if supported, so
+ * the request is woken up here.
+ */
+
+static ngx_int_t ngx_http_ctpp2_fetch_headers(ngx_http_request_t *sr);
+static ngx_int_t ngx_http_ctpp2_fetch_append(ngx_http_request_t *r,
+	ngx_http_ctpp2_fetch_t *fetch, u_char *p, size_t size);
+static ngx_int_t ngx_http_ctpp2_fetch_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static void ngx_http_ctpp2_fetch_cleanup(void *data);
+
+
+/* headers of the request that aren't passed to subrequests */
+static ngx_str_t  ngx_http_ctpp2_fetch_hide[] = {
+	ngx_string("If-Modified-Since"),
+	ngx_string("If-Unmodified-Since"),
+	ngx_string("If-None-Match"),
+	ngx_string("If-Match"),
+	ngx_string("If-Range"),
+	ngx_string("Range"),
+	ngx_string("Content-Length"),
+	ngx_string("Content-Type"),
+	ngx_string("Transfer-Encoding"),
+	ngx_string("Expect"),
+	ngx_null_string
+};
+
+
+ngx_http_ctpp2_fetch_t *
+ngx_http_ctpp2_fetch_create(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx, ngx_str_t *uri)
+{
+	ngx_http_ctpp2_fetch_t  *fetch;
+	ngx_pool_cleanup_t      *cln;
+
+	fetch = ngx_pcalloc(r->pool, sizeof(ngx_http_ctpp2_fetch_t));
+	if (fetch == NULL) return NULL;
+
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) return NULL;
+
+	cln->handler = ngx_http_ctpp2_fetch_cleanup;
+	cln->data = fetch;
+
+	fetch->ctx = ctx;
+	fetch->uri = *uri;
+
+	return fetch;
+}
+
+
+/*
+ * Issues the subrequest, fetch->handler and fetch->max_size are to be set.
+ */
+ngx_int_t
+ngx_http_ctpp2_fetch(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch, ngx_uint_t flags)
+{
+	ngx_http_post_subrequest_t  *ps;
+	ngx_http_request_t          *sr;
+	ngx_str_t                    uri, args;
+	ngx_uint_t                   unsafe;
+
+	uri = fetch->uri;
+	ngx_str_null(&args);
+	unsafe = NGX_HTTP_LOG_UNSAFE;
+
+	if (ngx_http_parse_unsafe_uri(r, &uri, &args, &unsafe) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"Subrequest URI \"%V\" is unsafe", &fetch->uri);
+		return NGX_ERROR;
+	}
+
+	ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+	if (ps == NULL) return NGX_ERROR;
+
+	ps->handler = ngx_http_ctpp2_fetch_done;
+	ps->data = fetch;
+
+	if (ngx_http_subrequest(r, &uri, &args, &sr, ps, flags) != NGX_OK) return NGX_ERROR;
+
+	fetch->request = sr;
+
+	return ngx_http_ctpp2_fetch_headers(sr);
+}
+
+
+/*
+ * The subrequest gets headers of the request, except conditional ones
+ * and ones of the body.
+ */
+static ngx_int_t
+ngx_http_ctpp2_fetch_headers(ngx_http_request_t *sr)
+{
+	ngx_list_part_t  *part;
+	ngx_table_elt_t  *h, *ho;
+	ngx_str_t        *hide;
+	ngx_uint_t        i;
+
+	if (ngx_list_init(&sr->headers_in.headers, sr->pool, 20, sizeof(ngx_table_elt_t))
+	    != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	part = &sr->parent->headers_in.headers.part;
+	h = part->elts;
+
+	for (i = 0; /* void */ ; i++) {
+		if (i >= part->nelts) {
+			if (part->next == NULL) break;
+
+			part = part->next;
+			h = part->elts;
+			i = 0;
+		}
+
+		for (hide = ngx_http_ctpp2_fetch_hide; hide->len; hide++) {
+			if (hide->len == h[i].key.len
+			    && ngx_strcasecmp(hide->data, h[i].key.data) == 0)
+			{
+				break;
+			}
+		}
+		if (hide->len) continue;
+
+		ho = ngx_list_push(&sr->headers_in.headers);
+		if (ho == NULL) return NGX_ERROR;
+
+		*ho = h[i];
+	}
+
+	sr->headers_in.if_modified_since = NULL;
+	sr->headers_in.if_unmodified_since = NULL;
+	sr->headers_in.if_match = NULL;
+	sr->headers_in.if_none_match = NULL;
+	sr->headers_in.if_range = NULL;
+	sr->headers_in.range = NULL;
+	sr->headers_in.content_length = NULL;
+	sr->headers_in.content_length_n = -1;
+	sr->headers_in.content_type = NULL;
+	sr->headers_in.transfer_encoding = NULL;
+	sr->headers_in.chunked = 0;
+	sr->request_body = NULL;
+
+	return NGX_OK;
+}
+
+
+ngx_table_elt_t *
+ngx_http_ctpp2_fetch_push(ngx_http_request_t *sr, char *key, char *lowcase_key)
+{
+	ngx_table_elt_t  *h;
+
+	h = ngx_list_push(&sr->headers_in.headers);
+	if (h == NULL) return NULL;
+
+	h->hash = 1;
+	h->key.data = (u_char *) key;
+	h->key.len = ngx_strlen(key);
+	h->lowcase_key = (u_char *) lowcase_key;
+#if defined nginx_version && nginx_version >= 1023000
+	h->next = NULL;
+#endif
+
+	return h;
+}
+
+
+/*
+ * Called by the header filter for each request, the subrequest is told by
+ * its post_subrequest handler, as the ctx is lost on internal redirects.
+ */
+ngx_int_t
+ngx_http_ctpp2_fetch_header(ngx_http_request_t *r)
+{
+	ngx_http_ctpp2_ctx_t    *ctx;
+	ngx_http_ctpp2_fetch_t  *fetch;
+	off_t                    len;
+
+	if (r->post_subrequest == NULL
+	    || r->post_subrequest->handler != ngx_http_ctpp2_fetch_done)
+	{
+		return NGX_DECLINED;
+	}
+
+	fetch = r->post_subrequest->data;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	if (ctx == NULL) {
+		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_ctpp2_ctx_t));
+		if (ctx == NULL) return NGX_ERROR;
+
+		ctx->fetch = fetch;
+		ngx_http_set_ctx(r, ctx, ngx_http_ctpp2_filter_module);
+	}
+
+	r->filter_need_in_memory = 1;
+
+	len = r->headers_out.content_length_n;
+	if (r->headers_out.status != NGX_HTTP_OK || len <= 0) return NGX_OK;
+
+	if (len > (off_t) fetch->max_size) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"Response of \"%V\" (%O bytes) exceeds %uz bytes", &fetch->uri, len,
+			fetch->max_size);
+		fetch->failed = 1;
+		return NGX_OK;
+	}
+
+	fetch->start = ngx_alloc((size_t) len, r->connection->log);
+	if (fetch->start == NULL) return NGX_ERROR;
+
+	fetch->last = fetch->start;
+	fetch->end = fetch->start + len;
+
+	return NGX_OK;
+}
+
+
+/*
+ * The response of the subrequest is taken, nothing is passed further.
+ */
+ngx_int_t
+ngx_http_ctpp2_fetch_body(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch,
+	ngx_chain_t *in)
+{
+	ngx_buf_t  *b;
+
+	for ( /* void */ ; in; in = in->next) {
+		b = in->buf;
+
+		if (r->headers_out.status == NGX_HTTP_OK && !fetch->failed
+		    && ngx_buf_in_memory(b) && b->last > b->pos)
+		{
+			if (ngx_http_ctpp2_fetch_append(r, fetch, b->pos, b->last - b->pos)
+			    != NGX_OK)
+			{
+				return NGX_ERROR;
+			}
+		}
+
+		b->pos = b->last;
+		if (b->in_file) b->file_pos = b->file_last;
+
+		if (b->last_buf || b->last_in_chain) fetch->complete = 1;
+	}
+
+	return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_fetch_append(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch,
+	u_char *p, size_t size)
+{
+	size_t   len, used;
+	u_char  *n;
+
+	if ((size_t) (fetch->end - fetch->last) < size) {
+		len = fetch->last - fetch->start + size;
+		if (len > fetch->max_size) {
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"Response of \"%V\" exceeds %uz bytes", &fetch->uri, fetch->max_size);
+			fetch->failed = 1;
+			return NGX_OK;
+		}
+
+		len = ngx_max(len, (size_t) (fetch->end - fetch->start) * 2);
+		len = ngx_min(ngx_max(len, ngx_pagesize), fetch->max_size);
+
+		n = ngx_alloc(len, r->connection->log);
+		if (n == NULL) return NGX_ERROR;
+
+		used = fetch->last - fetch->start;
+
+		if (fetch->start) {
+			ngx_memcpy(n, fetch->start, used);
+			ngx_free(fetch->start);
+		}
+
+		fetch->start = n;
+		fetch->last = n + used;
+		fetch->end = n + len;
+	}
+
+	fetch->last = ngx_cpymem(fetch->last, p, size);
+
+	return NGX_OK;
+}
+
+
+/*
+ * The post_subrequest handler, it may be called a few times.
+ */
+static ngx_int_t
+ngx_http_ctpp2_fetch_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+	ngx_http_ctpp2_fetch_t *fetch = data;
+
+	if (fetch->done
+	    || rc == NGX_AGAIN
+	    || (rc == NGX_OK && r->headers_out.status == NGX_HTTP_OK
+	        && !fetch->complete && !fetch->failed))
+	{
+		return rc;
+	}
+
+	fetch->done = 1;
+
+	rc = fetch->handler(r, fetch, rc);
+
+#if defined nginx_version && nginx_version >= 1013001
+	if (r->background && fetch->ctx->waiting) {
+		/* nginx doesn't wake up the parent of background subrequests */
+		if (ngx_http_post_request(r->parent, NULL) != NGX_OK) return NGX_ERROR;
+	}
+#endif
+
+	return rc;
+}
+
+
+static void
+ngx_http_ctpp2_fetch_cleanup(void *data)
+{
+	ngx_http_ctpp2_fetch_t  *fetch = data;
+
+	if (fetch->start) ngx_free(fetch->start);
+}
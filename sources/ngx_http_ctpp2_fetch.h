@@ -0,0 +1,46 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_FETCH_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_FETCH_H_INCLUDED_
+
+
+#include "ngx_http_ctpp2_filter_module.h"
+
+
+/* called once the response has been received or the subrequest has failed */
+typedef ngx_int_t (*ngx_http_ctpp2_fetch_pt)(ngx_http_request_t *sr,
+	ngx_http_ctpp2_fetch_t *fetch, ngx_int_t rc);
+
+/* a response taken by the subrequest of "template_uri" or "ctpp2_data" */
+struct ngx_http_ctpp2_fetch_s {
+	ngx_http_request_t    *request;   /* the subrequest */
+	ngx_http_ctpp2_ctx_t  *ctx;       /* of the request waiting for the response */
+	ngx_str_t              uri;
+	size_t                 max_size;
+	ngx_http_ctpp2_fetch_pt  handler;
+	void                  *data;
+	u_char                *start;     /* response received */
+	u_char                *last;
+	u_char                *end;
+	unsigned               complete:1;
+	unsigned               done:1;
+	unsigned               failed:1;
+};
+
+
+ngx_http_ctpp2_fetch_t *ngx_http_ctpp2_fetch_create(ngx_http_request_t *r,
+	ngx_http_ctpp2_ctx_t *ctx, ngx_str_t *uri);
+ngx_int_t ngx_http_ctpp2_fetch(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch,
+	ngx_uint_t flags);
+ngx_table_elt_t *ngx_http_ctpp2_fetch_push(ngx_http_request_t *sr, char *key,
+	char *lowcase_key);
+ngx_int_t ngx_http_ctpp2_fetch_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_ctpp2_fetch_body(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch,
+	ngx_chain_t *in);
+
+
+#endif /* _NGX_HTTP_CTPP2_FETCH_H_INCLUDED_ */
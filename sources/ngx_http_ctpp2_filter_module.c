@@ -5,52 +5,127 @@
 
 
 #include "ngx_http_ctpp2_filter_module.h"
+#include "ngx_http_ctpp2_tmpl_cache.h"
+#include "ngx_http_ctpp2_render_cache.h"
+#include "ngx_http_ctpp2_status.h"
+#include "ngx_http_ctpp2_tmpl_uri.h"
+#include "ngx_http_ctpp2_data_uri.h"
 #include "ctpp2_process.h"
 
 #define NGX_HTTP_CTPP2_BUFFERED  0x80
 #define NGX_HTTP_CTPP2_TMPLS_HEADER  "x-template"
 
+/* output buffers cached by a worker, per buffer of a request */
+#define NGX_HTTP_CTPP2_OUTPUT_CACHED  32
+
+#define NGX_HTTP_CTPP2_VAR_TEMPLATE     0
+#define NGX_HTTP_CTPP2_VAR_PARSE_TIME   1
+#define NGX_HTTP_CTPP2_VAR_RENDER_TIME  2
+#define NGX_HTTP_CTPP2_VAR_VM_STEPS     3
+#define NGX_HTTP_CTPP2_VAR_DATA_SIZE    4
+#define NGX_HTTP_CTPP2_VAR_OUTPUT_SIZE  5
+
+struct ngx_http_ctpp2_output_s {
+	ngx_http_ctpp2_output_cache_t  *cache;
+	size_t                          size;
+	ngx_uint_t                      nbufs;
+	u_char                         *bufs[1];
+};
+
+#if (NGX_THREADS)
 
-typedef struct {
-	ngx_uint_t  args;
-	ngx_uint_t  code;
-	ngx_uint_t  funcs;
-	ngx_uint_t  steps;
-} ngx_http_ctpp2_main_conf_t;
+/* output buffer rendered by a thread, the data follow */
+struct ngx_http_ctpp2_block_s {
+	ngx_http_ctpp2_block_t  *next;
+	ngx_chain_t              chain;
+	ngx_buf_t                buf;
+};
 
-typedef struct {
-	ngx_flag_t  enable;
-	size_t      buffer_size;
-	ngx_str_t   tmpls_header;
-	ngx_flag_t  tmpls_check;
-	ngx_http_complex_value_t  *tmpl;
-	ngx_http_complex_value_t  *tmpls_root;
-	ngx_buf_t  *tmpl_cache;
-} ngx_http_ctpp2_loc_conf_t;
+#endif
 
 static ngx_int_t ngx_http_ctpp2_header_filter(ngx_http_request_t *r);
 static ngx_str_t *ngx_http_ctpp2_get_tmpl_header(ngx_http_request_t *r, ngx_str_t *name);
 
 static ngx_int_t ngx_http_ctpp2_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
 static ngx_int_t ngx_http_ctpp2_fillbuffer(ngx_buf_t *buf, ngx_chain_t **in);
+static ngx_int_t ngx_http_ctpp2_filldata(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_chain_t **in);
+static ngx_int_t ngx_http_ctpp2_join_data(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+static ngx_int_t ngx_http_ctpp2_start(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf);
+static void ngx_http_ctpp2_data_overflow(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+static void ngx_http_ctpp2_content_type(ngx_http_request_t *r, ngx_http_ctpp2_loc_conf_t *conf);
+static size_t ngx_http_ctpp2_data_estimate(ngx_http_ctpp2_loc_conf_t *conf);
+static void ngx_http_ctpp2_data_update(ngx_http_ctpp2_loc_conf_t *conf, size_t size);
+static ngx_int_t ngx_http_ctpp2_parse(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_chain_t *in);
+static ngx_int_t ngx_http_ctpp2_decode(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf);
+static ngx_int_t ngx_http_ctpp2_render(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf);
+static void ngx_http_ctpp2_slice_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_ctpp2_send(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf);
+static ngx_int_t ngx_http_ctpp2_flush(void *data, ngx_chain_t *out);
+static ngx_int_t ngx_http_ctpp2_output_blocked(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_chain_t *out);
+static ngx_chain_t *ngx_http_ctpp2_output_alloc(void *data);
+static ngx_int_t ngx_http_ctpp2_variable(void *data, ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_ctpp2_stat_variable(ngx_http_request_t *r,
+	ngx_http_variable_value_t *v, uintptr_t data);
+static void ngx_http_ctpp2_output_cleanup(void *data);
+
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_ctpp2_thread_post(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf);
+static void ngx_http_ctpp2_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_ctpp2_thread_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_ctpp2_thread_output(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+static ngx_chain_t *ngx_http_ctpp2_thread_alloc(void *data);
+static void ngx_http_ctpp2_thread_cleanup(void *data);
+#endif
 
 static void *ngx_http_ctpp2_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_ctpp2_init_main_conf(ngx_conf_t *cf, void *conf);
+static char *ngx_http_ctpp2_preload(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_ctpp2_init_process(ngx_cycle_t *cycle);
+static void ngx_http_ctpp2_exit_process(ngx_cycle_t *cycle);
 
 static char *ngx_http_set_notcompiled_cv_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_ctpp2_set_template(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ctpp2_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ctpp2_global_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static void *ngx_http_ctpp2_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_ctpp2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
-static ngx_int_t ngx_http_ctpp2_load_tmpl(ngx_conf_t *cf, u_char *path, ngx_buf_t *buffer);
+static ngx_int_t ngx_http_ctpp2_load_tmpl(ngx_conf_t *cf, u_char *path, ngx_buf_t *buffer,
+	ngx_flag_t map);
+static ngx_int_t ngx_http_ctpp2_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_ctpp2_filter_init(ngx_conf_t *cf);
 
+static ngx_int_t ngx_http_ctpp2_join_path(ngx_str_t *dir, ngx_str_t *name, ngx_str_t *path,
+	ngx_pool_t *pool);
 static ngx_int_t ngx_strprepend_nulled(ngx_str_t *what, ngx_str_t *to, ngx_pool_t *pool);
 static ngx_int_t ngx_strterminate(ngx_str_t *str, ngx_pool_t *pool);
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
+static ngx_conf_enum_t  ngx_http_ctpp2_data_formats[] = {
+	{ ngx_string("application/msgpack"),      CTPP2_DATA_MSGPACK },
+	{ ngx_string("application/x-msgpack"),    CTPP2_DATA_MSGPACK },
+	{ ngx_string("application/vnd.msgpack"),  CTPP2_DATA_MSGPACK },
+	{ ngx_string("application/cbor"),         CTPP2_DATA_CBOR },
+	{ ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_ctpp2_json_parsers[] = {
+	{ ngx_string("classic"),      NGX_HTTP_CTPP2_JSON_CLASSIC },
+	{ ngx_string("incremental"),  NGX_HTTP_CTPP2_JSON_INCREMENTAL },
+	{ ngx_string("simd"),         NGX_HTTP_CTPP2_JSON_SIMD },
+	{ ngx_null_string, 0 }
+};
+
 static ngx_command_t  ngx_http_ctpp2_filter_commands[] = {
 	{
 		ngx_string("ctpp2"),
@@ -70,6 +145,78 @@ static ngx_command_t  ngx_http_ctpp2_filter_commands[] = {
 		offsetof(ngx_http_ctpp2_loc_conf_t, buffer_size),
 		NULL
 	},
+	{
+		ngx_string("ctpp2_max_data_size"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, max_data_size),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_json_parser"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_TAKE1,
+		ngx_conf_set_enum_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, json_parser),
+		&ngx_http_ctpp2_json_parsers
+	},
+	{
+		ngx_string("ctpp2_json_utf8"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, json_utf8),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_output_buffers"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_TAKE2,
+		ngx_conf_set_bufs_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, output_bufs),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_render_cache"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_1MORE,
+		ngx_http_ctpp2_render_cache,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_thread_pool"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_TAKE1,
+		ngx_http_ctpp2_thread_pool,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_global_data"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_TAKE1,
+		ngx_http_ctpp2_global_data,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_content_type"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, content_type),
+		NULL
+	},
 	{
 		ngx_string("ctpp2_args_stack"),
 		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
@@ -102,6 +249,87 @@ static ngx_command_t  ngx_http_ctpp2_filter_commands[] = {
 		offsetof(ngx_http_ctpp2_main_conf_t, steps),
 		NULL
 	},
+	{
+		ngx_string("ctpp2_slice_steps"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_main_conf_t, slice_steps),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_fragment_cache"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_main_conf_t, fragment_cache),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_template_cache"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_http_ctpp2_tmpl_cache_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_template_worker_cache"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_main_conf_t, tmpl_local_size),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_template_watch"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_main_conf_t, tmpl_watch),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_preload"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+		ngx_http_ctpp2_preload,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_template_uri_cache"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_main_conf_t, tmpl_uri_size),
+		NULL
+	},
+	{
+		ngx_string("ctpp2_status_zone"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+		ngx_http_ctpp2_status_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_status"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+		ngx_http_ctpp2_status,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_stream"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, stream),
+		NULL
+	},
 	{
 		ngx_string("templates_check"),
 		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
@@ -111,6 +339,15 @@ static ngx_command_t  ngx_http_ctpp2_filter_commands[] = {
 		offsetof(ngx_http_ctpp2_loc_conf_t, tmpls_check),
 		NULL
 	},
+	{
+		ngx_string("templates_mmap"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+		                  |NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, tmpls_mmap),
+		NULL
+	},
 	{
 		ngx_string("templates_root"),
 		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
@@ -138,12 +375,57 @@ static ngx_command_t  ngx_http_ctpp2_filter_commands[] = {
 		0,
 		NULL
 	},
+	{
+		ngx_string("template_uri"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+		                  |NGX_CONF_TAKE12,
+		ngx_http_ctpp2_tmpl_uri,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_data"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+		                  |NGX_CONF_TAKE2,
+		ngx_http_ctpp2_data_uri,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("ctpp2_data_timeout"),
+		NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_ctpp2_loc_conf_t, data_timeout),
+		NULL
+	},
 	ngx_null_command
 };
 
 
+static ngx_http_variable_t  ngx_http_ctpp2_vars[] = {
+	{ ngx_string("ctpp2_render_cache_status"), NULL,
+	  ngx_http_ctpp2_render_cache_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_string("ctpp2_template"), NULL,
+	  ngx_http_ctpp2_stat_variable, NGX_HTTP_CTPP2_VAR_TEMPLATE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_string("ctpp2_parse_time"), NULL,
+	  ngx_http_ctpp2_stat_variable, NGX_HTTP_CTPP2_VAR_PARSE_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_string("ctpp2_render_time"), NULL,
+	  ngx_http_ctpp2_stat_variable, NGX_HTTP_CTPP2_VAR_RENDER_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_string("ctpp2_vm_steps"), NULL,
+	  ngx_http_ctpp2_stat_variable, NGX_HTTP_CTPP2_VAR_VM_STEPS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_string("ctpp2_data_size"), NULL,
+	  ngx_http_ctpp2_stat_variable, NGX_HTTP_CTPP2_VAR_DATA_SIZE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_string("ctpp2_output_size"), NULL,
+	  ngx_http_ctpp2_stat_variable, NGX_HTTP_CTPP2_VAR_OUTPUT_SIZE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+	{ ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
 static ngx_http_module_t  ngx_http_ctpp2_filter_module_ctx = {
-	NULL,                                  /* preconfiguration */
+	ngx_http_ctpp2_add_variables,          /* preconfiguration */
 	ngx_http_ctpp2_filter_init,            /* postconfiguration */
 
 	ngx_http_ctpp2_create_main_conf,       /* create main configuration */
@@ -164,10 +446,10 @@ ngx_module_t  ngx_http_ctpp2_filter_module = {
 	NGX_HTTP_MODULE,                       /* module type */
 	NULL,                                  /* init master */
 	NULL,                                  /* init module */
-	NULL,                                  /* init process */
+	ngx_http_ctpp2_init_process,           /* init process */
 	NULL,                                  /* init thread */
 	NULL,                                  /* exit thread */
-	NULL,                                  /* exit process */
+	ngx_http_ctpp2_exit_process,           /* exit process */
 	NULL,                                  /* exit master */
 	NGX_MODULE_V1_PADDING
 };
@@ -177,16 +459,26 @@ static ngx_int_t
 ngx_http_ctpp2_header_filter(ngx_http_request_t *r)
 {
 	ngx_http_ctpp2_loc_conf_t  *conf;
+	ngx_http_ctpp2_main_conf_t *mcf;
 	ngx_http_ctpp2_ctx_t       *ctx;
 	ngx_str_t                   root, *tmpl;
 	off_t                       len;
+	ngx_int_t                   rc;
 
+	rc = ngx_http_ctpp2_fetch_header(r);
+	if (rc != NGX_DECLINED) {
+		/* the subrequest of "template_uri" or "ctpp2_data" */
+		return (rc == NGX_OK) ? ngx_http_next_header_filter(r) : NGX_ERROR;
+	}
+	
 	if (r->headers_out.status == NGX_HTTP_NOT_MODIFIED) {
 		return ngx_http_next_header_filter(r);
 	}
 	
-	if (ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module)) {
-		ngx_http_set_ctx(r, NULL, ngx_http_ctpp2_filter_module);
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	if (ctx) {
+		/* the ctx is kept for variables */
+		ctx->done = 1;
 		return ngx_http_next_header_filter(r);
 	}
 	
@@ -195,15 +487,26 @@ ngx_http_ctpp2_header_filter(ngx_http_request_t *r)
 	
 	tmpl = ngx_http_ctpp2_get_tmpl_header(r, &conf->tmpls_header);
 	if (tmpl == NULL) {
-		if (conf->tmpl == NULL) return ngx_http_next_header_filter(r);
+		if (conf->tmpl == NULL && conf->tmpl_uri == NULL) {
+			return ngx_http_next_header_filter(r);
+		}
 		
 		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_ctpp2_ctx_t));
 		if (ctx == NULL) return NGX_ERROR;
-		if (conf->tmpl_cache == NULL) {
+		if (conf->tmpl_uri) {
+			tmpl = &ctx->tmpl_path;
+			if (ngx_http_complex_value(r, conf->tmpl_uri, tmpl) != NGX_OK) {
+				return NGX_ERROR;
+			}
+			if (tmpl->len && tmpl->data[tmpl->len - 1] == '\0') tmpl->len--;
+			
+			if (ngx_http_ctpp2_tmpl_uri_fetch(r, ctx) != NGX_OK) return NGX_ERROR;
+		} else if (conf->tmpl_cache == NULL) {
 			tmpl = &ctx->tmpl_path;
 			if (ngx_http_complex_value(r, conf->tmpl, tmpl) != NGX_OK) {
 				return NGX_ERROR;
 			}
+			if (tmpl->len && tmpl->data[tmpl->len - 1] == '\0') tmpl->len--;
 		} else {
 			tmpl = &conf->tmpl->value;
 			ctx->tmpl = conf->tmpl_cache;
@@ -222,24 +525,59 @@ ngx_http_ctpp2_header_filter(ngx_http_request_t *r)
 		if (ctx == NULL) return NGX_ERROR;
 		ctx->tmpl_path = *tmpl;
 	}
+	
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_ctpp2_filter_module);
+	if (ctx->tmpl == NULL && ctx->fetch == NULL && mcf->tmpl_local) {
+		switch (ngx_http_ctpp2_tmpl_local_get(r, mcf->tmpl_local, ctx)) {
+			case NGX_OK:
+				if (ngx_http_ctpp2_tmpl_cached(r, ctx) != NGX_OK) return NGX_ERROR;
+				break;
+			case NGX_DECLINED: break;
+			default: return NGX_ERROR;
+		}
+	}
+	
 	ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
 		"http ctpp2: Template \"%s\" will be processed", tmpl->data);
 	
+	r->main_filter_need_in_memory = 1;
+	ngx_http_set_ctx(r, ctx, ngx_http_ctpp2_filter_module);
+	
+	if (conf->data_uris) {
+		if (ngx_http_ctpp2_data_uri_fetch(r, ctx) != NGX_OK) return NGX_ERROR;
+	}
+	
+	ctx->data_last = &ctx->data_chain;
+	
 	len = r->headers_out.content_length_n;
 	if (len == -1) {
-		ngx_log_debug0(NGX_LOG_NOTICE, r->connection->log, 0,
-			"Missing Content-Length header causes allocating default buffer size");
-		len = conf->buffer_size;
+		ctx->data_limit = conf->max_data_size;
+		len = ngx_http_ctpp2_data_estimate(conf);
+	} else {
+		ctx->data_limit = len;
+		ctx->data_length = 1;
+	}
+	
+	ctx->data_format = ngx_http_ctpp2_data_format(r);
+	
+	if (ctx->data_format != CTPP2_DATA_JSON) {
+		/* the type of data isn't one of the output, unlike the ones taken for JSON */
+		ngx_http_ctpp2_content_type(r, conf);
+	}
+	
+	if (ctx->data_format == CTPP2_DATA_JSON
+	    && conf->json_parser != NGX_HTTP_CTPP2_JSON_CLASSIC
+	    && conf->render_cache == NULL)
+	{
+		/* data are parsed right from the incoming buffers */
+		return NGX_OK;
 	}
 	
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-		"http ctpp2: Allocating %d bytes for data buffer", len);
+		"http ctpp2: Allocating %O bytes for data buffer", len);
 	ctx->data = ngx_create_temp_buf(r->pool, len);
 	if (ctx->data == NULL) return NGX_ERROR;
 	
-	r->main_filter_need_in_memory = 1;
-	ngx_http_set_ctx(r, ctx, ngx_http_ctpp2_filter_module);
-	
 	return NGX_OK;
 }
 
@@ -274,23 +612,97 @@ ngx_http_ctpp2_get_tmpl_header(ngx_http_request_t *r, ngx_str_t *name)
 }
 
 
+ngx_uint_t
+ngx_http_ctpp2_data_format(ngx_http_request_t *r)
+{
+	ngx_str_t        *type;
+	ngx_conf_enum_t  *f;
+	size_t            len;
+	
+	type = &r->headers_out.content_type;
+	
+	for (len = 0; len < type->len; len++) {
+		if (type->data[len] == ';' || type->data[len] == ' ') break;
+	}
+	
+	for (f = ngx_http_ctpp2_data_formats; f->name.len; f++) {
+		if (f->name.len == len && ngx_strncasecmp(f->name.data, type->data, len) == 0) {
+			return f->value;
+		}
+	}
+	
+	return CTPP2_DATA_JSON;
+}
+
+
+/*
+ * Sets "ctpp2_content_type" of the output, "default_type" if not set.
+ */
+static void
+ngx_http_ctpp2_content_type(ngx_http_request_t *r, ngx_http_ctpp2_loc_conf_t *conf)
+{
+	ngx_http_core_loc_conf_t  *clcf;
+	ngx_str_t                 *type;
+	
+	type = &conf->content_type;
+	
+	if (type->len == 0) {
+		clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+		type = &clcf->default_type;
+	}
+	
+	r->headers_out.content_type = *type;
+	r->headers_out.content_type_len = type->len;
+	r->headers_out.content_type_lowcase = NULL;
+	r->headers_out.content_type_hash = 0;
+	r->headers_out.charset.len = 0;
+}
+
+
 static ngx_int_t
 ngx_http_ctpp2_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
+	ngx_http_ctpp2_loc_conf_t  *conf;
 	ngx_http_ctpp2_ctx_t       *ctx;
-	ngx_int_t                   rc;
 	ngx_log_t                  *log;
-	ngx_http_ctpp2_loc_conf_t  *conf;
-	ngx_buf_t                  *b;
-	ngx_chain_t                *out;
-	size_t                      out_size;
+	ngx_int_t                   rc;
 	
-	if (in == NULL) {
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	if (ctx == NULL || ctx->done) {
 		return ngx_http_next_body_filter(r, in);
 	}
 	
-	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
-	if (ctx == NULL) {
+	if (ctx->fetch && ctx->fetch->request == r) {
+		/* the subrequest of "template_uri" or "ctpp2_data" */
+		return ngx_http_ctpp2_fetch_body(r, ctx->fetch, in);
+	}
+	
+#if (NGX_THREADS)
+	if (ctx->thread_task) {
+		return ngx_http_ctpp2_thread_output(r, ctx);
+	}
+#endif
+	
+	if (ctx->render.vm) {
+		if (ctx->render.blocked) {
+			/* woken up by the writer, the output may have been drained */
+			rc = ngx_http_ctpp2_output_blocked(r, ctx, NULL);
+			if (rc != NGX_OK) return rc;
+			
+			ctx->render.blocked = 0;
+		}
+		
+		return ngx_http_ctpp2_render(r, ctx,
+			ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module));
+	}
+	
+	if (ctx->waiting) {
+		/* woken up after a subrequest or by "ctpp2_data_timeout" */
+		return ngx_http_ctpp2_start(r, ctx,
+			ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module));
+	}
+	
+	if (in == NULL) {
 		return ngx_http_next_body_filter(r, in);
 	}
 	
@@ -298,7 +710,7 @@ ngx_http_ctpp2_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "http ctpp2 filter");
 
 
-	if (!ctx->template_ready) {
+	if (!ctx->template_ready && ctx->fetch == NULL) {
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
 			"http ctpp2: Filling template buffer");
 		switch (ngx_http_ctpp2_fillbuffer(ctx->tmpl, &in)) {
@@ -310,12 +722,10 @@ ngx_http_ctpp2_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 				return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
 					NGX_HTTP_INTERNAL_SERVER_ERROR);
 		}
-		ctx->template_ready = 1;
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
 			"http ctpp2: Template buffer filled");
 		
-		conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
-		if (ctpp2_tmpltest(ctx->tmpl, conf->tmpls_check, log) != NGX_OK) {
+		if (ngx_http_ctpp2_tmpl_loaded(r, ctx) != NGX_OK) {
 			return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
 				NGX_HTTP_INTERNAL_SERVER_ERROR);
 		}
@@ -324,55 +734,847 @@ ngx_http_ctpp2_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 	}
 
 
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
-		"http ctpp2: Filling data buffer");
-	switch (ngx_http_ctpp2_fillbuffer(ctx->data, &in)) {
-		case NGX_AGAIN: return NGX_OK;
-		case NGX_DONE: break;
-		default:
-			if (in == NULL) return NGX_OK;
-			b = in->buf;
-			if ((b->last_buf || b->last_in_chain) && b->pos == b->last) {
-				break;
-			}
-			ngx_log_error(NGX_LOG_ERR, log, 0,
-				"Data buffer overflow. You must set proper Content-Length header or, \
-increase size of \"ctpp2_data_buffer\" in nginx conf");
-			return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
-				NGX_HTTP_INTERNAL_SERVER_ERROR);
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	if (ctx->data == NULL) {
+		switch (ngx_http_ctpp2_parse(r, ctx, in)) {
+			case NGX_AGAIN: return NGX_OK;
+			case NGX_DONE: break;
+			default:
+				return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+					NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+		
+	} else {
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"http ctpp2: Filling data buffer");
+		switch (ngx_http_ctpp2_filldata(r, ctx, &in)) {
+			case NGX_AGAIN: return NGX_OK;
+			case NGX_DONE: break;
+			case NGX_DECLINED:
+				ngx_http_ctpp2_data_overflow(r, ctx);
+				/* fall through */
+			default:
+				return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+					NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"http ctpp2: Data buffer filled");
 	}
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
-		"http ctpp2: Data buffer filled");
+	
+	return ngx_http_ctpp2_start(r, ctx, conf);
+}
 
-	if (ctpp2_process(ctx->tmpl, ctx->data, r->pool, &out, &out_size, log) != NGX_DONE) {
+
+/*
+ * Renders the data received as soon as the template is there, it may be
+ * still fetched by the subrequest of "template_uri", and the branches of
+ * "ctpp2_data" are done.
+ */
+static ngx_int_t
+ngx_http_ctpp2_start(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf)
+{
+	ngx_int_t  rc;
+	
+	if ((!ctx->template_ready && ctx->fetch && !ctx->fetch->failed)
+	    || (ctx->branches && ctx->branches->pending && !ctx->branches->timedout))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http ctpp2: Waiting for subrequests");
+		ctx->waiting = 1;
+		r->buffered |= NGX_HTTP_CTPP2_BUFFERED;
+		return NGX_OK;
+	}
+	
+	if (ctx->waiting) {
+		ctx->waiting = 0;
+		r->buffered &= ~NGX_HTTP_CTPP2_BUFFERED;
+	}
+	
+	if (!ctx->template_ready) {
 		return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
 			NGX_HTTP_INTERNAL_SERVER_ERROR);
 	}
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
-		"http ctpp2: Templating done");
-
-	if (ctx->tmpl->temporary) ngx_pfree(r->pool, ctx->tmpl->start);
-	ngx_http_set_ctx(r, NULL, ngx_http_ctpp2_filter_module);
-
-
-	if (r == r->main) {
-		ngx_http_clear_accept_ranges(r);
-		r->headers_out.content_length_n = out_size;
-		if (r->headers_out.content_length) {
-			r->headers_out.content_length->hash = 0;
-			r->headers_out.content_length = NULL;
-		}
+	
+	if (ctx->data) {
+		if (conf->render_cache && ctx->branches) {
+			/* the key doesn't cover branches of "ctpp2_data" */
+			ctx->render_cache_status = NGX_HTTP_CTPP2_CACHE_BYPASS;
+			
+		} else if (conf->render_cache) {
+			rc = ngx_http_ctpp2_render_cache_get(r, ctx);
+			if (rc == NGX_OK) return ngx_http_ctpp2_send(r, ctx, conf);
+			if (rc == NGX_ERROR) {
+				return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+					NGX_HTTP_INTERNAL_SERVER_ERROR);
+			}
+		}
+		
+		if (ngx_http_ctpp2_decode(r, ctx, conf) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+				NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+	}
+	
+	if (ctx->branches) {
+		if (ngx_http_ctpp2_data_uri_merge(r, ctx) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+				NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+	}
+	
+	if (conf->global_data) {
+#if (NGX_THREADS)
+		rc = ctpp2_json_overlay(ctx->json, conf->global_data, conf->thread_pool != NULL,
+			r->connection->log);
+#else
+		rc = ctpp2_json_overlay(ctx->json, conf->global_data, 0, r->connection->log);
+#endif
+		if (rc != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+				NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+	}
+
+	ctx->render.pool = r->pool;
+	ctx->render.log = r->connection->log;
+	ctx->render.tag = (ngx_buf_tag_t) &ngx_http_ctpp2_filter_module;
+	ctx->render.alloc = ngx_http_ctpp2_output_alloc;
+	ctx->render.variable = ngx_http_ctpp2_variable;
+	ctx->render.data = r;
+	
+#if (NGX_THREADS)
+	if (conf->thread_pool) {
+		if (ngx_http_ctpp2_thread_post(r, ctx, conf) != NGX_OK) {
+			return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+				NGX_HTTP_INTERNAL_SERVER_ERROR);
+		}
+		return NGX_OK;
+	}
+#endif
+	
+	if (conf->stream) {
+		/* output size is unknown until the VM stops, send headers right now */
+		if (r == r->main) {
+			ngx_http_clear_accept_ranges(r);
+			ngx_http_clear_content_length(r);
+		}
+		
+		rc = ngx_http_next_header_filter(r);
+		if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return NGX_ERROR;
+		
+		ctx->render.flush = ngx_http_ctpp2_flush;
+	}
+	
+	return ngx_http_ctpp2_render(r, ctx, conf);
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_render(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf)
+{
+	ngx_int_t  rc;
+	
+	rc = ctpp2_process(ctx->tmpl, ctx->data, ctx->json, &ctx->render);
+	
+	if (rc == NGX_AGAIN) {
+		/* "ctpp2_slice_steps" are done, other requests are served meanwhile */
+		if (!(r->buffered & NGX_HTTP_CTPP2_BUFFERED)) {
+			ctx->slice.handler = ngx_http_ctpp2_slice_handler;
+			ctx->slice.data = r;
+			ctx->slice.log = r->connection->log;
+			r->buffered |= NGX_HTTP_CTPP2_BUFFERED;
+		}
+		
+		if (ctx->render.blocked) {
+			/* the client is slow, the render is resumed by the writer */
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"http ctpp2: Output blocked");
+			return NGX_AGAIN;
+		}
+		
+		ngx_post_event(&ctx->slice, &ngx_posted_events);
+		
+		r->main->blocked++;
+		r->aio = 1;
+		
+		return NGX_OK;
+	}
+	
+	r->buffered &= ~NGX_HTTP_CTPP2_BUFFERED;
+	
+	ngx_http_ctpp2_status_update(r, ctx, rc);
+	
+	if (rc != NGX_DONE) {
+		if (conf->stream) {
+			/* headers and probably a part of the body have been sent already */
+			return NGX_ERROR;
+		}
+		return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+			NGX_HTTP_INTERNAL_SERVER_ERROR);
+	}
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2: Templating done, %uz bytes", ctx->render.out_size);
+	
+	return ngx_http_ctpp2_send(r, ctx, conf);
+}
+
+
+static void
+ngx_http_ctpp2_slice_handler(ngx_event_t *ev)
+{
+	ngx_http_request_t  *r;
+	ngx_connection_t    *c;
+	
+	r = ev->data;
+	c = r->connection;
+	
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+		"http ctpp2 slice: \"%V?%V\"", &r->uri, &r->args);
+	
+	r->main->blocked--;
+	r->aio = 0;
+	
+	/* the render is resumed by the body filter called from the writer */
+	r->write_event_handler(r);
+	
+	ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * Sends the output rendered or taken from the render cache.
+ */
+static ngx_int_t
+ngx_http_ctpp2_send(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf)
+{
+	ngx_int_t     rc;
+	ngx_chain_t  *out;
+	
+	if (conf->render_cache && ctx->render.flush == NULL) {
+		(void) ngx_http_ctpp2_render_cache_put(r, ctx);
+	}
+	
+	if (ctx->tmpl->temporary) ngx_pfree(r->pool, ctx->tmpl->start);
+	ctx->done = 1;
+	out = ctx->render.out;
+
+
+	if (ctx->render.flush == NULL) {
+		if (r == r->main) {
+			ngx_http_clear_accept_ranges(r);
+			r->headers_out.content_length_n = ctx->render.out_size;
+			if (r->headers_out.content_length) {
+				r->headers_out.content_length->hash = 0;
+				r->headers_out.content_length = NULL;
+			}
+		}
+		
+		rc = ngx_http_next_header_filter(r);
+		if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return NGX_ERROR;
+	}
+
+	if (out) {
+		rc = ngx_http_next_body_filter(r, out);
+		if (rc == NGX_ERROR) return rc;
+	}
+
+	return ngx_http_send_special(r, NGX_HTTP_LAST);
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_parse(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx, ngx_chain_t *in)
+{
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	ngx_log_t                  *log;
+	ngx_buf_t                  *b;
+	ngx_int_t                   rc;
+	uint64_t                    start;
+	
+	log = r->connection->log;
+	
+	if (ctx->json == NULL) {
+		conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+		ctx->json = ctpp2_json_create(r->pool, conf->json_parser == NGX_HTTP_CTPP2_JSON_SIMD,
+			conf->json_utf8);
+		if (ctx->json == NULL) return NGX_ERROR;
+	}
+	
+	for ( /* void */ ; in; in = in->next) {
+		b = in->buf;
+		
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+			"http ctpp2: Parsing %uz bytes of data", (size_t) (b->last - b->pos));
+		
+		ctx->data_size += b->last - b->pos;
+		if ((off_t) ctx->data_size > ctx->data_limit) {
+			ngx_http_ctpp2_data_overflow(r, ctx);
+			return NGX_ERROR;
+		}
+		
+		start = ctpp2_time();
+		rc = ctpp2_json_parse(ctx->json, b->pos, b->last, log);
+		ctx->render.parse_time += ctpp2_time() - start;
+		
+		if (rc != NGX_OK) return NGX_ERROR;
+		b->pos = b->last;
+		
+		if (b->last_buf || b->last_in_chain) {
+			if (ctpp2_json_done(ctx->json, log) != NGX_OK) return NGX_ERROR;
+			if (r->headers_out.content_length_n == -1) {
+				conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+				ngx_http_ctpp2_data_update(conf, ctx->data_size);
+			}
+			return NGX_DONE;
+		}
+	}
+	
+	return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_decode(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf)
+{
+	ngx_log_t    *log;
+	ngx_chain_t  *cl;
+	ngx_int_t     rc;
+	uint64_t      start;
+	
+	log = r->connection->log;
+	
+	if (ctx->data_format != CTPP2_DATA_JSON) {
+		if (ngx_http_ctpp2_join_data(r, ctx) != NGX_OK) return NGX_ERROR;
+		
+		ctx->json = ctpp2_json_create(r->pool, 0, 0);
+		if (ctx->json == NULL) return NGX_ERROR;
+		
+		start = ctpp2_time();
+		rc = ctpp2_data_decode(ctx->json, ctx->data_format, ctx->data->pos,
+			ctx->data->last, log);
+		ctx->render.parse_time += ctpp2_time() - start;
+		
+		return rc;
+	}
+	
+	/* classic parser runs within ctpp2_process(), unless anything is added */
+	if (conf->json_parser == NGX_HTTP_CTPP2_JSON_CLASSIC
+	    && ctx->branches == NULL && conf->global_data == NULL)
+	{
+		if (ngx_http_ctpp2_join_data(r, ctx) != NGX_OK) return NGX_ERROR;
+		if (!conf->json_utf8) return NGX_OK;
+		
+		start = ctpp2_time();
+		rc = ctpp2_utf8_check(ctx->data->pos, ctx->data->last, log);
+		ctx->render.parse_time += ctpp2_time() - start;
+		
+		return rc;
+	}
+	
+	/* the data have been buffered for the render cache, or for additions */
+	ctx->json = ctpp2_json_create(r->pool, conf->json_parser == NGX_HTTP_CTPP2_JSON_SIMD,
+		conf->json_utf8);
+	if (ctx->json == NULL) return NGX_ERROR;
+	
+	start = ctpp2_time();
+	
+	if (ctx->data_chain) {
+		/* buffer by buffer, those but the last one are freed then */
+		rc = NGX_OK;
+		for (cl = ctx->data_chain; cl && rc == NGX_OK; cl = cl->next) {
+			rc = ctpp2_json_parse(ctx->json, cl->buf->pos, cl->buf->last, log);
+			if (cl->buf != ctx->data) ngx_pfree(r->pool, cl->buf->start);
+		}
+		ctx->data_chain = NULL;
+	} else {
+		rc = ctpp2_json_parse(ctx->json, ctx->data->pos, ctx->data->last, log);
+	}
+	
+	if (rc == NGX_OK) rc = ctpp2_json_done(ctx->json, log);
+	ctx->render.parse_time += ctpp2_time() - start;
+	
+	return rc;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_flush(void *data, ngx_chain_t *out)
+{
+	ngx_http_request_t    *r = data;
+	ngx_http_ctpp2_ctx_t  *ctx;
+	
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2: Flushing %uz bytes", (size_t) (out->buf->last - out->buf->pos));
+	
+	return ngx_http_ctpp2_output_blocked(r, ctx, out);
+}
+
+
+/*
+ * Passes the streamed output on, NGX_AGAIN if the client doesn't keep up and
+ * "ctpp2_output_buffers" are all busy, the render has to wait for the writer
+ * then instead of allocating more.
+ */
+static ngx_int_t
+ngx_http_ctpp2_output_blocked(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_chain_t *out)
+{
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	ngx_chain_t                *cl;
+	ngx_uint_t                  busy;
+	ngx_int_t                   rc;
+	
+	rc = ngx_http_next_body_filter(r, out);
+	
+#if defined nginx_version && nginx_version >= 1001004
+	ngx_chain_update_chains(r->pool, &ctx->render.free, &ctx->busy, &out, ctx->render.tag);
+#else
+	ngx_chain_update_chains(&ctx->render.free, &ctx->busy, &out, ctx->render.tag);
+#endif
+	
+	if (rc != NGX_AGAIN) {
+		return (rc == NGX_ERROR) ? NGX_ERROR : NGX_OK;
+	}
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	
+	busy = 0;
+	for (cl = ctx->busy; cl; cl = cl->next) busy++;
+	
+	return (busy < (ngx_uint_t) conf->output_bufs.num) ? NGX_OK : NGX_AGAIN;
+}
+
+
+/*
+ * The first "number" buffers of a request are taken from the worker cache
+ * and returned there when the request is freed, the rest are allocated
+ * from the request pool.
+ */
+static ngx_chain_t *
+ngx_http_ctpp2_output_alloc(void *data)
+{
+	ngx_http_request_t             *r = data;
+	ngx_http_ctpp2_loc_conf_t      *conf;
+	ngx_http_ctpp2_ctx_t           *ctx;
+	ngx_http_ctpp2_output_t        *out;
+	ngx_http_ctpp2_output_cache_t  *cache;
+	ngx_pool_cleanup_t             *cln;
+	ngx_chain_t                    *cl;
+	ngx_buf_t                      *b;
+	u_char                         *p;
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	
+	out = ctx->output;
+	if (out == NULL) {
+		cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_ctpp2_output_t)
+			+ (conf->output_bufs.num - 1) * sizeof(u_char *));
+		if (cln == NULL) return NULL;
+		
+		out = cln->data;
+		out->cache = conf->output_cache;
+		out->size = conf->output_bufs.size;
+		out->nbufs = 0;
+		
+		cln->handler = ngx_http_ctpp2_output_cleanup;
+		ctx->output = out;
+	}
+	
+	cl = ngx_alloc_chain_link(r->pool);
+	if (cl == NULL) return NULL;
+	
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL) return NULL;
+	
+	if (out->nbufs < (ngx_uint_t) conf->output_bufs.num) {
+		cache = out->cache;
+		if (cache->free) {
+			p = cache->free;
+			cache->free = *(u_char **) p;
+			cache->nfree--;
+		} else {
+			p = ngx_alloc(out->size, r->connection->log);
+			if (p == NULL) return NULL;
+		}
+		out->bufs[out->nbufs++] = p;
+		
+	} else {
+		p = ngx_palloc(r->pool, out->size);
+		if (p == NULL) return NULL;
+	}
+	
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2: Output buffer %p, %uz bytes", p, out->size);
+	
+	b->start = p;
+	b->pos = p;
+	b->last = p;
+	b->end = p + out->size;
+	b->temporary = 1;
+	
+	cl->buf = b;
+	cl->next = NULL;
+	
+	return cl;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_variable(void *data, ngx_str_t *name, ngx_str_t *value)
+{
+	ngx_http_request_t         *r = data;
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	ngx_http_ctpp2_ctx_t       *ctx;
+	ngx_http_variable_value_t  *vv;
+	ngx_str_t                   lowcase;
+	ngx_uint_t                  key;
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	
+	if (conf->render_key == NULL && ctx->render_cache_status) {
+		/* the output depends on more than the data */
+		ctx->render_cache_status = NGX_HTTP_CTPP2_CACHE_BYPASS;
+	}
+	
+	lowcase.len = name->len;
+	lowcase.data = ngx_pnalloc(r->pool, name->len);
+	if (lowcase.data == NULL) return NGX_ERROR;
+	
+	key = ngx_hash_strlow(lowcase.data, name->data, name->len);
+	
+	vv = ngx_http_get_variable(r, &lowcase, key);
+	if (vv == NULL) {
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"NGINX_VAR(): unknown variable \"%V\"", name);
+		return NGX_DECLINED;
+	}
+	if (vv->not_found) return NGX_DECLINED;
+	
+	value->len = vv->len;
+	value->data = vv->data;
+	
+	return NGX_OK;
+}
+
+
+ngx_str_t *
+ngx_http_ctpp2_tmpl_name(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	
+	if (ctx->tmpl_path.len) return &ctx->tmpl_path;
+	
+	/* "template cached" */
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	
+	return &conf->tmpl->value;
+}
+
+
+/*
+ * Statistics of the render, times are in seconds with microsecond
+ * resolution.  Nothing is found until the template has been rendered.
+ */
+static ngx_int_t
+ngx_http_ctpp2_stat_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+	uintptr_t data)
+{
+	ngx_http_ctpp2_ctx_t       *ctx;
+	ngx_str_t                  *path;
+	uint64_t                    usec;
+	u_char                     *p;
+	
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	if (ctx == NULL || (!ctx->done && data != NGX_HTTP_CTPP2_VAR_TEMPLATE)) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+	
+	if (data == NGX_HTTP_CTPP2_VAR_TEMPLATE) {
+		path = ngx_http_ctpp2_tmpl_name(r, ctx);
+		
+		v->len = path->len;
+		v->data = path->data;
+		
+	} else {
+		p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 8);
+		if (p == NULL) return NGX_ERROR;
+		
+		switch (data) {
+			case NGX_HTTP_CTPP2_VAR_PARSE_TIME:
+			case NGX_HTTP_CTPP2_VAR_RENDER_TIME:
+				usec = (data == NGX_HTTP_CTPP2_VAR_PARSE_TIME) ? ctx->render.parse_time
+				                                               : ctx->render.render_time;
+				v->len = ngx_sprintf(p, "%uL.%06uL", usec / 1000000, usec % 1000000) - p;
+				break;
+			case NGX_HTTP_CTPP2_VAR_VM_STEPS:
+				v->len = ngx_sprintf(p, "%ui", ctx->render.steps) - p;
+				break;
+			case NGX_HTTP_CTPP2_VAR_DATA_SIZE:
+				v->len = ngx_sprintf(p, "%uz", ctx->data_size) - p;
+				break;
+			default: /* NGX_HTTP_CTPP2_VAR_OUTPUT_SIZE */
+				v->len = ngx_sprintf(p, "%uz", ctx->render.out_size) - p;
+		}
+		
+		v->data = p;
+	}
+	
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+	
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_output_cleanup(void *data)
+{
+	ngx_http_ctpp2_output_t        *out = data;
+	ngx_http_ctpp2_output_cache_t  *cache;
+	ngx_uint_t                      i;
+	
+	cache = out->cache;
+	
+	for (i = 0; i < out->nbufs; i++) {
+		if (cache->nfree >= cache->max) {
+			ngx_free(out->bufs[i]);
+			continue;
+		}
+		*(u_char **) out->bufs[i] = cache->free;
+		cache->free = out->bufs[i];
+		cache->nfree++;
+	}
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * The data are parsed and the template is executed in a thread of the pool,
+ * the same way "aio threads" reads files.  The render doesn't touch the
+ * request pool there, so streaming and NGINX_VAR() aren't available.
+ * Every thread has a VM of its own with its own "ctpp2_fragment_cache", so
+ * a worker may take that size times the number of threads in the pool in
+ * addition to its own cache.
+ */
+static ngx_int_t
+ngx_http_ctpp2_thread_post(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_http_ctpp2_loc_conf_t *conf)
+{
+	ngx_thread_task_t   *task;
+	ngx_pool_cleanup_t  *cln;
+	
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL) return NGX_ERROR;
+	cln->handler = ngx_http_ctpp2_thread_cleanup;
+	cln->data = ctx;
+	
+	task = ngx_thread_task_alloc(r->pool, 0);
+	if (task == NULL) return NGX_ERROR;
+	
+	task->ctx = ctx;
+	task->handler = ngx_http_ctpp2_thread_handler;
+	task->event.data = r;
+	task->event.handler = ngx_http_ctpp2_thread_event_handler;
+	
+	ctx->render.pool = NULL;
+	ctx->render.alloc = ngx_http_ctpp2_thread_alloc;
+	ctx->render.variable = NULL;
+	ctx->render.data = ctx;
+	ctx->thread_size = conf->output_bufs.size;
+	ctx->thread_rc = NGX_ERROR;
+	
+	if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK) return NGX_ERROR;
+	
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2: Rendering in thread task #%ui", task->id);
+	
+	ctx->thread_task = task;
+	ctx->rendering = 1;
+	
+	r->main->blocked++;
+	r->aio = 1;
+	r->buffered |= NGX_HTTP_CTPP2_BUFFERED;
+	
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_thread_handler(void *data, ngx_log_t *log)
+{
+	ngx_http_ctpp2_ctx_t  *ctx = data;
+	
+	ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "ctpp2 thread handler");
+	
+	/* the connection log isn't safe to use here */
+	ctx->render.log = log;
+	ctx->thread_rc = ctpp2_process(ctx->tmpl, ctx->data, ctx->json, &ctx->render);
+}
+
+
+static void
+ngx_http_ctpp2_thread_event_handler(ngx_event_t *ev)
+{
+	ngx_http_request_t    *r;
+	ngx_connection_t      *c;
+	ngx_http_ctpp2_ctx_t  *ctx;
+	
+	r = ev->data;
+	c = r->connection;
+	
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+		"http ctpp2 thread: \"%V?%V\"", &r->uri, &r->args);
+	
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	ctx->rendering = 0;
+	
+	r->main->blocked--;
+	r->aio = 0;
+	
+	/* the output is sent by the body filter called from the writer */
+	r->write_event_handler(r);
+	
+	ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_thread_output(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	
+	if (ctx->rendering) return NGX_AGAIN;
+	
+	r->buffered &= ~NGX_HTTP_CTPP2_BUFFERED;
+	ctx->thread_task = NULL;
+	ctx->render.log = r->connection->log;
+	
+	ngx_http_ctpp2_status_update(r, ctx, ctx->thread_rc);
+	
+	if (ctx->thread_rc != NGX_DONE) {
+		return ngx_http_filter_finalize_request(r, &ngx_http_ctpp2_filter_module,
+			NGX_HTTP_INTERNAL_SERVER_ERROR);
+	}
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2: Templating done in thread, %uz bytes", ctx->render.out_size);
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	
+	return ngx_http_ctpp2_send(r, ctx, conf);
+}
+
+
+/*
+ * Called within a thread, the buffers are freed with the request.
+ */
+static ngx_chain_t *
+ngx_http_ctpp2_thread_alloc(void *data)
+{
+	ngx_http_ctpp2_ctx_t    *ctx = data;
+	ngx_http_ctpp2_block_t  *block;
+	u_char                  *p;
+	
+	block = ngx_alloc(sizeof(ngx_http_ctpp2_block_t) + ctx->thread_size, ctx->render.log);
+	if (block == NULL) return NULL;
+	
+	p = (u_char *) block + sizeof(ngx_http_ctpp2_block_t);
+	
+	ngx_memzero(&block->buf, sizeof(ngx_buf_t));
+	block->buf.start = p;
+	block->buf.pos = p;
+	block->buf.last = p;
+	block->buf.end = p + ctx->thread_size;
+	block->buf.temporary = 1;
+	
+	block->chain.buf = &block->buf;
+	block->chain.next = NULL;
+	
+	block->next = ctx->thread_blocks;
+	ctx->thread_blocks = block;
+	
+	return &block->chain;
+}
+
+
+static void
+ngx_http_ctpp2_thread_cleanup(void *data)
+{
+	ngx_http_ctpp2_ctx_t    *ctx = data;
+	ngx_http_ctpp2_block_t  *block, *next;
+	
+	for (block = ctx->thread_blocks; block; block = next) {
+		next = block->next;
+		ngx_free(block);
+	}
+}
+
+#endif
+
+
+ngx_int_t
+ngx_http_ctpp2_tmpl_loaded(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t   *conf;
+	ngx_http_ctpp2_main_conf_t  *mcf;
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	if (ngx_http_ctpp2_tmpl_memo_test(ctx, conf->tmpls_check) != NGX_OK) {
+		if (ctpp2_tmpltest(ctx->tmpl, conf->tmpls_check, r->connection->log) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		ngx_http_ctpp2_tmpl_memo_add(ctx, conf->tmpls_check, r->connection->log);
+	}
+	ctx->tmpl_checked = conf->tmpls_check ? 1 : 0;
+	ctx->template_ready = 1;
+	
+	/* a file written this second may yet be rewritten keeping inode, mtime and size */
+	if (conf->tmpl_uri == NULL && ctx->tmpl_mtime >= ngx_time()) return NGX_OK;
+	
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_ctpp2_filter_module);
+	if (mcf->tmpl_cache) {
+		(void) ngx_http_ctpp2_tmpl_cache_put(r, mcf->tmpl_cache, ctx);
 	}
+	if (mcf->tmpl_local) {
+		(void) ngx_http_ctpp2_tmpl_local_put(r, mcf->tmpl_local, ctx);
+	}
+	
+	return NGX_OK;
+}
 
-	rc = ngx_http_next_header_filter(r);
-	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return NGX_ERROR;
 
-	if (out) {
-		rc = ngx_http_next_body_filter(r, out);
-		if (rc == NGX_ERROR) return rc;
+/*
+ * A template found in a cache has been tested when it was stored, but maybe
+ * without CRC check, which is done now if this location wants it.
+ */
+ngx_int_t
+ngx_http_ctpp2_tmpl_cached(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t  *conf;
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	if (conf->tmpls_check && !ctx->tmpl_checked) {
+		if (ngx_http_ctpp2_tmpl_memo_test(ctx, 1) != NGX_OK) {
+			if (ctpp2_tmpltest(ctx->tmpl, 1, r->connection->log) != NGX_OK) {
+				return NGX_ERROR;
+			}
+			ngx_http_ctpp2_tmpl_memo_add(ctx, 1, r->connection->log);
+		}
+		ctx->tmpl_checked = 1;
 	}
-
-	return ngx_http_send_special(r, NGX_HTTP_LAST);
+	ctx->template_ready = 1;
+	
+	return NGX_OK;
 }
 
 
@@ -424,6 +1626,153 @@ ngx_http_ctpp2_fillbuffer(ngx_buf_t *buf, ngx_chain_t **in)
 }
 
 
+/*
+ * Returns NGX_DECLINED if data don't fit into the limit.
+ */
+static ngx_int_t
+ngx_http_ctpp2_filldata(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx, ngx_chain_t **in)
+{
+	ngx_chain_t  *cl;
+	ngx_buf_t    *b;
+	ngx_int_t     rc;
+	size_t        size;
+	
+	for ( ;; ) {
+		rc = ngx_http_ctpp2_fillbuffer(ctx->data, in);
+		if (rc == NGX_DONE) break;
+		if (rc != NGX_OK) return rc;
+		
+		/* the buffer is full */
+		
+		if (*in == NULL) return NGX_AGAIN;
+		b = (*in)->buf;
+		if ((b->last_buf || b->last_in_chain) && b->pos == b->last) break;
+		
+		size = ctx->data_size + (ctx->data->last - ctx->data->pos);
+		if ((off_t) size >= ctx->data_limit) return NGX_DECLINED;
+		
+		cl = ngx_alloc_chain_link(r->pool);
+		if (cl == NULL) return NGX_ERROR;
+		cl->buf = ctx->data;
+		cl->next = NULL;
+		*ctx->data_last = cl;
+		ctx->data_last = &cl->next;
+		ctx->data_size = size;
+		
+		/* the size of data is doubled with every new buffer */
+		size = ngx_min(ngx_max(size, ngx_pagesize), (size_t) ctx->data_limit - size);
+		
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http ctpp2: Allocating %uz more bytes for data", size);
+		ctx->data = ngx_create_temp_buf(r->pool, size);
+		if (ctx->data == NULL) return NGX_ERROR;
+	}
+	
+	if (r->headers_out.content_length_n == -1) {
+		ngx_http_ctpp2_data_update(ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module),
+			ctx->data_size + (ctx->data->last - ctx->data->pos));
+	}
+	
+	if (ctx->data_chain) {
+		/* the chain is joined only if data are wanted in one piece */
+		cl = ngx_alloc_chain_link(r->pool);
+		if (cl == NULL) return NGX_ERROR;
+		cl->buf = ctx->data;
+		cl->next = NULL;
+		*ctx->data_last = cl;
+		ctx->data_last = &cl->next;
+	}
+	
+	ctx->data_size += ctx->data->last - ctx->data->pos;
+	
+	return NGX_DONE;
+}
+
+
+/*
+ * Classic JSON parser and decoders of other formats need data in one piece,
+ * buffers of the chain are freed as soon as they are copied.
+ */
+static ngx_int_t
+ngx_http_ctpp2_join_data(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_chain_t  *cl;
+	ngx_buf_t    *b;
+	
+	if (ctx->data_chain == NULL) return NGX_OK;
+	
+	b = ngx_create_temp_buf(r->pool, ctx->data_size);
+	if (b == NULL) return NGX_ERROR;
+	
+	for (cl = ctx->data_chain; cl; cl = cl->next) {
+		b->last = ngx_cpymem(b->last, cl->buf->pos, cl->buf->last - cl->buf->pos);
+		ngx_pfree(r->pool, cl->buf->start);
+	}
+	
+	ctx->data = b;
+	ctx->data_chain = NULL;
+	
+	return NGX_OK;
+}
+
+
+/*
+ * Tells which of the limits the data have exceeded.
+ */
+static void
+ngx_http_ctpp2_data_overflow(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	if (ctx->data_length) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"Data buffer overflow. Data size exceeds %O bytes of Content-Length header",
+			ctx->data_limit);
+	} else {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"Data buffer overflow. Data size exceeds %O bytes of \"ctpp2_max_data_size\", \
+you must set proper Content-Length header or increase it in nginx conf", ctx->data_limit);
+	}
+}
+
+
+static size_t
+ngx_http_ctpp2_data_estimate(ngx_http_ctpp2_loc_conf_t *conf)
+{
+	size_t  size;
+	
+	if (conf->data_est->avg == 0) {
+		size = conf->buffer_size;
+	} else {
+		/* most of data should fit */
+		size = conf->data_est->avg + 2 * conf->data_est->dev;
+		size = ngx_align(size, ngx_pagesize);
+	}
+	
+	return ngx_min(size, conf->max_data_size);
+}
+
+
+static void
+ngx_http_ctpp2_data_update(ngx_http_ctpp2_loc_conf_t *conf, size_t size)
+{
+	ngx_http_ctpp2_data_est_t  *est;
+	size_t                      dev;
+	
+	est = conf->data_est;
+	
+	if (est->avg == 0) {
+		est->avg = size;
+		est->dev = size / 2;
+		return;
+	}
+	
+	/* the same smoothing as for TCP RTT: 1/8 for average, 1/4 for deviation */
+	
+	dev = (size > est->avg) ? size - est->avg : est->avg - size;
+	est->dev = est->dev - est->dev / 4 + dev / 4;
+	est->avg = est->avg - est->avg / 8 + size / 8;
+}
+
+
 static void *
 ngx_http_ctpp2_create_main_conf(ngx_conf_t *cf)
 {
@@ -436,6 +1785,11 @@ ngx_http_ctpp2_create_main_conf(ngx_conf_t *cf)
 	mcf->code  = NGX_CONF_UNSET_UINT;
 	mcf->funcs = NGX_CONF_UNSET_UINT;
 	mcf->steps = NGX_CONF_UNSET_UINT;
+	mcf->slice_steps = NGX_CONF_UNSET_UINT;
+	mcf->fragment_cache = NGX_CONF_UNSET_SIZE;
+	mcf->tmpl_local_size = NGX_CONF_UNSET_SIZE;
+	mcf->tmpl_watch = NGX_CONF_UNSET;
+	mcf->tmpl_uri_size = NGX_CONF_UNSET_SIZE;
 
 	return mcf;
 }
@@ -462,10 +1816,190 @@ ngx_http_ctpp2_init_main_conf(ngx_conf_t *cf, void *conf)
 		mcf->steps = 10240;
 	}
 	
+	if (mcf->slice_steps == NGX_CONF_UNSET_UINT) {
+		mcf->slice_steps = 0;
+	}
+	
+	ngx_conf_init_size_value(mcf->fragment_cache, 0);
+	
+	ngx_conf_init_size_value(mcf->tmpl_local_size, 0);
+	if (mcf->tmpl_local_size) {
+		mcf->tmpl_local = ngx_http_ctpp2_tmpl_local_create(cf, mcf->tmpl_local_size);
+		if (mcf->tmpl_local == NULL) return NGX_CONF_ERROR;
+	}
+	
+	ngx_conf_init_size_value(mcf->tmpl_uri_size, 16 * 1024 * 1024);
+	mcf->tmpl_uri_cache = ngx_http_ctpp2_tmpl_uri_create(cf, mcf->tmpl_uri_size);
+	if (mcf->tmpl_uri_cache == NULL) return NGX_CONF_ERROR;
+	
+	ngx_conf_init_value(mcf->tmpl_watch, 0);
+	if (mcf->tmpl_watch) {
+#if (NGX_HAVE_INOTIFY)
+		if (mcf->tmpl_local == NULL) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"\"ctpp2_template_watch\" requires \"ctpp2_template_worker_cache\"");
+			return NGX_CONF_ERROR;
+		}
+#else
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"ctpp2_template_watch\" is unsupported on this platform");
+		return NGX_CONF_ERROR;
+#endif
+	}
+	
+	if (mcf->status_used && mcf->status_zone == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"ctpp2_status\" requires \"ctpp2_status_zone\"");
+		return NGX_CONF_ERROR;
+	}
+	
+	if (mcf->preload && mcf->tmpl_local == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"ctpp2_preload\" requires \"ctpp2_template_worker_cache\"");
+		return NGX_CONF_ERROR;
+	}
+	
+	return NGX_CONF_OK;
+}
+
+
+/*
+ * Patterns are relative to "templates_root" of the http block, a directory
+ * stands for all "*.ct2" files in it.
+ */
+static char *
+ngx_http_ctpp2_preload(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_main_conf_t *mcf = conf;
+	
+	ngx_http_ctpp2_loc_conf_t  *lcf;
+	ngx_str_t                  *value, *pattern, root, dir;
+	ngx_file_info_t             fi;
+	ngx_uint_t                  i;
+	
+	static ngx_str_t  all = ngx_string("*.ct2");
+	
+	if (mcf->preload == NULL) {
+		mcf->preload = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_str_t));
+		if (mcf->preload == NULL) return NGX_CONF_ERROR;
+	}
+	
+	lcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_ctpp2_filter_module);
+	if (lcf->tmpls_root) {
+		root = lcf->tmpls_root->value;
+		if (ngx_http_script_variables_count(&root) > 0) {
+			return "can't be used with variables in \"templates_root\"";
+		}
+	} else {
+		ngx_str_set(&root, NGX_CTPP2_TMPLS_ROOT_PATH "/");
+	}
+	
+	value = cf->args->elts;
+	
+	for (i = 1; i < cf->args->nelts; i++) {
+		pattern = ngx_array_push(mcf->preload);
+		if (pattern == NULL) return NGX_CONF_ERROR;
+		
+		*pattern = value[i];
+		
+		if (!ngx_path_separator(pattern->data[0])) {
+			if (ngx_http_ctpp2_join_path(&root, &value[i], pattern, cf->pool) != NGX_OK) {
+				return NGX_CONF_ERROR;
+			}
+			if (ngx_conf_full_name(cf->cycle, pattern, 0) != NGX_OK) {
+				return NGX_CONF_ERROR;
+			}
+		}
+		
+		if (ngx_file_info(pattern->data, &fi) != NGX_FILE_ERROR && ngx_is_dir(&fi)) {
+			dir = *pattern;
+			if (ngx_http_ctpp2_join_path(&dir, &all, pattern, cf->pool) != NGX_OK) {
+				return NGX_CONF_ERROR;
+			}
+		}
+	}
+	
 	return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_ctpp2_init_process(ngx_cycle_t *cycle)
+{
+	ngx_http_ctpp2_main_conf_t  *mcf;
+	ngx_str_t                   *pattern, path;
+	ngx_glob_t                   gl;
+	ngx_uint_t                   i, n;
+	size_t                       size, total;
+	
+	mcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ctpp2_filter_module);
+	if (mcf == NULL) return NGX_OK;
+	
+#if (NGX_HAVE_INOTIFY)
+	if (mcf->tmpl_watch) {
+		/* templates are checked by stat() as usual if that fails */
+		(void) ngx_http_ctpp2_tmpl_local_watch(mcf->tmpl_local, cycle);
+	}
+#endif
+	
+	if (mcf->preload == NULL) return NGX_OK;
+	
+	n = 0;
+	total = 0;
+	pattern = mcf->preload->elts;
+	
+	for (i = 0; i < mcf->preload->nelts; i++) {
+		ngx_memzero(&gl, sizeof(ngx_glob_t));
+		
+		gl.pattern = pattern[i].data;
+		gl.log = cycle->log;
+		gl.test = 1;
+		
+		if (ngx_open_glob(&gl) != NGX_OK) {
+			ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+				ngx_open_glob_n " \"%s\" failed", pattern[i].data);
+			continue;
+		}
+		
+		while (ngx_read_glob(&gl, &path) == NGX_OK) {
+			if (path.len < sizeof(".ct2") - 1
+			    || ngx_strcmp(path.data + path.len - (sizeof(".ct2") - 1), ".ct2") != 0)
+			{
+				continue;
+			}
+			
+			if (ngx_http_ctpp2_tmpl_local_preload(mcf->tmpl_local, &path, &size, cycle->log)
+			    == NGX_OK)
+			{
+				n++;
+				total += size;
+			}
+		}
+		
+		ngx_close_glob(&gl);
+	}
+	
+	ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+		"ctpp2: %ui templates preloaded, %uz bytes", n, total);
+	
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_exit_process(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_INOTIFY)
+	ngx_http_ctpp2_main_conf_t  *mcf;
+	
+	mcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ctpp2_filter_module);
+	if (mcf && mcf->tmpl_watch) {
+		ngx_http_ctpp2_tmpl_local_unwatch(mcf->tmpl_local);
+	}
+#endif
+}
+
+
 static void *
 ngx_http_ctpp2_create_loc_conf(ngx_conf_t *cf)
 {
@@ -476,7 +2010,21 @@ ngx_http_ctpp2_create_loc_conf(ngx_conf_t *cf)
 	
 	conf->enable = NGX_CONF_UNSET;
 	conf->buffer_size = NGX_CONF_UNSET_SIZE;
+	conf->max_data_size = NGX_CONF_UNSET_SIZE;
 	conf->tmpls_check = NGX_CONF_UNSET;
+	conf->tmpls_mmap = NGX_CONF_UNSET;
+	conf->stream = NGX_CONF_UNSET;
+	conf->json_utf8 = NGX_CONF_UNSET;
+	conf->json_parser = NGX_CONF_UNSET_UINT;
+	conf->render_cache = NGX_CONF_UNSET_PTR;
+	conf->data_timeout = NGX_CONF_UNSET_MSEC;
+	conf->global_data = NGX_CONF_UNSET_PTR;
+#if (NGX_THREADS)
+	conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+	
+	conf->data_est = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_data_est_t));
+	if (conf->data_est == NULL) return NULL;
 
 	return conf;
 }
@@ -511,6 +2059,8 @@ ngx_http_ctpp2_set_template(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 	char       *ret;
 	ngx_buf_t  *buf;
 
+	if (lcf->tmpl_uri) return "conflicts with \"template_uri\"";
+	
 	if (cf->args->nelts == 2) {
 		return ngx_http_set_notcompiled_cv_slot(cf, cmd, conf);
 	}
@@ -547,13 +2097,53 @@ ngx_http_ctpp2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_value(conf->enable, prev->enable, 0);
 	if (conf->enable) {
 		mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ctpp2_filter_module);
-		if (ctpp2_init(mcf->args, mcf->code, mcf->funcs, mcf->steps) != NGX_OK) {
+		if (ctpp2_init(mcf->args, mcf->code, mcf->funcs, mcf->steps, mcf->slice_steps,
+		               mcf->fragment_cache)
+		    != NGX_OK)
+		{
 			return NGX_CONF_ERROR;
 		}
 	}
 	
 	ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 16 * 1024);
+	ngx_conf_merge_size_value(conf->max_data_size, prev->max_data_size, 1024 * 1024);
 	ngx_conf_merge_value(conf->tmpls_check, prev->tmpls_check, 0);
+	ngx_conf_merge_value(conf->tmpls_mmap, prev->tmpls_mmap, 0);
+	ngx_conf_merge_value(conf->stream, prev->stream, 0);
+	ngx_conf_merge_value(conf->json_utf8, prev->json_utf8, 0);
+	ngx_conf_merge_uint_value(conf->json_parser, prev->json_parser, NGX_HTTP_CTPP2_JSON_CLASSIC);
+	ngx_conf_merge_msec_value(conf->data_timeout, prev->data_timeout, 0);
+	ngx_conf_merge_ptr_value(conf->global_data, prev->global_data, NULL);
+	ngx_conf_merge_str_value(conf->content_type, prev->content_type, "");
+	
+	if (conf->data_uris == NULL) conf->data_uris = prev->data_uris;
+	
+	if (conf->output_bufs.num == 0) {
+		/* buffers of the same size, so the cache is shared */
+		conf->output_cache = prev->output_cache;
+	}
+	ngx_conf_merge_bufs_value(conf->output_bufs, prev->output_bufs,
+		(128 * 1024) / ngx_pagesize, ngx_pagesize);
+	
+	if (conf->output_bufs.size < sizeof(u_char *)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too small \"ctpp2_output_buffers\" size");
+		return NGX_CONF_ERROR;
+	}
+	if (conf->render_cache == NGX_CONF_UNSET_PTR) {
+		conf->render_cache = (prev->render_cache == NGX_CONF_UNSET_PTR) ? NULL : prev->render_cache;
+		conf->render_key = prev->render_key;
+		conf->render_valid = prev->render_valid;
+	}
+	
+#if (NGX_THREADS)
+	ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+	
+	if (conf->output_cache == NULL) {
+		conf->output_cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_output_cache_t));
+		if (conf->output_cache == NULL) return NGX_CONF_ERROR;
+		conf->output_cache->max = conf->output_bufs.num * NGX_HTTP_CTPP2_OUTPUT_CACHED;
+	}
 	ngx_conf_merge_str_value(conf->tmpls_header, prev->tmpls_header, NGX_HTTP_CTPP2_TMPLS_HEADER);
 	
 	if (conf->tmpls_root == NULL) {
@@ -594,10 +2184,13 @@ ngx_http_ctpp2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		}
 	}
 	
-	if (conf->tmpl == NULL) {
+	if (conf->tmpl == NULL && conf->tmpl_uri == NULL) {
 		conf->tmpl = prev->tmpl;
 		conf->tmpl_cache = prev->tmpl_cache;
-	} else {
+		conf->tmpl_crc = prev->tmpl_crc;
+		conf->tmpl_uri = prev->tmpl_uri;
+		conf->tmpl_uri_valid = prev->tmpl_uri_valid;
+	} else if (conf->tmpl) {
 		c_str = &conf->tmpl->value;
 		if (!ngx_path_separator(c_str->data[0])) {
 			p_str = &conf->tmpls_root->value;
@@ -630,11 +2223,15 @@ ngx_http_ctpp2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 					"can't cache template with relative path and variable root: \"%s\"", c_str->data);
 				return NGX_CONF_ERROR;
 			}
-			if (ngx_http_ctpp2_load_tmpl(cf, c_str->data, conf->tmpl_cache) != NGX_OK) {
+			if (ngx_http_ctpp2_load_tmpl(cf, c_str->data, conf->tmpl_cache, conf->tmpls_mmap)
+			    != NGX_OK)
+			{
 				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
 					"load template \"%s\" to cache failed", c_str->data);
 				return NGX_CONF_ERROR;
 			}
+			conf->tmpl_crc = ngx_crc32_long(conf->tmpl_cache->pos,
+				conf->tmpl_cache->last - conf->tmpl_cache->pos);
 		}
 	}
 
@@ -642,8 +2239,109 @@ ngx_http_ctpp2_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
+static char *
+ngx_http_ctpp2_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+	ngx_http_ctpp2_loc_conf_t *lcf = conf;
+	
+	ngx_str_t  *value;
+	
+	if (lcf->thread_pool != NGX_CONF_UNSET_PTR) return "is duplicate";
+	
+	value = cf->args->elts;
+	if (ngx_strcmp(value[1].data, "off") == 0) {
+		lcf->thread_pool = NULL;
+		return NGX_CONF_OK;
+	}
+	
+	lcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+	if (lcf->thread_pool == NULL) return NGX_CONF_ERROR;
+	
+	return NGX_CONF_OK;
+#else
+	return "is unsupported on this platform";
+#endif
+}
+
+
+/*
+ * Global data are parsed once, on configuration load, and shared by workers.
+ */
+static char *
+ngx_http_ctpp2_global_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_loc_conf_t *lcf = conf;
+	
+	ngx_str_t        *value, path;
+	ngx_fd_t          fd;
+	ngx_file_info_t   fi;
+	size_t            size;
+	ssize_t           n;
+	u_char           *b;
+	
+	if (lcf->global_data != NGX_CONF_UNSET_PTR) return "is duplicate";
+	
+	value = cf->args->elts;
+	if (ngx_strcmp(value[1].data, "off") == 0) {
+		lcf->global_data = NULL;
+		return NGX_CONF_OK;
+	}
+	
+	path = value[1];
+	if (ngx_conf_full_name(cf->cycle, &path, 1) != NGX_OK) return NGX_CONF_ERROR;
+	
+	fd = ngx_open_file(path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_open_file_n " \"%s\" failed",
+			path.data);
+		return NGX_CONF_ERROR;
+	}
+	
+	b = NULL;
+	
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_fd_info_n " \"%s\" failed",
+			path.data);
+		goto failed;
+	}
+	size = (size_t) ngx_file_size(&fi);
+	
+	b = ngx_alloc(size, cf->log);
+	if (b == NULL) goto failed;
+	
+	n = ngx_read_fd(fd, b, size);
+	if (n == NGX_FILE_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_read_fd_n " \"%s\" failed",
+			path.data);
+		goto failed;
+	}
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno, ngx_close_file_n " \"%s\" failed",
+			path.data);
+	}
+	
+	lcf->global_data = ctpp2_global_create(cf->pool, b, b + n, cf->log);
+	ngx_free(b);
+	
+	if (lcf->global_data == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid global data in \"%s\"", path.data);
+		return NGX_CONF_ERROR;
+	}
+	
+	return NGX_CONF_OK;
+	
+failed:
+	
+	if (b) ngx_free(b);
+	ngx_close_file(fd);
+	
+	return NGX_CONF_ERROR;
+}
+
+
 static ngx_int_t
-ngx_http_ctpp2_load_tmpl(ngx_conf_t *cf, u_char *path, ngx_buf_t *buffer)
+ngx_http_ctpp2_load_tmpl(ngx_conf_t *cf, u_char *path, ngx_buf_t *buffer, ngx_flag_t map)
 {
 	ngx_fd_t         fd;
 	ngx_file_info_t  fi;
@@ -664,6 +2362,19 @@ ngx_http_ctpp2_load_tmpl(ngx_conf_t *cf, u_char *path, ngx_buf_t *buffer)
 		return NGX_ERROR;
 	}
 	size = ngx_file_size(&fi);
+	
+	if (map) {
+		if (ngx_http_ctpp2_tmpl_map(cf->pool, fd, size, buffer, cf->log) == NULL) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mapping \"%s\" failed", path);
+			ngx_close_file(fd);
+			return NGX_ERROR;
+		}
+		if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+			ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno, ngx_close_file_n " \"%s\" failed", path);
+		}
+		return ctpp2_tmpltest(buffer, 1, cf->log);
+	}
+	
 	b = ngx_palloc(cf->pool, size);
 	if (b == NULL) return NGX_ERROR;
 	
@@ -688,6 +2399,23 @@ ngx_http_ctpp2_load_tmpl(ngx_conf_t *cf, u_char *path, ngx_buf_t *buffer)
 }
 
 
+static ngx_int_t
+ngx_http_ctpp2_add_variables(ngx_conf_t *cf)
+{
+	ngx_http_variable_t  *var, *v;
+	
+	for (v = ngx_http_ctpp2_vars; v->name.len; v++) {
+		var = ngx_http_add_variable(cf, &v->name, v->flags);
+		if (var == NULL) return NGX_ERROR;
+		
+		var->get_handler = v->get_handler;
+		var->data = v->data;
+	}
+	
+	return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_ctpp2_filter_init(ngx_conf_t *cf)
 {
@@ -701,6 +2429,33 @@ ngx_http_ctpp2_filter_init(ngx_conf_t *cf)
 }
 
 
+/*
+ * Makes null-terminated "dir/name".
+ */
+static ngx_int_t
+ngx_http_ctpp2_join_path(ngx_str_t *dir, ngx_str_t *name, ngx_str_t *path, ngx_pool_t *pool)
+{
+	size_t   len;
+	u_char  *p;
+	
+	len = dir->len + 1 + name->len;
+	
+	p = ngx_pnalloc(pool, len + 1);
+	if (p == NULL) return NGX_ERROR;
+	
+	path->data = p;
+	
+	p = ngx_cpymem(p, dir->data, dir->len);
+	if (dir->len == 0 || !ngx_path_separator(dir->data[dir->len - 1])) *p++ = '/';
+	p = ngx_cpymem(p, name->data, name->len);
+	*p = '\0';
+	
+	path->len = p - path->data;
+	
+	return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_strprepend_nulled(ngx_str_t *what, ngx_str_t *to, ngx_pool_t *pool)
 {
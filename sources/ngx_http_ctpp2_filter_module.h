@@ -12,16 +12,145 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+#include "ctpp2_process.h"
+
+
+#define NGX_HTTP_CTPP2_JSON_CLASSIC      0
+#define NGX_HTTP_CTPP2_JSON_INCREMENTAL  1
+#define NGX_HTTP_CTPP2_JSON_SIMD         2
+
+#define NGX_HTTP_CTPP2_CACHE_BYPASS      1
+#define NGX_HTTP_CTPP2_CACHE_MISS        2
+#define NGX_HTTP_CTPP2_CACHE_EXPIRED     3
+#define NGX_HTTP_CTPP2_CACHE_HIT         4
+
+
+typedef struct ngx_http_ctpp2_tmpl_local_s  ngx_http_ctpp2_tmpl_local_t;
+typedef struct ngx_http_ctpp2_output_s      ngx_http_ctpp2_output_t;
+typedef struct ngx_http_ctpp2_block_s       ngx_http_ctpp2_block_t;
+typedef struct ngx_http_ctpp2_tmpl_uri_cache_s  ngx_http_ctpp2_tmpl_uri_cache_t;
+typedef struct ngx_http_ctpp2_fetch_s       ngx_http_ctpp2_fetch_t;
+typedef struct ngx_http_ctpp2_branches_s    ngx_http_ctpp2_branches_t;
+
+typedef struct {
+	ngx_uint_t       args;
+	ngx_uint_t       code;
+	ngx_uint_t       funcs;
+	ngx_uint_t       steps;
+	ngx_uint_t       slice_steps;
+	size_t           fragment_cache;
+	ngx_shm_zone_t  *tmpl_cache;
+	size_t           tmpl_local_size;
+	ngx_http_ctpp2_tmpl_local_t  *tmpl_local;
+	ngx_flag_t       tmpl_watch;   /* by inotify instead of stat() */
+	ngx_array_t     *preload;      /* of ngx_str_t, null-terminated */
+	size_t           tmpl_uri_size;
+	ngx_http_ctpp2_tmpl_uri_cache_t  *tmpl_uri_cache;
+	ngx_shm_zone_t  *status_zone;
+	ngx_flag_t       status_used;  /* by "ctpp2_status" */
+} ngx_http_ctpp2_main_conf_t;
+
+/* running estimate of data size, per location and per worker */
+typedef struct {
+	size_t  avg;
+	size_t  dev;
+} ngx_http_ctpp2_data_est_t;
+
+/* MD5 and the length of the material of a render cache key */
+typedef struct {
+	u_char      md5[16];
+	uint64_t    len;
+} ngx_http_ctpp2_render_key_t;
+
+/* output buffers kept between requests, per location and per worker */
+typedef struct {
+	u_char      *free;   /* linked through the first bytes of buffers */
+	ngx_uint_t   nfree;
+	ngx_uint_t   max;
+} ngx_http_ctpp2_output_cache_t;
+
+typedef struct {
+	ngx_flag_t  enable;
+	size_t      buffer_size;
+	size_t      max_data_size;
+	ngx_http_ctpp2_data_est_t  *data_est;
+	ngx_bufs_t  output_bufs;
+	ngx_http_ctpp2_output_cache_t  *output_cache;
+	ngx_str_t   tmpls_header;
+	ngx_flag_t  tmpls_check;
+	ngx_flag_t  tmpls_mmap;
+	ngx_flag_t  stream;
+	ngx_uint_t  json_parser;
+	ngx_flag_t  json_utf8;
+	ngx_http_complex_value_t  *tmpl;
+	ngx_http_complex_value_t  *tmpls_root;
+	ngx_buf_t  *tmpl_cache;
+	uint32_t    tmpl_crc;     /* of tmpl_cache */
+	ngx_http_complex_value_t  *tmpl_uri;
+	time_t      tmpl_uri_valid;
+	ngx_array_t  *data_uris;  /* of ngx_http_ctpp2_data_uri_t */
+	ngx_msec_t  data_timeout;
+	ctpp2_global_t  *global_data;  /* of "ctpp2_global_data" */
+	ngx_str_t   content_type; /* of output rendered from binary data */
+	ngx_shm_zone_t  *render_cache;
+	ngx_http_complex_value_t  *render_key;
+	time_t      render_valid;
+	ngx_uint_t  status;       /* format of "ctpp2_status" output */
+#if (NGX_THREADS)
+	ngx_thread_pool_t  *thread_pool;
+#endif
+} ngx_http_ctpp2_loc_conf_t;
 
 typedef struct {
 	ngx_buf_t           *data;
-	
+	ngx_chain_t         *data_chain;  /* filled data buffers, then all of them */
+	ngx_chain_t        **data_last;
+	size_t               data_size;   /* size of data in data_chain, of all data then */
+	off_t                data_limit;
+	ngx_uint_t           data_format;
+	ctpp2_json_t        *json;
+
 	ngx_buf_t           *tmpl;
 	ngx_str_t            tmpl_path;
+	ngx_file_uniq_t      tmpl_uniq;
+	time_t               tmpl_mtime;
+	ngx_pool_cleanup_t  *tmpl_map;
+	ngx_http_ctpp2_fetch_t  *fetch;   /* of "template_uri", or of the subrequest itself */
+	ngx_http_ctpp2_branches_t  *branches;  /* of "ctpp2_data" */
+	
+	ctpp2_render_t       render;
+	ngx_chain_t         *busy;
+	ngx_http_ctpp2_output_t  *output;
+	ngx_event_t          slice;       /* resumes suspended render */
+	
+#if (NGX_THREADS)
+	ngx_thread_task_t   *thread_task;
+	ngx_http_ctpp2_block_t  *thread_blocks;  /* output rendered by the thread */
+	size_t               thread_size;
+	ngx_int_t            thread_rc;
+#endif
+	
+	ngx_http_ctpp2_render_key_t  render_key;
+	ngx_uint_t           render_cache_status;
+	
 	unsigned             template_ready:1;
+	unsigned             tmpl_checked:1;  /* tmpl has passed the CRC check */
+	unsigned             done:1;
+	unsigned             rendering:1;     /* in a thread */
+	unsigned             waiting:1;       /* for subrequests */
+	unsigned             data_length:1;   /* data_limit is Content-Length */
 } ngx_http_ctpp2_ctx_t;
 
 
+ngx_int_t ngx_http_ctpp2_tmpl_loaded(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+ngx_int_t ngx_http_ctpp2_tmpl_cached(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+ngx_str_t *ngx_http_ctpp2_tmpl_name(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+ngx_uint_t ngx_http_ctpp2_data_format(ngx_http_request_t *r);
+
 extern ngx_module_t  ngx_http_ctpp2_filter_module;
 
 
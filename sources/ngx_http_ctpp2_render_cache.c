@@ -0,0 +1,620 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_render_cache.h"
+#include <ngx_md5.h>
+
+
+typedef struct {
+	ngx_rbtree_node_t            node;
+	ngx_queue_t                  queue;
+	ngx_http_ctpp2_render_key_t  key;
+	time_t                       expire;
+	size_t                       size;
+	ngx_uint_t                   count;
+	unsigned                     deleted:1;
+	u_char                       out[1];
+} ngx_http_ctpp2_render_cache_node_t;
+
+typedef struct {
+	ngx_rbtree_t                 rbtree;
+	ngx_rbtree_node_t            sentinel;
+	ngx_queue_t                  queue;
+} ngx_http_ctpp2_render_cache_sh_t;
+
+typedef struct {
+	ngx_http_ctpp2_render_cache_sh_t  *sh;
+	ngx_slab_pool_t                   *shpool;
+} ngx_http_ctpp2_render_cache_t;
+
+typedef struct {
+	ngx_http_ctpp2_render_cache_t       *cache;
+	ngx_http_ctpp2_render_cache_node_t  *node;
+} ngx_http_ctpp2_render_cache_cleanup_t;
+
+
+static ngx_int_t ngx_http_ctpp2_render_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_ctpp2_render_cache_key(ngx_http_request_t *r,
+	ngx_http_ctpp2_loc_conf_t *conf, ngx_http_ctpp2_ctx_t *ctx);
+static void ngx_http_ctpp2_render_cache_hash(ngx_md5_t *md5,
+	ngx_http_ctpp2_render_key_t *key, u_char *p, size_t len);
+static ngx_int_t ngx_http_ctpp2_render_cache_cmp(ngx_http_ctpp2_render_key_t *one,
+	ngx_http_ctpp2_render_key_t *two);
+static void ngx_http_ctpp2_render_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+	ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_ctpp2_render_cache_node_t *ngx_http_ctpp2_render_cache_lookup(
+	ngx_http_ctpp2_render_cache_t *cache, ngx_http_ctpp2_render_key_t *key);
+static void *ngx_http_ctpp2_render_cache_alloc(ngx_http_ctpp2_render_cache_t *cache, size_t size);
+static void ngx_http_ctpp2_render_cache_delete(ngx_http_ctpp2_render_cache_t *cache,
+	ngx_http_ctpp2_render_cache_node_t *rn);
+static void ngx_http_ctpp2_render_cache_cleanup(void *data);
+
+
+static ngx_str_t  ngx_http_ctpp2_render_cache_status[] = {
+	ngx_string("BYPASS"),
+	ngx_string("MISS"),
+	ngx_string("EXPIRED"),
+	ngx_string("HIT")
+};
+
+
+char *
+ngx_http_ctpp2_render_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_loc_conf_t *lcf = conf;
+
+	ngx_str_t                         *value, name, s;
+	ngx_uint_t                         i;
+	ssize_t                            size;
+	time_t                             valid;
+	u_char                            *p;
+	ngx_shm_zone_t                    *zone;
+	ngx_http_ctpp2_render_cache_t     *cache;
+	ngx_http_compile_complex_value_t   ccv;
+
+	if (lcf->render_cache != NGX_CONF_UNSET_PTR) return "is duplicate";
+
+	value = cf->args->elts;
+
+	if (ngx_strcmp(value[1].data, "off") == 0) {
+		if (cf->args->nelts != 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+		lcf->render_cache = NULL;
+		return NGX_CONF_OK;
+	}
+
+	name.len = 0;
+	size = 0;
+	valid = 60;
+
+	for (i = 1; i < cf->args->nelts; i++) {
+
+		if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+			name.data = value[i].data + 5;
+			name.len = value[i].len - 5;
+
+			p = (u_char *) ngx_strchr(name.data, ':');
+			if (p == NULL) continue;
+
+			name.len = p - name.data;
+
+			s.data = p + 1;
+			s.len = value[i].data + value[i].len - s.data;
+
+			size = ngx_parse_size(&s);
+			if (size == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid zone size \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			if (size < (ssize_t) (8 * ngx_pagesize)) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"zone \"%V\" is too small", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+			s.data = value[i].data + 4;
+			s.len = value[i].len - 4;
+
+			lcf->render_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+			if (lcf->render_key == NULL) return NGX_CONF_ERROR;
+
+			ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+			ccv.cf = cf;
+			ccv.value = &s;
+			ccv.complex_value = lcf->render_key;
+
+			if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			valid = ngx_parse_time(&s, 1);
+			if (valid == (time_t) NGX_ERROR || valid == 0) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid time \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if (name.len == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"%V\" must have \"zone\" parameter", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	/* zone=name without size refers to the zone declared elsewhere */
+	zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_ctpp2_filter_module);
+	if (zone == NULL) return NGX_CONF_ERROR;
+
+	if (zone->data == NULL) {
+		cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_render_cache_t));
+		if (cache == NULL) return NGX_CONF_ERROR;
+
+		zone->init = ngx_http_ctpp2_render_cache_init_zone;
+		zone->data = cache;
+
+	} else if (zone->init != ngx_http_ctpp2_render_cache_init_zone) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	lcf->render_cache = zone;
+	lcf->render_valid = valid;
+
+	return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_render_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_ctpp2_render_cache_t  *ocache = data;
+	ngx_http_ctpp2_render_cache_t  *cache;
+	size_t                          len;
+
+	cache = shm_zone->data;
+
+	if (ocache) {
+		cache->sh = ocache->sh;
+		cache->shpool = ocache->shpool;
+		return NGX_OK;
+	}
+
+	cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists) {
+		cache->sh = cache->shpool->data;
+		return NGX_OK;
+	}
+
+	cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_ctpp2_render_cache_sh_t));
+	if (cache->sh == NULL) return NGX_ERROR;
+
+	cache->shpool->data = cache->sh;
+
+	ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+		ngx_http_ctpp2_render_cache_rbtree_insert_value);
+	ngx_queue_init(&cache->sh->queue);
+
+	len = sizeof(" in ctpp2 render cache zone \"\"") + shm_zone->shm.name.len;
+
+	cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+	if (cache->shpool->log_ctx == NULL) return NGX_ERROR;
+
+	ngx_sprintf(cache->shpool->log_ctx, " in ctpp2 render cache zone \"%V\"%Z",
+		&shm_zone->shm.name);
+
+	cache->shpool->log_nomem = 0;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Data must be in ctx->data or ctx->data_chain already.  Returns NGX_OK with the stored output
+ * in ctx->render on a hit and NGX_DECLINED otherwise.
+ */
+ngx_int_t
+ngx_http_ctpp2_render_cache_get(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t              *conf;
+	ngx_http_ctpp2_render_cache_t          *cache;
+	ngx_http_ctpp2_render_cache_node_t     *rn;
+	ngx_http_ctpp2_render_cache_cleanup_t  *ccln;
+	ngx_pool_cleanup_t                     *cln;
+	ngx_chain_t                            *cl;
+	ngx_buf_t                              *b;
+
+	if (r->headers_out.status != NGX_HTTP_OK) {
+		ctx->render_cache_status = NGX_HTTP_CTPP2_CACHE_BYPASS;
+		return NGX_DECLINED;
+	}
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	cache = conf->render_cache->data;
+
+	if (ngx_http_ctpp2_render_cache_key(r, conf, ctx) != NGX_OK) return NGX_ERROR;
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL) return NGX_ERROR;
+
+	cl = ngx_alloc_chain_link(r->pool);
+	if (cl == NULL) return NGX_ERROR;
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_ctpp2_render_cache_cleanup_t));
+	if (cln == NULL) return NGX_ERROR;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	rn = ngx_http_ctpp2_render_cache_lookup(cache, &ctx->render_key);
+	if (rn == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		ctx->render_cache_status = NGX_HTTP_CTPP2_CACHE_MISS;
+		return NGX_DECLINED;
+	}
+
+	if (rn->expire <= ngx_time()) {
+		ngx_http_ctpp2_render_cache_delete(cache, rn);
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		ctx->render_cache_status = NGX_HTTP_CTPP2_CACHE_EXPIRED;
+		return NGX_DECLINED;
+	}
+
+	rn->count++;
+	ngx_queue_remove(&rn->queue);
+	ngx_queue_insert_head(&cache->sh->queue, &rn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ccln = cln->data;
+	ccln->cache = cache;
+	ccln->node = rn;
+	cln->handler = ngx_http_ctpp2_render_cache_cleanup;
+
+	b->start = rn->out;
+	b->end = rn->out + rn->size;
+	b->pos = b->start;
+	b->last = b->end;
+	b->memory = 1;
+
+	cl->buf = b;
+	cl->next = NULL;
+
+	ctx->render.out = rn->size ? cl : NULL;
+	ctx->render.out_size = rn->size;
+	ctx->render_cache_status = NGX_HTTP_CTPP2_CACHE_HIT;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 render cache: hit, %uz bytes", rn->size);
+
+	return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_render_cache_put(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_loc_conf_t           *conf;
+	ngx_http_ctpp2_render_cache_t       *cache;
+	ngx_http_ctpp2_render_cache_node_t  *rn;
+	ngx_chain_t                         *cl;
+	size_t                               size;
+	u_char                              *p;
+
+	if (ctx->render_cache_status != NGX_HTTP_CTPP2_CACHE_MISS
+	    && ctx->render_cache_status != NGX_HTTP_CTPP2_CACHE_EXPIRED)
+	{
+		return NGX_DECLINED;
+	}
+
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	cache = conf->render_cache->data;
+	size = ctx->render.out_size;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	rn = ngx_http_ctpp2_render_cache_lookup(cache, &ctx->render_key);
+	if (rn) {
+		if (rn->expire > ngx_time()) {
+			/* another worker has been faster */
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			return NGX_OK;
+		}
+		ngx_http_ctpp2_render_cache_delete(cache, rn);
+	}
+
+	rn = ngx_http_ctpp2_render_cache_alloc(cache,
+		sizeof(ngx_http_ctpp2_render_cache_node_t) + size);
+	if (rn == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"Output (%uz bytes) doesn't fit into ctpp2 render cache", size);
+		return NGX_DECLINED;
+	}
+
+	p = rn->out;
+	for (cl = ctx->render.out; cl; cl = cl->next) {
+		p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+	}
+
+	ngx_memcpy(&rn->node.key, ctx->render_key.md5, sizeof(ngx_rbtree_key_t));
+	rn->key = ctx->render_key;
+	rn->expire = ngx_time() + conf->render_valid;
+	rn->size = size;
+	rn->count = 0;
+	rn->deleted = 0;
+
+	ngx_rbtree_insert(&cache->sh->rbtree, &rn->node);
+	ngx_queue_insert_head(&cache->sh->queue, &rn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 render cache: stored %uz bytes", size);
+
+	return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_render_cache_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+	uintptr_t data)
+{
+	ngx_http_ctpp2_ctx_t  *ctx;
+	ngx_str_t             *status;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
+	if (ctx == NULL || ctx->render_cache_status == 0) {
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	status = &ngx_http_ctpp2_render_cache_status[ctx->render_cache_status - 1];
+
+	v->len = status->len;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+	v->data = status->data;
+
+	return NGX_OK;
+}
+
+
+/*
+ * The key covers the template version and either the data or the value
+ * of the "key" parameter.  Like keys of proxy_cache, it is kept as MD5 of
+ * that material, its length is compared as well.
+ */
+static ngx_int_t
+ngx_http_ctpp2_render_cache_key(ngx_http_request_t *r, ngx_http_ctpp2_loc_conf_t *conf,
+	ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_render_key_t  *key;
+	ngx_str_t                    *path, value;
+	ngx_chain_t                  *cl;
+	ngx_md5_t                     md5;
+
+	key = &ctx->render_key;
+
+	ngx_md5_init(&md5);
+	key->len = 0;
+
+	if (ctx->tmpl_path.len) {
+		path = &ctx->tmpl_path;
+		ngx_http_ctpp2_render_cache_hash(&md5, key, (u_char *) &path->len, sizeof(size_t));
+		ngx_http_ctpp2_render_cache_hash(&md5, key, path->data, path->len);
+		ngx_http_ctpp2_render_cache_hash(&md5, key, (u_char *) &ctx->tmpl_uniq,
+			sizeof(ngx_file_uniq_t));
+		ngx_http_ctpp2_render_cache_hash(&md5, key, (u_char *) &ctx->tmpl_mtime,
+			sizeof(time_t));
+
+	} else {
+		/* the template loaded with configuration */
+		path = &conf->tmpl->value;
+		ngx_http_ctpp2_render_cache_hash(&md5, key, (u_char *) &path->len, sizeof(size_t));
+		ngx_http_ctpp2_render_cache_hash(&md5, key, path->data, path->len);
+		ngx_http_ctpp2_render_cache_hash(&md5, key, (u_char *) &conf->tmpl_crc,
+			sizeof(uint32_t));
+	}
+
+	if (conf->render_key) {
+		if (ngx_http_complex_value(r, conf->render_key, &value) != NGX_OK) {
+			return NGX_ERROR;
+		}
+		ngx_http_ctpp2_render_cache_hash(&md5, key, value.data, value.len);
+
+	} else if (ctx->data_chain) {
+		for (cl = ctx->data_chain; cl; cl = cl->next) {
+			ngx_http_ctpp2_render_cache_hash(&md5, key, cl->buf->pos,
+				cl->buf->last - cl->buf->pos);
+		}
+
+	} else {
+		ngx_http_ctpp2_render_cache_hash(&md5, key, ctx->data->pos,
+			ctx->data->last - ctx->data->pos);
+	}
+
+	ngx_md5_final(key->md5, &md5);
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_render_cache_hash(ngx_md5_t *md5, ngx_http_ctpp2_render_key_t *key, u_char *p,
+	size_t len)
+{
+	ngx_md5_update(md5, p, len);
+	key->len += len;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_render_cache_cmp(ngx_http_ctpp2_render_key_t *one,
+	ngx_http_ctpp2_render_key_t *two)
+{
+	ngx_int_t  rc;
+
+	rc = ngx_memcmp(one->md5, two->md5, sizeof(one->md5));
+	if (rc != 0) return rc;
+
+	if (one->len != two->len) return (one->len < two->len) ? -1 : 1;
+
+	return 0;
+}
+
+
+static void
+ngx_http_ctpp2_render_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+	ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	ngx_rbtree_node_t                   **p;
+	ngx_http_ctpp2_render_cache_node_t   *rn, *rnt;
+
+	for ( ;; ) {
+		if (node->key < temp->key) {
+			p = &temp->left;
+		} else if (node->key > temp->key) {
+			p = &temp->right;
+		} else {
+			rn = (ngx_http_ctpp2_render_cache_node_t *) node;
+			rnt = (ngx_http_ctpp2_render_cache_node_t *) temp;
+			p = (ngx_http_ctpp2_render_cache_cmp(&rn->key, &rnt->key) < 0)
+				? &temp->left : &temp->right;
+		}
+
+		if (*p == sentinel) break;
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+
+static ngx_http_ctpp2_render_cache_node_t *
+ngx_http_ctpp2_render_cache_lookup(ngx_http_ctpp2_render_cache_t *cache,
+	ngx_http_ctpp2_render_key_t *key)
+{
+	ngx_int_t                            rc;
+	ngx_rbtree_key_t                     node_key;
+	ngx_rbtree_node_t                   *node, *sentinel;
+	ngx_http_ctpp2_render_cache_node_t  *rn;
+
+	node = cache->sh->rbtree.root;
+	sentinel = cache->sh->rbtree.sentinel;
+
+	ngx_memcpy(&node_key, key->md5, sizeof(ngx_rbtree_key_t));
+
+	while (node != sentinel) {
+		if (node_key < node->key) {
+			node = node->left;
+			continue;
+		}
+		if (node_key > node->key) {
+			node = node->right;
+			continue;
+		}
+
+		rn = (ngx_http_ctpp2_render_cache_node_t *) node;
+		rc = ngx_http_ctpp2_render_cache_cmp(key, &rn->key);
+		if (rc == 0) return rn;
+
+		node = (rc < 0) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+
+static void *
+ngx_http_ctpp2_render_cache_alloc(ngx_http_ctpp2_render_cache_t *cache, size_t size)
+{
+	void                                *p;
+	ngx_queue_t                         *q;
+	ngx_http_ctpp2_render_cache_node_t  *rn;
+
+	for ( ;; ) {
+		p = ngx_slab_alloc_locked(cache->shpool, size);
+		if (p) return p;
+
+		/* evict the least recently used output nobody sends now */
+		for (q = ngx_queue_last(&cache->sh->queue);
+		     q != ngx_queue_sentinel(&cache->sh->queue);
+		     q = ngx_queue_prev(q))
+		{
+			rn = ngx_queue_data(q, ngx_http_ctpp2_render_cache_node_t, queue);
+			if (rn->count == 0) break;
+		}
+
+		if (q == ngx_queue_sentinel(&cache->sh->queue)) return NULL;
+
+		ngx_http_ctpp2_render_cache_delete(cache, rn);
+	}
+}
+
+
+static void
+ngx_http_ctpp2_render_cache_delete(ngx_http_ctpp2_render_cache_t *cache,
+	ngx_http_ctpp2_render_cache_node_t *rn)
+{
+	ngx_rbtree_delete(&cache->sh->rbtree, &rn->node);
+	ngx_queue_remove(&rn->queue);
+
+	if (rn->count) {
+		rn->deleted = 1;
+		return;
+	}
+
+	ngx_slab_free_locked(cache->shpool, rn);
+}
+
+
+static void
+ngx_http_ctpp2_render_cache_cleanup(void *data)
+{
+	ngx_http_ctpp2_render_cache_cleanup_t  *ccln = data;
+
+	ngx_http_ctpp2_render_cache_t       *cache;
+	ngx_http_ctpp2_render_cache_node_t  *rn;
+
+	cache = ccln->cache;
+	rn = ccln->node;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	rn->count--;
+
+	if (rn->deleted && rn->count == 0) {
+		ngx_slab_free_locked(cache->shpool, rn);
+	}
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+}
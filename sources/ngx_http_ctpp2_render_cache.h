@@ -0,0 +1,23 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_RENDER_CACHE_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_RENDER_CACHE_H_INCLUDED_
+
+
+#include "ngx_http_ctpp2_filter_module.h"
+
+
+char *ngx_http_ctpp2_render_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_ctpp2_render_cache_get(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+ngx_int_t ngx_http_ctpp2_render_cache_put(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+
+ngx_int_t ngx_http_ctpp2_render_cache_variable(ngx_http_request_t *r,
+	ngx_http_variable_value_t *v, uintptr_t data);
+
+
+#endif /* _NGX_HTTP_CTPP2_RENDER_CACHE_H_INCLUDED_ */
@@ -0,0 +1,697 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_status.h"
+#include "ngx_http_ctpp2_crc32.h"
+
+
+typedef struct {
+	uint64_t             usec;
+	ngx_str_t            le;
+} ngx_http_ctpp2_status_bucket_t;
+
+/* the last one is +Inf */
+static ngx_http_ctpp2_status_bucket_t  ngx_http_ctpp2_status_buckets[] = {
+	{ 100,     ngx_string("0.0001") },
+	{ 250,     ngx_string("0.00025") },
+	{ 500,     ngx_string("0.0005") },
+	{ 1000,    ngx_string("0.001") },
+	{ 2500,    ngx_string("0.0025") },
+	{ 5000,    ngx_string("0.005") },
+	{ 10000,   ngx_string("0.01") },
+	{ 25000,   ngx_string("0.025") },
+	{ 50000,   ngx_string("0.05") },
+	{ 100000,  ngx_string("0.1") },
+	{ 250000,  ngx_string("0.25") },
+	{ 0,       ngx_string("+Inf") }
+};
+
+#define NGX_HTTP_CTPP2_STATUS_BUCKETS                                         \
+	(sizeof(ngx_http_ctpp2_status_buckets) / sizeof(ngx_http_ctpp2_status_bucket_t))
+
+typedef struct {
+	ngx_atomic_t         count[NGX_HTTP_CTPP2_STATUS_BUCKETS];
+	ngx_atomic_t         sum;          /* in microseconds */
+} ngx_http_ctpp2_status_hist_t;
+
+/*
+ * Counters are updated by atomic operations only, nodes are never deleted.
+ */
+typedef struct {
+	ngx_str_node_t       sn;
+	ngx_queue_t          queue;
+	ngx_atomic_t         renders;
+	ngx_atomic_t         errors[CTPP2_ERRORS];
+	ngx_atomic_t         bytes_in;
+	ngx_atomic_t         bytes_out;
+	ngx_atomic_t         steps;
+	ngx_http_ctpp2_status_hist_t  parse;
+	ngx_http_ctpp2_status_hist_t  render;
+	u_char               path[1];
+} ngx_http_ctpp2_status_node_t;
+
+typedef struct {
+	ngx_rbtree_t         rbtree;
+	ngx_rbtree_node_t    sentinel;
+	ngx_queue_t          queue;
+	ngx_atomic_t         dropped;      /* renders of templates that didn't fit */
+} ngx_http_ctpp2_status_sh_t;
+
+typedef struct {
+	ngx_http_ctpp2_status_sh_t  *sh;
+	ngx_slab_pool_t             *shpool;
+} ngx_http_ctpp2_status_t;
+
+/* worker's references to the shared nodes, so the zone isn't locked */
+typedef struct {
+	ngx_str_node_t                 sn;
+	ngx_queue_t                    queue;
+	ngx_http_ctpp2_status_node_t  *node;
+} ngx_http_ctpp2_status_ref_t;
+
+/* references kept by a worker, the rest of templates lock the zone */
+#define NGX_HTTP_CTPP2_STATUS_REFS  1024
+
+typedef struct {
+	ngx_str_t            name;
+	ngx_str_t            help;
+	size_t               offset;
+} ngx_http_ctpp2_status_metric_t;
+
+
+static ngx_int_t ngx_http_ctpp2_status_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_http_ctpp2_status_node_t *ngx_http_ctpp2_status_lookup(ngx_shm_zone_t *zone,
+	ngx_str_t *path, ngx_log_t *log);
+static void ngx_http_ctpp2_status_hist_add(ngx_http_ctpp2_status_hist_t *hist, uint64_t usec);
+static ngx_int_t ngx_http_ctpp2_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_ctpp2_status_json(u_char *p, ngx_http_ctpp2_status_t *status);
+static u_char *ngx_http_ctpp2_status_json_hist(u_char *p, ngx_http_ctpp2_status_hist_t *hist);
+static u_char *ngx_http_ctpp2_status_prometheus(u_char *p, ngx_http_ctpp2_status_t *status);
+static u_char *ngx_http_ctpp2_status_prometheus_hist(u_char *p, ngx_http_ctpp2_status_t *status,
+	ngx_str_t *name, size_t offset);
+static uintptr_t ngx_http_ctpp2_status_escape(u_char *dst, u_char *src, size_t size);
+
+
+static ngx_rbtree_t       ngx_http_ctpp2_status_refs;
+static ngx_rbtree_node_t  ngx_http_ctpp2_status_refs_sentinel;
+static ngx_queue_t        ngx_http_ctpp2_status_refs_queue;
+static ngx_uint_t         ngx_http_ctpp2_status_nrefs;
+
+static ngx_str_t  ngx_http_ctpp2_status_errors[] = {
+	ngx_null_string,
+	ngx_string("data"),
+	ngx_string("vm"),
+	ngx_string("stack"),
+	ngx_string("steps"),
+	ngx_string("ctpp"),
+	ngx_string("other")
+};
+
+static ngx_http_ctpp2_status_metric_t  ngx_http_ctpp2_status_counters[] = {
+	{ ngx_string("ctpp2_renders_total"), ngx_string("Templates rendered."),
+	  offsetof(ngx_http_ctpp2_status_node_t, renders) },
+	{ ngx_string("ctpp2_data_bytes_total"), ngx_string("Data rendered."),
+	  offsetof(ngx_http_ctpp2_status_node_t, bytes_in) },
+	{ ngx_string("ctpp2_output_bytes_total"), ngx_string("Output rendered."),
+	  offsetof(ngx_http_ctpp2_status_node_t, bytes_out) },
+	{ ngx_string("ctpp2_vm_steps_total"), ngx_string("VM steps executed."),
+	  offsetof(ngx_http_ctpp2_status_node_t, steps) },
+	{ ngx_null_string, ngx_null_string, 0 }
+};
+
+/* lines of output per template, none is longer than 128 bytes but the path */
+#define NGX_HTTP_CTPP2_STATUS_LINES                                           \
+	(8 + CTPP2_ERRORS + 2 * (NGX_HTTP_CTPP2_STATUS_BUCKETS + 2))
+
+
+char *
+ngx_http_ctpp2_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_main_conf_t *mcf = conf;
+
+	ngx_str_t                *value, name, s;
+	ssize_t                   size;
+	u_char                   *p;
+	ngx_shm_zone_t           *zone;
+	ngx_http_ctpp2_status_t  *status;
+
+	if (mcf->status_zone) return "is duplicate";
+
+	value = cf->args->elts;
+
+	p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+	if (p == NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid zone size \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	name.data = value[1].data;
+	name.len = p - name.data;
+
+	s.data = p + 1;
+	s.len = value[1].data + value[1].len - s.data;
+
+	size = ngx_parse_size(&s);
+	if (size == NGX_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid zone size \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+	if (size < (ssize_t) (8 * ngx_pagesize)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"zone \"%V\" is too small", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_ctpp2_filter_module);
+	if (zone == NULL) return NGX_CONF_ERROR;
+
+	if (zone->data) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	status = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_status_t));
+	if (status == NULL) return NGX_CONF_ERROR;
+
+	zone->init = ngx_http_ctpp2_status_init_zone;
+	zone->data = status;
+
+	mcf->status_zone = zone;
+
+	return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_ctpp2_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_loc_conf_t *lcf = conf;
+
+	ngx_http_ctpp2_main_conf_t  *mcf;
+	ngx_http_core_loc_conf_t    *clcf;
+	ngx_str_t                   *value;
+
+	if (lcf->status) return "is duplicate";
+
+	value = cf->args->elts;
+
+	if (cf->args->nelts == 1 || ngx_strcmp(value[1].data, "json") == 0) {
+		lcf->status = NGX_HTTP_CTPP2_STATUS_JSON;
+
+	} else if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+		lcf->status = NGX_HTTP_CTPP2_STATUS_PROMETHEUS;
+
+	} else {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid format \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	/* the zone is checked when the http block is over */
+	mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ctpp2_filter_module);
+	mcf->status_used = 1;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_ctpp2_status_handler;
+
+	return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_ctpp2_status_t  *ostatus = data;
+	ngx_http_ctpp2_status_t  *status;
+	size_t                    len;
+
+	status = shm_zone->data;
+
+	if (ostatus) {
+		status->sh = ostatus->sh;
+		status->shpool = ostatus->shpool;
+		return NGX_OK;
+	}
+
+	status->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists) {
+		status->sh = status->shpool->data;
+		return NGX_OK;
+	}
+
+	status->sh = ngx_slab_calloc(status->shpool, sizeof(ngx_http_ctpp2_status_sh_t));
+	if (status->sh == NULL) return NGX_ERROR;
+
+	status->shpool->data = status->sh;
+
+	ngx_rbtree_init(&status->sh->rbtree, &status->sh->sentinel, ngx_str_rbtree_insert_value);
+	ngx_queue_init(&status->sh->queue);
+
+	len = sizeof(" in ctpp2 status zone \"\"") + shm_zone->shm.name.len;
+
+	status->shpool->log_ctx = ngx_slab_alloc(status->shpool, len);
+	if (status->shpool->log_ctx == NULL) return NGX_ERROR;
+
+	ngx_sprintf(status->shpool->log_ctx, " in ctpp2 status zone \"%V\"%Z",
+		&shm_zone->shm.name);
+
+	/* templates that don't fit are counted as dropped */
+	status->shpool->log_nomem = 0;
+
+	return NGX_OK;
+}
+
+
+/*
+ * Accounts a finished render, rc is the result of ctpp2_process().
+ */
+void
+ngx_http_ctpp2_status_update(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx, ngx_int_t rc)
+{
+	ngx_http_ctpp2_main_conf_t    *mcf;
+	ngx_http_ctpp2_status_node_t  *node;
+	ngx_uint_t                     error;
+
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_ctpp2_filter_module);
+	if (mcf->status_zone == NULL) return;
+
+	node = ngx_http_ctpp2_status_lookup(mcf->status_zone, ngx_http_ctpp2_tmpl_name(r, ctx),
+		r->connection->log);
+	if (node == NULL) return;
+
+	(void) ngx_atomic_fetch_add(&node->renders, 1);
+
+	if (rc != NGX_DONE) {
+		error = ctx->render.error ? ctx->render.error : CTPP2_ERROR_OTHER;
+		(void) ngx_atomic_fetch_add(&node->errors[error], 1);
+	}
+
+	(void) ngx_atomic_fetch_add(&node->bytes_in, ctx->data_size);
+	(void) ngx_atomic_fetch_add(&node->bytes_out, ctx->render.out_size);
+	(void) ngx_atomic_fetch_add(&node->steps, ctx->render.steps);
+
+	ngx_http_ctpp2_status_hist_add(&node->parse, ctx->render.parse_time);
+	ngx_http_ctpp2_status_hist_add(&node->render, ctx->render.render_time);
+}
+
+
+/*
+ * Templates that didn't fit into the zone aren't remembered, the least
+ * recently used references are freed when there are too many of them.
+ */
+static ngx_http_ctpp2_status_node_t *
+ngx_http_ctpp2_status_lookup(ngx_shm_zone_t *zone, ngx_str_t *path, ngx_log_t *log)
+{
+	ngx_http_ctpp2_status_t       *status;
+	ngx_http_ctpp2_status_ref_t   *ref;
+	ngx_http_ctpp2_status_node_t  *node;
+	ngx_queue_t                   *q;
+	uint32_t                       hash;
+
+	status = zone->data;
+	hash = ngx_crc32_short(path->data, path->len);
+
+	if (ngx_http_ctpp2_status_refs.root == NULL) {
+		ngx_rbtree_init(&ngx_http_ctpp2_status_refs, &ngx_http_ctpp2_status_refs_sentinel,
+			ngx_str_rbtree_insert_value);
+		ngx_queue_init(&ngx_http_ctpp2_status_refs_queue);
+	}
+
+	ref = (ngx_http_ctpp2_status_ref_t *)
+		ngx_str_rbtree_lookup(&ngx_http_ctpp2_status_refs, path, hash);
+
+	if (ref) {
+		ngx_queue_remove(&ref->queue);
+		ngx_queue_insert_head(&ngx_http_ctpp2_status_refs_queue, &ref->queue);
+		return ref->node;
+	}
+
+	ngx_shmtx_lock(&status->shpool->mutex);
+
+	node = (ngx_http_ctpp2_status_node_t *)
+		ngx_str_rbtree_lookup(&status->sh->rbtree, path, hash);
+
+	if (node == NULL) {
+		node = ngx_slab_calloc_locked(status->shpool,
+			sizeof(ngx_http_ctpp2_status_node_t) + path->len);
+
+		if (node) {
+			node->sn.str.data = node->path;
+			node->sn.str.len = path->len;
+			ngx_memcpy(node->path, path->data, path->len);
+			node->sn.node.key = hash;
+
+			ngx_rbtree_insert(&status->sh->rbtree, &node->sn.node);
+			ngx_queue_insert_tail(&status->sh->queue, &node->queue);
+		}
+	}
+
+	ngx_shmtx_unlock(&status->shpool->mutex);
+
+	if (node == NULL) {
+		/* logged once, the rest are only counted */
+		if (ngx_atomic_fetch_add(&status->sh->dropped, 1) == 0) {
+			ngx_log_error(NGX_LOG_WARN, log, 0,
+				"template \"%V\" doesn't fit into ctpp2 status zone \"%V\"",
+				path, &zone->shm.name);
+		}
+		return NULL;
+	}
+
+	if (ngx_http_ctpp2_status_nrefs == NGX_HTTP_CTPP2_STATUS_REFS) {
+		q = ngx_queue_last(&ngx_http_ctpp2_status_refs_queue);
+		ref = ngx_queue_data(q, ngx_http_ctpp2_status_ref_t, queue);
+
+		ngx_queue_remove(q);
+		ngx_rbtree_delete(&ngx_http_ctpp2_status_refs, &ref->sn.node);
+		ngx_free(ref);
+		ngx_http_ctpp2_status_nrefs--;
+	}
+
+	/* the node is found again next time if this fails */
+	ref = ngx_alloc(sizeof(ngx_http_ctpp2_status_ref_t) + path->len, log);
+	if (ref == NULL) return node;
+
+	ref->sn.str.data = (u_char *) ref + sizeof(ngx_http_ctpp2_status_ref_t);
+	ref->sn.str.len = path->len;
+	ngx_memcpy(ref->sn.str.data, path->data, path->len);
+	ref->sn.node.key = hash;
+	ref->node = node;
+
+	ngx_rbtree_insert(&ngx_http_ctpp2_status_refs, &ref->sn.node);
+	ngx_queue_insert_head(&ngx_http_ctpp2_status_refs_queue, &ref->queue);
+	ngx_http_ctpp2_status_nrefs++;
+
+	return node;
+}
+
+
+static void
+ngx_http_ctpp2_status_hist_add(ngx_http_ctpp2_status_hist_t *hist, uint64_t usec)
+{
+	ngx_uint_t  i;
+
+	for (i = 0; i < NGX_HTTP_CTPP2_STATUS_BUCKETS - 1; i++) {
+		if (usec <= ngx_http_ctpp2_status_buckets[i].usec) break;
+	}
+
+	(void) ngx_atomic_fetch_add(&hist->count[i], 1);
+	(void) ngx_atomic_fetch_add(&hist->sum, usec);
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_status_handler(ngx_http_request_t *r)
+{
+	ngx_http_ctpp2_main_conf_t    *mcf;
+	ngx_http_ctpp2_loc_conf_t     *lcf;
+	ngx_http_ctpp2_status_t       *status;
+	ngx_http_ctpp2_status_node_t  *node;
+	ngx_queue_t                   *q;
+	ngx_chain_t                    out;
+	ngx_buf_t                     *b;
+	ngx_int_t                      rc;
+	size_t                         len;
+
+	if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) return NGX_HTTP_NOT_ALLOWED;
+
+	rc = ngx_http_discard_request_body(r);
+	if (rc != NGX_OK) return rc;
+
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_ctpp2_filter_module);
+	lcf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	status = mcf->status_zone->data;
+
+	/* the output is made under the lock, as templates may be added meanwhile */
+	ngx_shmtx_lock(&status->shpool->mutex);
+
+	len = 2048;
+
+	for (q = ngx_queue_head(&status->sh->queue);
+	     q != ngx_queue_sentinel(&status->sh->queue);
+	     q = ngx_queue_next(q))
+	{
+		node = ngx_queue_data(q, ngx_http_ctpp2_status_node_t, queue);
+
+		/* JSON escapes more than labels of Prometheus do */
+		len += (node->sn.str.len + ngx_escape_json(NULL, node->path, node->sn.str.len) + 128)
+		       * NGX_HTTP_CTPP2_STATUS_LINES;
+	}
+
+	b = ngx_create_temp_buf(r->pool, len);
+	if (b == NULL) {
+		ngx_shmtx_unlock(&status->shpool->mutex);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	if (lcf->status == NGX_HTTP_CTPP2_STATUS_PROMETHEUS) {
+		b->last = ngx_http_ctpp2_status_prometheus(b->last, status);
+		ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+	} else {
+		b->last = ngx_http_ctpp2_status_json(b->last, status);
+		ngx_str_set(&r->headers_out.content_type, "application/json");
+	}
+
+	ngx_shmtx_unlock(&status->shpool->mutex);
+
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+	r->headers_out.content_type_lowcase = NULL;
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = b->last - b->pos;
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_ctpp2_status_json(u_char *p, ngx_http_ctpp2_status_t *status)
+{
+	ngx_http_ctpp2_status_node_t  *node;
+	ngx_queue_t                   *q;
+	ngx_uint_t                     i;
+
+	p = ngx_sprintf(p, "{\"dropped\":%uA,\"templates\":{", status->sh->dropped);
+
+	for (q = ngx_queue_head(&status->sh->queue);
+	     q != ngx_queue_sentinel(&status->sh->queue);
+	     q = ngx_queue_next(q))
+	{
+		node = ngx_queue_data(q, ngx_http_ctpp2_status_node_t, queue);
+
+		if (q != ngx_queue_head(&status->sh->queue)) *p++ = ',';
+
+		*p++ = '"';
+		p = (u_char *) ngx_escape_json(p, node->path, node->sn.str.len);
+
+		p = ngx_sprintf(p, "\":{\"renders\":%uA,\"errors\":{", node->renders);
+
+		for (i = 1; i < CTPP2_ERRORS; i++) {
+			p = ngx_sprintf(p, "%s\"%V\":%uA", (i == 1) ? "" : ",",
+				&ngx_http_ctpp2_status_errors[i], node->errors[i]);
+		}
+
+		p = ngx_sprintf(p, "},\"data_bytes\":%uA,\"output_bytes\":%uA,\"vm_steps\":%uA",
+			node->bytes_in, node->bytes_out, node->steps);
+
+		p = ngx_cpymem(p, ",\"parse_time\":", sizeof(",\"parse_time\":") - 1);
+		p = ngx_http_ctpp2_status_json_hist(p, &node->parse);
+
+		p = ngx_cpymem(p, ",\"render_time\":", sizeof(",\"render_time\":") - 1);
+		p = ngx_http_ctpp2_status_json_hist(p, &node->render);
+
+		*p++ = '}';
+	}
+
+	return ngx_cpymem(p, "}}\n", sizeof("}}\n") - 1);
+}
+
+
+/*
+ * Buckets are cumulative, the same as in Prometheus.
+ */
+static u_char *
+ngx_http_ctpp2_status_json_hist(u_char *p, ngx_http_ctpp2_status_hist_t *hist)
+{
+	ngx_atomic_uint_t  n;
+	ngx_uint_t         i;
+	uint64_t           sum;
+
+	sum = hist->sum;
+	p = ngx_sprintf(p, "{\"sum\":%uL.%06uL,\"buckets\":{", sum / 1000000, sum % 1000000);
+
+	n = 0;
+	for (i = 0; i < NGX_HTTP_CTPP2_STATUS_BUCKETS; i++) {
+		n += hist->count[i];
+		p = ngx_sprintf(p, "%s\"%V\":%uA", i ? "," : "", &ngx_http_ctpp2_status_buckets[i].le, n);
+	}
+
+	return ngx_cpymem(p, "}}", 2);
+}
+
+
+static u_char *
+ngx_http_ctpp2_status_prometheus(u_char *p, ngx_http_ctpp2_status_t *status)
+{
+	ngx_http_ctpp2_status_metric_t  *m;
+	ngx_http_ctpp2_status_node_t    *node;
+	ngx_queue_t                     *q;
+	ngx_uint_t                       i;
+
+	static ngx_str_t  parse = ngx_string("ctpp2_parse_seconds");
+	static ngx_str_t  render = ngx_string("ctpp2_render_seconds");
+
+	for (m = ngx_http_ctpp2_status_counters; m->name.len; m++) {
+		p = ngx_sprintf(p, "# HELP %V %V\n# TYPE %V counter\n", &m->name, &m->help, &m->name);
+
+		for (q = ngx_queue_head(&status->sh->queue);
+		     q != ngx_queue_sentinel(&status->sh->queue);
+		     q = ngx_queue_next(q))
+		{
+			node = ngx_queue_data(q, ngx_http_ctpp2_status_node_t, queue);
+
+			p = ngx_sprintf(p, "%V{template=\"", &m->name);
+			p = (u_char *) ngx_http_ctpp2_status_escape(p, node->path, node->sn.str.len);
+			p = ngx_sprintf(p, "\"} %uA\n", *(ngx_atomic_t *) ((u_char *) node + m->offset));
+		}
+	}
+
+	p = ngx_sprintf(p, "# HELP ctpp2_errors_total Renders failed, by class of errors.\n"
+	                   "# TYPE ctpp2_errors_total counter\n");
+
+	for (q = ngx_queue_head(&status->sh->queue);
+	     q != ngx_queue_sentinel(&status->sh->queue);
+	     q = ngx_queue_next(q))
+	{
+		node = ngx_queue_data(q, ngx_http_ctpp2_status_node_t, queue);
+
+		for (i = 1; i < CTPP2_ERRORS; i++) {
+			p = ngx_sprintf(p, "ctpp2_errors_total{template=\"");
+			p = (u_char *) ngx_http_ctpp2_status_escape(p, node->path, node->sn.str.len);
+			p = ngx_sprintf(p, "\",class=\"%V\"} %uA\n",
+				&ngx_http_ctpp2_status_errors[i], node->errors[i]);
+		}
+	}
+
+	p = ngx_sprintf(p, "# HELP %V Time spent on parsing data.\n", &parse);
+	p = ngx_http_ctpp2_status_prometheus_hist(p, status, &parse,
+		offsetof(ngx_http_ctpp2_status_node_t, parse));
+
+	p = ngx_sprintf(p, "# HELP %V Time spent in the VM.\n", &render);
+	p = ngx_http_ctpp2_status_prometheus_hist(p, status, &render,
+		offsetof(ngx_http_ctpp2_status_node_t, render));
+
+	return ngx_sprintf(p, "# HELP ctpp2_dropped_renders_total "
+	                      "Renders of templates that didn't fit into the zone.\n"
+	                      "# TYPE ctpp2_dropped_renders_total counter\n"
+	                      "ctpp2_dropped_renders_total %uA\n", status->sh->dropped);
+}
+
+
+static u_char *
+ngx_http_ctpp2_status_prometheus_hist(u_char *p, ngx_http_ctpp2_status_t *status,
+	ngx_str_t *name, size_t offset)
+{
+	ngx_http_ctpp2_status_node_t  *node;
+	ngx_http_ctpp2_status_hist_t  *hist;
+	ngx_queue_t                   *q;
+	ngx_atomic_uint_t              n;
+	ngx_uint_t                     i;
+	uint64_t                       sum;
+	u_char                        *label, *end;
+
+	p = ngx_sprintf(p, "# TYPE %V histogram\n", name);
+
+	for (q = ngx_queue_head(&status->sh->queue);
+	     q != ngx_queue_sentinel(&status->sh->queue);
+	     q = ngx_queue_next(q))
+	{
+		node = ngx_queue_data(q, ngx_http_ctpp2_status_node_t, queue);
+		hist = (ngx_http_ctpp2_status_hist_t *) ((u_char *) node + offset);
+
+		/* the escaped path is copied from the first line */
+		p = ngx_sprintf(p, "%V_bucket{template=\"", name);
+		label = p;
+		p = (u_char *) ngx_http_ctpp2_status_escape(p, node->path, node->sn.str.len);
+		end = p;
+
+		n = 0;
+		for (i = 0; i < NGX_HTTP_CTPP2_STATUS_BUCKETS; i++) {
+			if (i) {
+				p = ngx_sprintf(p, "%V_bucket{template=\"", name);
+				p = ngx_cpymem(p, label, end - label);
+			}
+
+			n += hist->count[i];
+			p = ngx_sprintf(p, "\",le=\"%V\"} %uA\n", &ngx_http_ctpp2_status_buckets[i].le, n);
+		}
+
+		sum = hist->sum;
+
+		p = ngx_sprintf(p, "%V_sum{template=\"", name);
+		p = ngx_cpymem(p, label, end - label);
+		p = ngx_sprintf(p, "\"} %uL.%06uL\n", sum / 1000000, sum % 1000000);
+
+		p = ngx_sprintf(p, "%V_count{template=\"", name);
+		p = ngx_cpymem(p, label, end - label);
+		p = ngx_sprintf(p, "\"} %uA\n", n);
+	}
+
+	return p;
+}
+
+
+/*
+ * Label values of the Prometheus text format escape only backslashes, quotes
+ * and line feeds.  Returns the number of bytes added if dst is NULL, the same
+ * as ngx_escape_json() does.
+ */
+static uintptr_t
+ngx_http_ctpp2_status_escape(u_char *dst, u_char *src, size_t size)
+{
+	ngx_uint_t  n;
+	u_char      ch;
+
+	if (dst == NULL) {
+		n = 0;
+		while (size--) {
+			ch = *src++;
+			if (ch == '\\' || ch == '"' || ch == '\n') n++;
+		}
+		return (uintptr_t) n;
+	}
+
+	while (size--) {
+		ch = *src++;
+		switch (ch) {
+			case '\\':
+			case '"':
+				*dst++ = '\\';
+				*dst++ = ch;
+				break;
+			case '\n':
+				*dst++ = '\\';
+				*dst++ = 'n';
+				break;
+			default:
+				*dst++ = ch;
+		}
+	}
+
+	return (uintptr_t) dst;
+}
@@ -0,0 +1,25 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_STATUS_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_STATUS_H_INCLUDED_
+
+
+#include "ngx_http_ctpp2_filter_module.h"
+
+
+#define NGX_HTTP_CTPP2_STATUS_JSON        1
+#define NGX_HTTP_CTPP2_STATUS_PROMETHEUS  2
+
+
+char *ngx_http_ctpp2_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_ctpp2_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+void ngx_http_ctpp2_status_update(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx,
+	ngx_int_t rc);
+
+
+#endif /* _NGX_HTTP_CTPP2_STATUS_H_INCLUDED_ */
@@ -0,0 +1,1348 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_tmpl_cache.h"
+
+#if (NGX_HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
+
+typedef struct {
+	ngx_rbtree_node_t    node;
+	ngx_queue_t          queue;
+	ngx_file_uniq_t      uniq;
+	time_t               mtime;
+	size_t               size;
+	ngx_uint_t           count;
+	unsigned             deleted:1;
+	unsigned             crc:1;       /* tested with CRC check */
+	u_char              *tmpl;
+	size_t               len;
+	u_char               path[1];
+} ngx_http_ctpp2_tmpl_cache_node_t;
+
+typedef struct {
+	ngx_rbtree_t         rbtree;
+	ngx_rbtree_node_t    sentinel;
+	ngx_queue_t          queue;
+} ngx_http_ctpp2_tmpl_cache_sh_t;
+
+typedef struct {
+	ngx_http_ctpp2_tmpl_cache_sh_t  *sh;
+	ngx_slab_pool_t                 *shpool;
+} ngx_http_ctpp2_tmpl_cache_t;
+
+typedef struct {
+	ngx_http_ctpp2_tmpl_cache_t       *cache;
+	ngx_http_ctpp2_tmpl_cache_node_t  *node;
+} ngx_http_ctpp2_tmpl_cache_cleanup_t;
+
+
+typedef struct {
+	ngx_str_node_t       sn;
+	ngx_queue_t          queue;
+	ngx_file_uniq_t      uniq;
+	time_t               mtime;
+	size_t               size;
+	time_t               valid;
+	ngx_uint_t           uses;
+	ngx_uint_t           count;
+	unsigned             deleted:1;
+	unsigned             crc:1;       /* tested with CRC check */
+	unsigned             mapped:1;
+	unsigned             watched:1;   /* its directory, stat() isn't needed */
+	ngx_buf_t            tmpl;
+} ngx_http_ctpp2_tmpl_local_node_t;
+
+struct ngx_http_ctpp2_tmpl_local_s {
+	ngx_rbtree_t         rbtree;
+	ngx_rbtree_node_t    sentinel;
+	ngx_queue_t          queue;
+	size_t               size;
+	size_t               max_size;
+#if (NGX_HAVE_INOTIFY)
+	ngx_connection_t    *watch;
+	ngx_rbtree_t         dirs;        /* watched directories */
+	ngx_rbtree_node_t    dirs_sentinel;
+#endif
+};
+
+#if (NGX_HAVE_INOTIFY)
+typedef struct {
+	ngx_rbtree_node_t    node;        /* key is watch descriptor */
+	ngx_str_t            dir;
+} ngx_http_ctpp2_tmpl_local_dir_t;
+
+#define NGX_HTTP_CTPP2_TMPL_WATCH_MASK                                        \
+	(IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE  \
+	 |IN_MOVE_SELF|IN_ONLYDIR)
+#endif
+
+typedef struct {
+	ngx_http_ctpp2_tmpl_local_t       *cache;
+	ngx_http_ctpp2_tmpl_local_node_t  *node;
+} ngx_http_ctpp2_tmpl_local_cleanup_t;
+
+
+typedef struct {
+	ngx_str_node_t       sn;
+	ngx_queue_t          queue;
+	ngx_file_uniq_t      uniq;
+	time_t               mtime;
+	size_t               size;
+	unsigned             crc:1;
+} ngx_http_ctpp2_tmpl_memo_node_t;
+
+#define NGX_HTTP_CTPP2_TMPL_MEMO_MAX  1024
+
+
+typedef struct {
+	void                *addr;
+	size_t               size;
+	ngx_log_t           *log;
+} ngx_http_ctpp2_tmpl_map_t;
+
+
+static ngx_int_t ngx_http_ctpp2_tmpl_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_ctpp2_tmpl_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+	ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_ctpp2_tmpl_cache_node_t *ngx_http_ctpp2_tmpl_cache_lookup(
+	ngx_http_ctpp2_tmpl_cache_t *cache, ngx_str_t *path, uint32_t hash);
+static void *ngx_http_ctpp2_tmpl_cache_alloc(ngx_http_ctpp2_tmpl_cache_t *cache, size_t size);
+static void ngx_http_ctpp2_tmpl_cache_delete(ngx_http_ctpp2_tmpl_cache_t *cache,
+	ngx_http_ctpp2_tmpl_cache_node_t *tn);
+static void ngx_http_ctpp2_tmpl_cache_cleanup(void *data);
+
+static ngx_http_ctpp2_tmpl_local_node_t *ngx_http_ctpp2_tmpl_local_lookup(
+	ngx_http_ctpp2_tmpl_local_t *cache, ngx_str_t *path, uint32_t hash);
+static ngx_int_t ngx_http_ctpp2_tmpl_local_reserve(ngx_http_ctpp2_tmpl_local_t *cache,
+	size_t size);
+static void ngx_http_ctpp2_tmpl_local_delete(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_tmpl_local_node_t *tn);
+static void ngx_http_ctpp2_tmpl_local_free(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_tmpl_local_node_t *tn);
+static void ngx_http_ctpp2_tmpl_local_cleanup(void *data);
+#if (NGX_HAVE_INOTIFY)
+static void ngx_http_ctpp2_tmpl_local_add_watch(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_tmpl_local_node_t *tn, ngx_log_t *log);
+static void ngx_http_ctpp2_tmpl_local_watch_handler(ngx_event_t *rev);
+static void ngx_http_ctpp2_tmpl_local_expire(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_str_t *dir);
+#endif
+
+static ngx_http_ctpp2_tmpl_memo_node_t *ngx_http_ctpp2_tmpl_memo_lookup(
+	ngx_http_ctpp2_ctx_t *ctx);
+
+static void ngx_http_ctpp2_tmpl_unmap(void *data);
+
+
+/* per worker results of template tests */
+static ngx_rbtree_t       ngx_http_ctpp2_tmpl_memo;
+static ngx_rbtree_node_t  ngx_http_ctpp2_tmpl_memo_sentinel;
+static ngx_queue_t        ngx_http_ctpp2_tmpl_memo_queue;
+static ngx_uint_t         ngx_http_ctpp2_tmpl_memo_n;
+
+
+char *
+ngx_http_ctpp2_tmpl_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_main_conf_t *mcf = conf;
+
+	ngx_str_t                    *value, name, s;
+	ssize_t                       size;
+	u_char                       *p;
+	ngx_http_ctpp2_tmpl_cache_t  *cache;
+
+	if (mcf->tmpl_cache) return "is duplicate";
+
+	value = cf->args->elts;
+
+	if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid parameter \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	name.data = value[1].data + 5;
+	p = (u_char *) ngx_strchr(name.data, ':');
+	if (p == NULL || p == name.data) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid zone \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+	name.len = p - name.data;
+
+	s.data = p + 1;
+	s.len = value[1].data + value[1].len - s.data;
+
+	size = ngx_parse_size(&s);
+	if (size == NGX_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid zone size \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+	if (size < (ssize_t) (8 * ngx_pagesize)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"zone \"%V\" is too small", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_tmpl_cache_t));
+	if (cache == NULL) return NGX_CONF_ERROR;
+
+	mcf->tmpl_cache = ngx_shared_memory_add(cf, &name, size, &ngx_http_ctpp2_filter_module);
+	if (mcf->tmpl_cache == NULL) return NGX_CONF_ERROR;
+
+	if (mcf->tmpl_cache->data) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	mcf->tmpl_cache->init = ngx_http_ctpp2_tmpl_cache_init_zone;
+	mcf->tmpl_cache->data = cache;
+
+	return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_tmpl_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_ctpp2_tmpl_cache_t  *ocache = data;
+	ngx_http_ctpp2_tmpl_cache_t  *cache;
+	size_t                        len;
+
+	cache = shm_zone->data;
+
+	/* templates loaded before reconfiguration stay valid */
+	if (ocache) {
+		cache->sh = ocache->sh;
+		cache->shpool = ocache->shpool;
+		return NGX_OK;
+	}
+
+	cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists) {
+		cache->sh = cache->shpool->data;
+		return NGX_OK;
+	}
+
+	cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_ctpp2_tmpl_cache_sh_t));
+	if (cache->sh == NULL) return NGX_ERROR;
+
+	cache->shpool->data = cache->sh;
+
+	ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+		ngx_http_ctpp2_tmpl_cache_rbtree_insert_value);
+	ngx_queue_init(&cache->sh->queue);
+
+	len = sizeof(" in ctpp2 template cache zone \"\"") + shm_zone->shm.name.len;
+
+	cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+	if (cache->shpool->log_ctx == NULL) return NGX_ERROR;
+
+	ngx_sprintf(cache->shpool->log_ctx, " in ctpp2 template cache zone \"%V\"%Z",
+		&shm_zone->shm.name);
+
+	/* running out of memory is normal, the oldest templates get evicted */
+	cache->shpool->log_nomem = 0;
+
+	return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_tmpl_cache_get(ngx_http_request_t *r, ngx_shm_zone_t *zone,
+	ngx_http_ctpp2_ctx_t *ctx, off_t size)
+{
+	ngx_http_ctpp2_tmpl_cache_t          *cache;
+	ngx_http_ctpp2_tmpl_cache_node_t     *tn;
+	ngx_http_ctpp2_tmpl_cache_cleanup_t  *ccln;
+	ngx_pool_cleanup_t                   *cln;
+	ngx_buf_t                            *b;
+	uint32_t                              hash;
+
+	cache = zone->data;
+	hash = ngx_crc32_short(ctx->tmpl_path.data, ctx->tmpl_path.len);
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL) return NGX_ERROR;
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_ctpp2_tmpl_cache_cleanup_t));
+	if (cln == NULL) return NGX_ERROR;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	tn = ngx_http_ctpp2_tmpl_cache_lookup(cache, &ctx->tmpl_path, hash);
+	if (tn == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_DECLINED;
+	}
+
+	if (tn->uniq != ctx->tmpl_uniq || tn->mtime != ctx->tmpl_mtime
+	    || tn->size != (size_t) size)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http ctpp2 template cache: \"%V\" is outdated", &ctx->tmpl_path);
+		ngx_http_ctpp2_tmpl_cache_delete(cache, tn);
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_DECLINED;
+	}
+
+	tn->count++;
+	ngx_queue_remove(&tn->queue);
+	ngx_queue_insert_head(&cache->sh->queue, &tn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ccln = cln->data;
+	ccln->cache = cache;
+	ccln->node = tn;
+	cln->handler = ngx_http_ctpp2_tmpl_cache_cleanup;
+
+	b->start = tn->tmpl;
+	b->end = tn->tmpl + tn->size;
+	b->pos = b->start;
+	b->last = b->end;
+	b->memory = 1;
+
+	ctx->tmpl = b;
+	ctx->tmpl_checked = tn->crc;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 template cache: \"%V\" found", &ctx->tmpl_path);
+
+	return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_tmpl_cache_put(ngx_http_request_t *r, ngx_shm_zone_t *zone,
+	ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_tmpl_cache_t       *cache;
+	ngx_http_ctpp2_tmpl_cache_node_t  *tn;
+	ngx_str_t                         *path;
+	size_t                             size;
+	uint32_t                           hash;
+
+	cache = zone->data;
+	path = &ctx->tmpl_path;
+	size = ctx->tmpl->last - ctx->tmpl->pos;
+	hash = ngx_crc32_short(path->data, path->len);
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	tn = ngx_http_ctpp2_tmpl_cache_lookup(cache, path, hash);
+	if (tn) {
+		if (tn->uniq == ctx->tmpl_uniq && tn->mtime == ctx->tmpl_mtime && tn->size == size) {
+			/* another worker has been faster */
+			if (ctx->tmpl_checked) tn->crc = 1;
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			return NGX_OK;
+		}
+		ngx_http_ctpp2_tmpl_cache_delete(cache, tn);
+	}
+
+	tn = ngx_http_ctpp2_tmpl_cache_alloc(cache,
+		sizeof(ngx_http_ctpp2_tmpl_cache_node_t) + path->len);
+	if (tn == NULL) goto failed;
+
+	tn->tmpl = ngx_http_ctpp2_tmpl_cache_alloc(cache, size);
+	if (tn->tmpl == NULL) {
+		ngx_slab_free_locked(cache->shpool, tn);
+		goto failed;
+	}
+
+	ngx_memcpy(tn->tmpl, ctx->tmpl->pos, size);
+	ngx_memcpy(tn->path, path->data, path->len);
+
+	tn->node.key = hash;
+	tn->len = path->len;
+	tn->uniq = ctx->tmpl_uniq;
+	tn->mtime = ctx->tmpl_mtime;
+	tn->size = size;
+	tn->count = 0;
+	tn->deleted = 0;
+	tn->crc = ctx->tmpl_checked;
+
+	ngx_rbtree_insert(&cache->sh->rbtree, &tn->node);
+	ngx_queue_insert_head(&cache->sh->queue, &tn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 template cache: \"%V\" stored, %uz bytes", path, size);
+
+	return NGX_OK;
+
+failed:
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+		"Template \"%V\" (%uz bytes) doesn't fit into ctpp2 template cache", path, size);
+
+	return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+	ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	ngx_rbtree_node_t                 **p;
+	ngx_http_ctpp2_tmpl_cache_node_t   *tn, *tnt;
+
+	for ( ;; ) {
+		if (node->key < temp->key) {
+			p = &temp->left;
+		} else if (node->key > temp->key) {
+			p = &temp->right;
+		} else {
+			tn = (ngx_http_ctpp2_tmpl_cache_node_t *) node;
+			tnt = (ngx_http_ctpp2_tmpl_cache_node_t *) temp;
+			p = (ngx_memn2cmp(tn->path, tnt->path, tn->len, tnt->len) < 0)
+				? &temp->left : &temp->right;
+		}
+
+		if (*p == sentinel) break;
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+
+static ngx_http_ctpp2_tmpl_cache_node_t *
+ngx_http_ctpp2_tmpl_cache_lookup(ngx_http_ctpp2_tmpl_cache_t *cache, ngx_str_t *path,
+	uint32_t hash)
+{
+	ngx_int_t                          rc;
+	ngx_rbtree_node_t                 *node, *sentinel;
+	ngx_http_ctpp2_tmpl_cache_node_t  *tn;
+
+	node = cache->sh->rbtree.root;
+	sentinel = cache->sh->rbtree.sentinel;
+
+	while (node != sentinel) {
+		if (hash < node->key) {
+			node = node->left;
+			continue;
+		}
+		if (hash > node->key) {
+			node = node->right;
+			continue;
+		}
+
+		tn = (ngx_http_ctpp2_tmpl_cache_node_t *) node;
+		rc = ngx_memn2cmp(path->data, tn->path, path->len, tn->len);
+		if (rc == 0) return tn;
+
+		node = (rc < 0) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+
+static void *
+ngx_http_ctpp2_tmpl_cache_alloc(ngx_http_ctpp2_tmpl_cache_t *cache, size_t size)
+{
+	void                              *p;
+	ngx_queue_t                       *q;
+	ngx_http_ctpp2_tmpl_cache_node_t  *tn;
+
+	for ( ;; ) {
+		p = ngx_slab_alloc_locked(cache->shpool, size);
+		if (p) return p;
+
+		/* evict the least recently used template nobody renders now */
+		for (q = ngx_queue_last(&cache->sh->queue);
+		     q != ngx_queue_sentinel(&cache->sh->queue);
+		     q = ngx_queue_prev(q))
+		{
+			tn = ngx_queue_data(q, ngx_http_ctpp2_tmpl_cache_node_t, queue);
+			if (tn->count == 0) break;
+		}
+
+		if (q == ngx_queue_sentinel(&cache->sh->queue)) return NULL;
+
+		ngx_http_ctpp2_tmpl_cache_delete(cache, tn);
+	}
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_cache_delete(ngx_http_ctpp2_tmpl_cache_t *cache,
+	ngx_http_ctpp2_tmpl_cache_node_t *tn)
+{
+	ngx_rbtree_delete(&cache->sh->rbtree, &tn->node);
+	ngx_queue_remove(&tn->queue);
+
+	if (tn->count) {
+		/* the last request using it will free the memory */
+		tn->deleted = 1;
+		return;
+	}
+
+	ngx_slab_free_locked(cache->shpool, tn->tmpl);
+	ngx_slab_free_locked(cache->shpool, tn);
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_cache_cleanup(void *data)
+{
+	ngx_http_ctpp2_tmpl_cache_cleanup_t  *ccln = data;
+
+	ngx_http_ctpp2_tmpl_cache_t       *cache;
+	ngx_http_ctpp2_tmpl_cache_node_t  *tn;
+
+	cache = ccln->cache;
+	tn = ccln->node;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	tn->count--;
+
+	if (tn->deleted && tn->count == 0) {
+		ngx_slab_free_locked(cache->shpool, tn->tmpl);
+		ngx_slab_free_locked(cache->shpool, tn);
+	}
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+ngx_http_ctpp2_tmpl_local_t *
+ngx_http_ctpp2_tmpl_local_create(ngx_conf_t *cf, size_t size)
+{
+	ngx_http_ctpp2_tmpl_local_t  *cache;
+
+	cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_tmpl_local_t));
+	if (cache == NULL) return NULL;
+
+	ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_str_rbtree_insert_value);
+	ngx_queue_init(&cache->queue);
+	cache->max_size = size;
+
+	return cache;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_tmpl_local_get(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_tmpl_local_node_t     *tn;
+	ngx_http_ctpp2_tmpl_local_cleanup_t  *lcln;
+	ngx_http_core_loc_conf_t             *clcf;
+	ngx_pool_cleanup_t                   *cln;
+	ngx_file_info_t                       fi;
+	time_t                                now;
+
+	tn = ngx_http_ctpp2_tmpl_local_lookup(cache, &ctx->tmpl_path,
+		ngx_crc32_short(ctx->tmpl_path.data, ctx->tmpl_path.len));
+	if (tn == NULL || tn->tmpl.start == NULL) return NGX_DECLINED;
+
+	now = ngx_time();
+
+	if (!tn->watched && now >= tn->valid) {
+		if (ngx_file_info(ctx->tmpl_path.data, &fi) == NGX_FILE_ERROR
+		    || ngx_file_uniq(&fi) != tn->uniq
+		    || ngx_file_mtime(&fi) != tn->mtime
+		    || ngx_file_size(&fi) != (off_t) tn->size)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"http ctpp2 worker template cache: \"%V\" is outdated", &ctx->tmpl_path);
+			ngx_http_ctpp2_tmpl_local_delete(cache, tn);
+			return NGX_DECLINED;
+		}
+
+		clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+		tn->valid = now + clcf->open_file_cache_valid;
+
+#if (NGX_HAVE_INOTIFY)
+		ngx_http_ctpp2_tmpl_local_add_watch(cache, tn, r->connection->log);
+#endif
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_ctpp2_tmpl_local_cleanup_t));
+	if (cln == NULL) return NGX_ERROR;
+
+	lcln = cln->data;
+	lcln->cache = cache;
+	lcln->node = tn;
+	cln->handler = ngx_http_ctpp2_tmpl_local_cleanup;
+
+	tn->count++;
+	ngx_queue_remove(&tn->queue);
+	ngx_queue_insert_head(&cache->queue, &tn->queue);
+
+	ctx->tmpl = &tn->tmpl;
+	ctx->tmpl_uniq = tn->uniq;
+	ctx->tmpl_mtime = tn->mtime;
+	ctx->tmpl_checked = tn->crc;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 worker template cache: \"%V\" found", &ctx->tmpl_path);
+
+	return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_ctpp2_tmpl_local_put(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_tmpl_local_node_t     *tn;
+	ngx_http_ctpp2_tmpl_local_cleanup_t  *lcln;
+	ngx_http_core_loc_conf_t             *clcf;
+	ngx_pool_cleanup_t                   *cln;
+	ngx_str_t                            *path;
+	ngx_int_t                             rc;
+	uint32_t                              hash;
+	size_t                                size;
+	u_char                               *p;
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	path = &ctx->tmpl_path;
+	size = ctx->tmpl->last - ctx->tmpl->pos;
+	hash = ngx_crc32_short(path->data, path->len);
+
+	tn = ngx_http_ctpp2_tmpl_local_lookup(cache, path, hash);
+
+	if (tn && (tn->uniq != ctx->tmpl_uniq || tn->mtime != ctx->tmpl_mtime
+	           || tn->size != size))
+	{
+		ngx_http_ctpp2_tmpl_local_delete(cache, tn);
+		tn = NULL;
+	}
+
+	if (tn == NULL) {
+		if (ngx_http_ctpp2_tmpl_local_reserve(cache,
+			sizeof(ngx_http_ctpp2_tmpl_local_node_t) + path->len + 1) != NGX_OK)
+		{
+			return NGX_DECLINED;
+		}
+
+		tn = ngx_alloc(sizeof(ngx_http_ctpp2_tmpl_local_node_t) + path->len + 1,
+			r->connection->log);
+		if (tn == NULL) return NGX_ERROR;
+
+		ngx_memzero(tn, sizeof(ngx_http_ctpp2_tmpl_local_node_t));
+
+		tn->sn.str.data = (u_char *) tn + sizeof(ngx_http_ctpp2_tmpl_local_node_t);
+		tn->sn.str.len = path->len;
+		ngx_memcpy(tn->sn.str.data, path->data, path->len);
+		tn->sn.str.data[path->len] = '\0';
+
+		tn->sn.node.key = hash;
+		tn->uniq = ctx->tmpl_uniq;
+		tn->mtime = ctx->tmpl_mtime;
+		tn->size = size;
+
+		cache->size += sizeof(ngx_http_ctpp2_tmpl_local_node_t) + path->len + 1;
+
+		ngx_rbtree_insert(&cache->rbtree, &tn->sn.node);
+		ngx_queue_insert_head(&cache->queue, &tn->queue);
+	}
+
+	tn->valid = ngx_time() + clcf->open_file_cache_valid;
+	if (ctx->tmpl_checked) tn->crc = 1;
+
+	if (tn->tmpl.start || ++tn->uses < clcf->open_file_cache_min_uses) {
+		return NGX_OK;
+	}
+
+	/* pin the node so that making room doesn't evict it */
+	tn->count++;
+	rc = ngx_http_ctpp2_tmpl_local_reserve(cache, size);
+	tn->count--;
+
+	if (rc != NGX_OK) {
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"Template \"%V\" (%uz bytes) doesn't fit into ctpp2 worker template cache",
+			path, size);
+		return NGX_DECLINED;
+	}
+
+	if (ctx->tmpl_map) {
+		/* take over the mapping instead of copying it */
+		cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_ctpp2_tmpl_local_cleanup_t));
+		if (cln == NULL) return NGX_ERROR;
+
+		tn->tmpl = *ctx->tmpl;
+		tn->mapped = 1;
+
+		ctx->tmpl_map->handler = NULL;
+		ctx->tmpl_map = NULL;
+		ctx->tmpl = &tn->tmpl;
+
+		lcln = cln->data;
+		lcln->cache = cache;
+		lcln->node = tn;
+		cln->handler = ngx_http_ctpp2_tmpl_local_cleanup;
+
+		tn->count++;
+
+	} else {
+		p = ngx_alloc(size, r->connection->log);
+		if (p == NULL) return NGX_ERROR;
+
+		ngx_memcpy(p, ctx->tmpl->pos, size);
+
+		tn->tmpl.start = p;
+		tn->tmpl.end = p + size;
+		tn->tmpl.pos = p;
+		tn->tmpl.last = p + size;
+		tn->tmpl.memory = 1;
+	}
+
+	cache->size += size;
+
+#if (NGX_HAVE_INOTIFY)
+	ngx_http_ctpp2_tmpl_local_add_watch(cache, tn, r->connection->log);
+#endif
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 worker template cache: \"%V\" stored, %uz bytes", path, size);
+
+	return NGX_OK;
+}
+
+
+/*
+ * Loads a template into the worker cache on start, nothing is evicted for
+ * it.  Returns NGX_DECLINED if the template is cached already or doesn't fit.
+ */
+ngx_int_t
+ngx_http_ctpp2_tmpl_local_preload(ngx_http_ctpp2_tmpl_local_t *cache, ngx_str_t *path,
+	size_t *size, ngx_log_t *log)
+{
+	ngx_http_ctpp2_tmpl_local_node_t  *tn;
+	ngx_file_info_t                    fi;
+	ngx_fd_t                           fd;
+	ngx_buf_t                          b;
+	uint32_t                           hash;
+	size_t                             len;
+	ssize_t                            n;
+	u_char                            *p;
+
+	hash = ngx_crc32_short(path->data, path->len);
+	if (ngx_http_ctpp2_tmpl_local_lookup(cache, path, hash)) return NGX_DECLINED;
+
+	fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%V\" failed", path);
+		return NGX_ERROR;
+	}
+
+	tn = NULL;
+	p = NULL;
+
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_fd_info_n " \"%V\" failed", path);
+		goto failed;
+	}
+
+	*size = ngx_file_size(&fi);
+	len = sizeof(ngx_http_ctpp2_tmpl_local_node_t) + path->len + 1;
+
+	if (cache->size + len + *size > cache->max_size) {
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"Template \"%V\" (%uz bytes) doesn't fit into ctpp2 worker template cache",
+			path, *size);
+		if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+			ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%V\" failed", path);
+		}
+		return NGX_DECLINED;
+	}
+
+	tn = ngx_alloc(len, log);
+	p = ngx_alloc(*size, log);
+	if (tn == NULL || p == NULL) goto failed;
+
+	n = ngx_read_fd(fd, p, *size);
+	if (n == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_read_fd_n " \"%V\" failed", path);
+		goto failed;
+	}
+	if ((size_t) n != *size) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, ngx_read_fd_n " has read only %z of %uz from \"%V\"",
+			n, *size, path);
+		goto failed;
+	}
+
+	ngx_memzero(&b, sizeof(ngx_buf_t));
+	b.start = p;
+	b.end = p + *size;
+	b.pos = p;
+	b.last = p + *size;
+	b.memory = 1;
+
+	if (ctpp2_tmpltest(&b, 1, log) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "Template \"%V\" is not preloaded", path);
+		goto failed;
+	}
+
+	ngx_memzero(tn, sizeof(ngx_http_ctpp2_tmpl_local_node_t));
+
+	tn->sn.str.data = (u_char *) tn + sizeof(ngx_http_ctpp2_tmpl_local_node_t);
+	tn->sn.str.len = path->len;
+	ngx_memcpy(tn->sn.str.data, path->data, path->len);
+	tn->sn.str.data[path->len] = '\0';
+
+	tn->sn.node.key = hash;
+	tn->uniq = ngx_file_uniq(&fi);
+	tn->mtime = ngx_file_mtime(&fi);
+	tn->size = *size;
+	tn->crc = 1;
+	tn->tmpl = b;
+
+	cache->size += len + *size;
+
+	ngx_rbtree_insert(&cache->rbtree, &tn->sn.node);
+	ngx_queue_insert_head(&cache->queue, &tn->queue);
+
+#if (NGX_HAVE_INOTIFY)
+	ngx_http_ctpp2_tmpl_local_add_watch(cache, tn, log);
+#endif
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%V\" failed", path);
+	}
+
+	return NGX_OK;
+
+failed:
+
+	if (tn) ngx_free(tn);
+	if (p) ngx_free(p);
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%V\" failed", path);
+	}
+
+	return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_INOTIFY)
+
+/*
+ * Cached templates are invalidated as soon as anything happens to their
+ * files, so they aren't checked on requests.  Directories are watched as
+ * templates get into the cache.
+ */
+ngx_int_t
+ngx_http_ctpp2_tmpl_local_watch(ngx_http_ctpp2_tmpl_local_t *cache, ngx_cycle_t *cycle)
+{
+	ngx_connection_t  *c;
+	int                fd;
+
+	ngx_rbtree_init(&cache->dirs, &cache->dirs_sentinel, ngx_rbtree_insert_value);
+
+	fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (fd == -1) {
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "inotify_init1() failed");
+		return NGX_ERROR;
+	}
+
+	c = ngx_get_connection(fd, cycle->log);
+	if (c == NULL) {
+		if (close(fd) == -1) {
+			ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "inotify close() failed");
+		}
+		return NGX_ERROR;
+	}
+
+	c->data = cache;
+	c->read->handler = ngx_http_ctpp2_tmpl_local_watch_handler;
+	c->read->log = cycle->log;
+
+	if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+		ngx_close_connection(c);
+		return NGX_ERROR;
+	}
+
+	cache->watch = c;
+
+	return NGX_OK;
+}
+
+
+void
+ngx_http_ctpp2_tmpl_local_unwatch(ngx_http_ctpp2_tmpl_local_t *cache)
+{
+	if (cache->watch == NULL) return;
+
+	ngx_close_connection(cache->watch);
+	cache->watch = NULL;
+
+	ngx_http_ctpp2_tmpl_local_expire(cache, NULL);
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_local_add_watch(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_tmpl_local_node_t *tn, ngx_log_t *log)
+{
+	ngx_http_ctpp2_tmpl_local_dir_t  *dn;
+	ngx_rbtree_node_t                *node, *sentinel;
+	ngx_str_t                         dir;
+	u_char                           *p, ch;
+	int                               wd;
+
+	if (cache->watch == NULL || tn->watched) return;
+
+	dir = tn->sn.str;
+
+	p = dir.data + dir.len;
+	while (p > dir.data && !ngx_path_separator(p[-1])) p--;
+	if (p == dir.data) return;
+
+	dir.len = p - 1 - dir.data;
+	if (dir.len == 0) dir.len = 1;   /* the root */
+
+	/* the path is null-terminated in place for a moment */
+	ch = dir.data[dir.len];
+	dir.data[dir.len] = '\0';
+
+	wd = inotify_add_watch(cache->watch->fd, (char *) dir.data, NGX_HTTP_CTPP2_TMPL_WATCH_MASK);
+
+	dir.data[dir.len] = ch;
+
+	if (wd == -1) {
+		ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+			"inotify_add_watch(\"%V\") failed, template \"%V\" is checked by stat()",
+			&dir, &tn->sn.str);
+		return;
+	}
+
+	node = cache->dirs.root;
+	sentinel = cache->dirs.sentinel;
+
+	while (node != sentinel) {
+		if ((ngx_rbtree_key_t) wd == node->key) break;
+		node = ((ngx_rbtree_key_t) wd < node->key) ? node->left : node->right;
+	}
+
+	if (node == sentinel) {
+		dn = ngx_alloc(sizeof(ngx_http_ctpp2_tmpl_local_dir_t) + dir.len, log);
+		if (dn == NULL) {
+			(void) inotify_rm_watch(cache->watch->fd, wd);
+			return;
+		}
+
+		dn->node.key = wd;
+		dn->dir.len = dir.len;
+		dn->dir.data = (u_char *) dn + sizeof(ngx_http_ctpp2_tmpl_local_dir_t);
+		ngx_memcpy(dn->dir.data, dir.data, dir.len);
+
+		ngx_rbtree_insert(&cache->dirs, &dn->node);
+
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+			"http ctpp2 worker template cache: watching \"%V\", wd:%d", &dir, wd);
+	}
+
+	tn->watched = 1;
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_local_watch_handler(ngx_event_t *rev)
+{
+	ngx_http_ctpp2_tmpl_local_t       *cache;
+	ngx_http_ctpp2_tmpl_local_node_t  *tn;
+	ngx_http_ctpp2_tmpl_local_dir_t   *dn;
+	ngx_rbtree_node_t                 *node, *sentinel;
+	ngx_connection_t                  *c;
+	struct inotify_event              *ev;
+	ngx_str_t                          path;
+	ngx_err_t                          err;
+	ssize_t                            n;
+	size_t                             len;
+	u_char                            *p, *last;
+	u_char                             name[NGX_MAX_PATH];
+	u_char                             buf[4096]
+	                       __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	c = rev->data;
+	cache = c->data;
+
+	for ( ;; ) {
+		n = read(c->fd, buf, sizeof(buf));
+
+		if (n == -1) {
+			err = ngx_errno;
+			if (err == NGX_EINTR) continue;
+			if (err != NGX_EAGAIN) {
+				ngx_log_error(NGX_LOG_ALERT, rev->log, err, "inotify read() failed");
+			}
+			break;
+		}
+
+		if (n == 0) break;
+
+		last = buf + n;
+
+		for (p = buf; p < last; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				ngx_log_error(NGX_LOG_WARN, rev->log, 0,
+					"inotify queue overflow, all cached templates are checked by stat()");
+				ngx_http_ctpp2_tmpl_local_expire(cache, NULL);
+				continue;
+			}
+
+			node = cache->dirs.root;
+			sentinel = cache->dirs.sentinel;
+
+			while (node != sentinel) {
+				if ((ngx_rbtree_key_t) ev->wd == node->key) break;
+				node = ((ngx_rbtree_key_t) ev->wd < node->key) ? node->left : node->right;
+			}
+
+			if (node == sentinel) continue;
+
+			dn = (ngx_http_ctpp2_tmpl_local_dir_t *) node;
+
+			if (ev->mask & IN_MOVE_SELF) {
+				/* IN_IGNORED follows */
+				(void) inotify_rm_watch(c->fd, ev->wd);
+				continue;
+			}
+
+			if (ev->mask & IN_IGNORED) {
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+					"http ctpp2 worker template cache: \"%V\" isn't watched", &dn->dir);
+				ngx_http_ctpp2_tmpl_local_expire(cache, &dn->dir);
+				ngx_rbtree_delete(&cache->dirs, node);
+				ngx_free(dn);
+				continue;
+			}
+
+			if (ev->len == 0) continue;
+
+			len = ngx_strlen(ev->name);
+			if (dn->dir.len + 1 + len >= NGX_MAX_PATH) continue;
+
+			path.data = name;
+			path.len = ngx_cpymem(name, dn->dir.data, dn->dir.len) - name;
+			if (!ngx_path_separator(name[path.len - 1])) name[path.len++] = '/';
+			path.len = ngx_cpymem(name + path.len, ev->name, len) - name;
+
+			tn = ngx_http_ctpp2_tmpl_local_lookup(cache, &path,
+				ngx_crc32_short(path.data, path.len));
+			if (tn == NULL) continue;
+
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+				"http ctpp2 worker template cache: \"%V\" is outdated, mask:%xd",
+				&path, ev->mask);
+
+			ngx_http_ctpp2_tmpl_local_delete(cache, tn);
+		}
+	}
+
+	if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ALERT, rev->log, 0,
+			"inotify events are lost, cached templates are checked by stat()");
+		ngx_http_ctpp2_tmpl_local_unwatch(cache);
+	}
+}
+
+
+/*
+ * Templates of the directory (or all of them) are checked by stat() again
+ * until they are watched anew.
+ */
+static void
+ngx_http_ctpp2_tmpl_local_expire(ngx_http_ctpp2_tmpl_local_t *cache, ngx_str_t *dir)
+{
+	ngx_http_ctpp2_tmpl_local_node_t  *tn;
+	ngx_queue_t                       *q;
+	ngx_str_t                         *path;
+	u_char                            *p;
+
+	for (q = ngx_queue_head(&cache->queue);
+	     q != ngx_queue_sentinel(&cache->queue);
+	     q = ngx_queue_next(q))
+	{
+		tn = ngx_queue_data(q, ngx_http_ctpp2_tmpl_local_node_t, queue);
+		path = &tn->sn.str;
+
+		if (dir) {
+			if (path->len <= dir->len || ngx_strncmp(path->data, dir->data, dir->len) != 0) {
+				continue;
+			}
+
+			p = path->data + dir->len;
+
+			if (!ngx_path_separator(p[-1])) {
+				if (!ngx_path_separator(*p)) continue;
+				p++;
+			}
+
+			if (ngx_strlchr(p, path->data + path->len, '/')) continue;
+		}
+
+		tn->watched = 0;
+		tn->valid = 0;
+	}
+}
+
+#endif
+
+
+static ngx_http_ctpp2_tmpl_local_node_t *
+ngx_http_ctpp2_tmpl_local_lookup(ngx_http_ctpp2_tmpl_local_t *cache, ngx_str_t *path,
+	uint32_t hash)
+{
+	return (ngx_http_ctpp2_tmpl_local_node_t *)
+		ngx_str_rbtree_lookup(&cache->rbtree, path, hash);
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_tmpl_local_reserve(ngx_http_ctpp2_tmpl_local_t *cache, size_t size)
+{
+	ngx_queue_t                       *q, *prev;
+	ngx_http_ctpp2_tmpl_local_node_t  *tn;
+
+	if (size > cache->max_size) return NGX_DECLINED;
+
+	q = ngx_queue_last(&cache->queue);
+
+	while (cache->size + size > cache->max_size) {
+		if (q == ngx_queue_sentinel(&cache->queue)) return NGX_DECLINED;
+
+		prev = ngx_queue_prev(q);
+		tn = ngx_queue_data(q, ngx_http_ctpp2_tmpl_local_node_t, queue);
+
+		if (tn->count == 0) ngx_http_ctpp2_tmpl_local_delete(cache, tn);
+
+		q = prev;
+	}
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_local_delete(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_tmpl_local_node_t *tn)
+{
+	ngx_rbtree_delete(&cache->rbtree, &tn->sn.node);
+	ngx_queue_remove(&tn->queue);
+
+	if (tn->count) {
+		tn->deleted = 1;
+		return;
+	}
+
+	ngx_http_ctpp2_tmpl_local_free(cache, tn);
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_local_free(ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_tmpl_local_node_t *tn)
+{
+	cache->size -= sizeof(ngx_http_ctpp2_tmpl_local_node_t) + tn->sn.str.len + 1;
+
+	if (tn->tmpl.start) {
+		cache->size -= tn->tmpl.end - tn->tmpl.start;
+
+		if (tn->mapped) {
+			if (munmap(tn->tmpl.start, tn->tmpl.end - tn->tmpl.start) == -1) {
+				ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+					"munmap(%uz) failed", (size_t) (tn->tmpl.end - tn->tmpl.start));
+			}
+		} else {
+			ngx_free(tn->tmpl.start);
+		}
+	}
+
+	ngx_free(tn);
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_local_cleanup(void *data)
+{
+	ngx_http_ctpp2_tmpl_local_cleanup_t  *lcln = data;
+
+	lcln->node->count--;
+
+	if (lcln->node->deleted && lcln->node->count == 0) {
+		ngx_http_ctpp2_tmpl_local_free(lcln->cache, lcln->node);
+	}
+}
+
+
+/*
+ * Templates loaded from files are tested once per version (path, inode,
+ * mtime and size), not once per request.  mtime has a resolution of a second,
+ * so a version tested in the second it was written isn't remembered: the file
+ * may be rewritten in place within the same second keeping all of them.
+ */
+
+ngx_int_t
+ngx_http_ctpp2_tmpl_memo_test(ngx_http_ctpp2_ctx_t *ctx, ngx_flag_t check)
+{
+	ngx_http_ctpp2_tmpl_memo_node_t  *mn;
+
+	if (ctx->tmpl_path.len == 0) return NGX_DECLINED;
+
+	mn = ngx_http_ctpp2_tmpl_memo_lookup(ctx);
+
+	if (mn == NULL
+	    || mn->uniq != ctx->tmpl_uniq || mn->mtime != ctx->tmpl_mtime
+	    || mn->size != (size_t) (ctx->tmpl->last - ctx->tmpl->pos)
+	    || (check && !mn->crc))
+	{
+		return NGX_DECLINED;
+	}
+
+	ngx_queue_remove(&mn->queue);
+	ngx_queue_insert_head(&ngx_http_ctpp2_tmpl_memo_queue, &mn->queue);
+
+	return NGX_OK;
+}
+
+
+void
+ngx_http_ctpp2_tmpl_memo_add(ngx_http_ctpp2_ctx_t *ctx, ngx_flag_t check, ngx_log_t *log)
+{
+	ngx_http_ctpp2_tmpl_memo_node_t  *mn;
+	ngx_str_t                        *path;
+	ngx_queue_t                      *q;
+
+	path = &ctx->tmpl_path;
+	if (path->len == 0) return;
+
+	/* too recent to tell it from a rewrite, it is tested again */
+	if (ctx->tmpl_mtime >= ngx_time()) return;
+
+	mn = ngx_http_ctpp2_tmpl_memo_lookup(ctx);
+
+	if (mn == NULL) {
+		if (ngx_http_ctpp2_tmpl_memo_n == NGX_HTTP_CTPP2_TMPL_MEMO_MAX) {
+			q = ngx_queue_last(&ngx_http_ctpp2_tmpl_memo_queue);
+			mn = ngx_queue_data(q, ngx_http_ctpp2_tmpl_memo_node_t, queue);
+
+			ngx_queue_remove(q);
+			ngx_rbtree_delete(&ngx_http_ctpp2_tmpl_memo, &mn->sn.node);
+			ngx_free(mn);
+			ngx_http_ctpp2_tmpl_memo_n--;
+		}
+
+		mn = ngx_alloc(sizeof(ngx_http_ctpp2_tmpl_memo_node_t) + path->len, log);
+		if (mn == NULL) return;
+
+		mn->sn.str.data = (u_char *) mn + sizeof(ngx_http_ctpp2_tmpl_memo_node_t);
+		mn->sn.str.len = path->len;
+		ngx_memcpy(mn->sn.str.data, path->data, path->len);
+		mn->sn.node.key = ngx_crc32_short(path->data, path->len);
+		mn->crc = 0;
+
+		ngx_rbtree_insert(&ngx_http_ctpp2_tmpl_memo, &mn->sn.node);
+		ngx_queue_insert_head(&ngx_http_ctpp2_tmpl_memo_queue, &mn->queue);
+		ngx_http_ctpp2_tmpl_memo_n++;
+
+	} else if (mn->uniq != ctx->tmpl_uniq || mn->mtime != ctx->tmpl_mtime
+	           || mn->size != (size_t) (ctx->tmpl->last - ctx->tmpl->pos))
+	{
+		mn->crc = 0;
+	}
+
+	mn->uniq = ctx->tmpl_uniq;
+	mn->mtime = ctx->tmpl_mtime;
+	mn->size = ctx->tmpl->last - ctx->tmpl->pos;
+	mn->crc |= check ? 1 : 0;
+}
+
+
+static ngx_http_ctpp2_tmpl_memo_node_t *
+ngx_http_ctpp2_tmpl_memo_lookup(ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_tmpl_memo_node_t  *mn;
+	ngx_str_t                        *path;
+
+	if (ngx_http_ctpp2_tmpl_memo.root == NULL) {
+		ngx_rbtree_init(&ngx_http_ctpp2_tmpl_memo, &ngx_http_ctpp2_tmpl_memo_sentinel,
+			ngx_str_rbtree_insert_value);
+		ngx_queue_init(&ngx_http_ctpp2_tmpl_memo_queue);
+	}
+
+	path = &ctx->tmpl_path;
+
+	mn = (ngx_http_ctpp2_tmpl_memo_node_t *) ngx_str_rbtree_lookup(&ngx_http_ctpp2_tmpl_memo,
+		path, ngx_crc32_short(path->data, path->len));
+
+	return mn;
+}
+
+
+ngx_pool_cleanup_t *
+ngx_http_ctpp2_tmpl_map(ngx_pool_t *pool, ngx_fd_t fd, size_t size, ngx_buf_t *b,
+	ngx_log_t *log)
+{
+	ngx_http_ctpp2_tmpl_map_t  *map;
+	ngx_pool_cleanup_t         *cln;
+	u_char                     *addr;
+
+	cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_ctpp2_tmpl_map_t));
+	if (cln == NULL) return NULL;
+
+	/*
+	 * read-only shared mapping: all workers use the same page cache
+	 * pages, template tests must never write into the image
+	 */
+	addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"mmap(%uz) of template failed", size);
+		return NULL;
+	}
+
+	map = cln->data;
+	map->addr = addr;
+	map->size = size;
+	map->log = log;
+	cln->handler = ngx_http_ctpp2_tmpl_unmap;
+
+	b->start = addr;
+	b->end = addr + size;
+	b->pos = b->start;
+	b->last = b->end;
+	b->mmap = 1;
+
+	return cln;
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_unmap(void *data)
+{
+	ngx_http_ctpp2_tmpl_map_t  *map = data;
+
+	if (munmap(map->addr, map->size) == -1) {
+		ngx_log_error(NGX_LOG_ALERT, map->log, ngx_errno,
+			"munmap(%uz) failed", map->size);
+	}
+}
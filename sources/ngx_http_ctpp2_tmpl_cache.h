@@ -0,0 +1,40 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_TMPL_CACHE_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_TMPL_CACHE_H_INCLUDED_
+
+
+#include "ngx_http_ctpp2_filter_module.h"
+
+
+char *ngx_http_ctpp2_tmpl_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_ctpp2_tmpl_cache_get(ngx_http_request_t *r, ngx_shm_zone_t *zone,
+	ngx_http_ctpp2_ctx_t *ctx, off_t size);
+ngx_int_t ngx_http_ctpp2_tmpl_cache_put(ngx_http_request_t *r, ngx_shm_zone_t *zone,
+	ngx_http_ctpp2_ctx_t *ctx);
+
+ngx_int_t ngx_http_ctpp2_tmpl_memo_test(ngx_http_ctpp2_ctx_t *ctx, ngx_flag_t check);
+void ngx_http_ctpp2_tmpl_memo_add(ngx_http_ctpp2_ctx_t *ctx, ngx_flag_t check, ngx_log_t *log);
+
+ngx_pool_cleanup_t *ngx_http_ctpp2_tmpl_map(ngx_pool_t *pool, ngx_fd_t fd, size_t size,
+	ngx_buf_t *b, ngx_log_t *log);
+
+ngx_http_ctpp2_tmpl_local_t *ngx_http_ctpp2_tmpl_local_create(ngx_conf_t *cf, size_t size);
+ngx_int_t ngx_http_ctpp2_tmpl_local_get(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_ctx_t *ctx);
+ngx_int_t ngx_http_ctpp2_tmpl_local_put(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_local_t *cache,
+	ngx_http_ctpp2_ctx_t *ctx);
+ngx_int_t ngx_http_ctpp2_tmpl_local_preload(ngx_http_ctpp2_tmpl_local_t *cache, ngx_str_t *path,
+	size_t *size, ngx_log_t *log);
+#if (NGX_HAVE_INOTIFY)
+ngx_int_t ngx_http_ctpp2_tmpl_local_watch(ngx_http_ctpp2_tmpl_local_t *cache, ngx_cycle_t *cycle);
+void ngx_http_ctpp2_tmpl_local_unwatch(ngx_http_ctpp2_tmpl_local_t *cache);
+#endif
+
+
+#endif /* _NGX_HTTP_CTPP2_TMPL_CACHE_H_INCLUDED_ */
@@ -5,6 +5,7 @@
 
 
 #include "ngx_http_ctpp2_filter_module.h"
+#include "ngx_http_ctpp2_tmpl_cache.h"
 
 
 static ngx_int_t ngx_http_ctpp2_tmpl_loader_filter(ngx_http_request_t *r, ngx_chain_t *in);
@@ -52,6 +53,8 @@ ngx_http_ctpp2_tmpl_loader_filter(ngx_http_request_t *r, ngx_chain_t *in)
 	ngx_log_t                 *log;
 	ngx_open_file_info_t       of;
 	ngx_http_core_loc_conf_t  *clcf;
+	ngx_http_ctpp2_main_conf_t  *mcf;
+	ngx_http_ctpp2_loc_conf_t   *conf;
 	ngx_buf_t                 *b;
 	ngx_chain_t                out;
 	
@@ -60,7 +63,7 @@ ngx_http_ctpp2_tmpl_loader_filter(ngx_http_request_t *r, ngx_chain_t *in)
 	}
 	
 	ctx = ngx_http_get_module_ctx(r, ngx_http_ctpp2_filter_module);
-	if (ctx == NULL || ctx->tmpl) {
+	if (ctx == NULL || ctx->done || ctx->tmpl || ctx->fetch) {
 		return ngx_http_next_filter(r, in);
 	}
 
@@ -100,6 +103,40 @@ ngx_http_ctpp2_tmpl_loader_filter(ngx_http_request_t *r, ngx_chain_t *in)
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 	
+	ctx->tmpl_uniq = of.uniq;
+	ctx->tmpl_mtime = of.mtime;
+	
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_ctpp2_filter_module);
+	if (mcf->tmpl_cache) {
+		switch (ngx_http_ctpp2_tmpl_cache_get(r, mcf->tmpl_cache, ctx, of.size)) {
+			case NGX_OK:
+				if (ngx_http_ctpp2_tmpl_cached(r, ctx) != NGX_OK) {
+					return NGX_HTTP_INTERNAL_SERVER_ERROR;
+				}
+				if (mcf->tmpl_local) {
+					(void) ngx_http_ctpp2_tmpl_local_put(r, mcf->tmpl_local, ctx);
+				}
+				return ngx_http_next_filter(r, in);
+			case NGX_DECLINED: break;
+			default: return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+	
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_ctpp2_filter_module);
+	if (conf->tmpls_mmap) {
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+			"http ctpp2 template loader: Mapping %O bytes of template", of.size);
+		ctx->tmpl = ngx_calloc_buf(r->pool);
+		if (ctx->tmpl == NULL) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		ctx->tmpl_map = ngx_http_ctpp2_tmpl_map(r->pool, of.fd, of.size, ctx->tmpl, log);
+		if (ctx->tmpl_map == NULL || ngx_http_ctpp2_tmpl_loaded(r, ctx) != NGX_OK) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		return ngx_http_next_filter(r, in);
+	}
+	
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
 		"http ctpp2 template loader: Allocating %d bytes for template buffer", of.size);
 	ctx->tmpl = ngx_create_temp_buf(r->pool, of.size);
@@ -0,0 +1,528 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include "ngx_http_ctpp2_tmpl_uri.h"
+
+
+/*
+ * Templates of "template_uri" are fetched by subrequests and kept by each
+ * worker for "valid" time.  Then they are revalidated with If-None-Match
+ * and If-Modified-Since, or compared with the ones received if the location
+ * doesn't support that.
+ */
+
+typedef struct ngx_http_ctpp2_tmpl_uri_node_s {
+	ngx_str_node_t       sn;
+	ngx_queue_t          queue;
+	time_t               expire;
+	time_t               last_modified;   /* -1 if unknown */
+	ngx_str_t            etag;
+	uint32_t             crc;             /* of the template, as its version */
+	size_t               size;            /* of the node and the template */
+	ngx_uint_t           count;
+	unsigned             deleted:1;
+	ngx_buf_t            tmpl;
+} ngx_http_ctpp2_tmpl_uri_node_t;
+
+struct ngx_http_ctpp2_tmpl_uri_cache_s {
+	ngx_rbtree_t         rbtree;
+	ngx_rbtree_node_t    sentinel;
+	ngx_queue_t          queue;
+	size_t               size;
+	size_t               max_size;
+};
+
+typedef struct {
+	ngx_http_ctpp2_tmpl_uri_cache_t  *cache;
+	ngx_http_ctpp2_tmpl_uri_node_t   *node;
+} ngx_http_ctpp2_tmpl_uri_cleanup_t;
+
+
+static ngx_int_t ngx_http_ctpp2_tmpl_uri_conditions(ngx_http_request_t *sr,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn);
+static ngx_int_t ngx_http_ctpp2_tmpl_uri_done(ngx_http_request_t *r,
+	ngx_http_ctpp2_fetch_t *fetch, ngx_int_t rc);
+static ngx_int_t ngx_http_ctpp2_tmpl_uri_store(ngx_http_request_t *r,
+	ngx_http_ctpp2_tmpl_uri_cache_t *cache, ngx_http_ctpp2_fetch_t *fetch,
+	ngx_http_ctpp2_tmpl_uri_node_t **node);
+static ngx_int_t ngx_http_ctpp2_tmpl_uri_use(ngx_http_request_t *r,
+	ngx_http_ctpp2_tmpl_uri_cache_t *cache, ngx_http_ctpp2_tmpl_uri_node_t *tn,
+	ngx_http_ctpp2_ctx_t *ctx);
+static ngx_int_t ngx_http_ctpp2_tmpl_uri_pin(ngx_http_request_t *r,
+	ngx_http_ctpp2_tmpl_uri_cache_t *cache, ngx_http_ctpp2_tmpl_uri_node_t *tn);
+static ngx_http_ctpp2_tmpl_uri_node_t *ngx_http_ctpp2_tmpl_uri_lookup(
+	ngx_http_ctpp2_tmpl_uri_cache_t *cache, ngx_str_t *uri, uint32_t hash);
+static ngx_int_t ngx_http_ctpp2_tmpl_uri_reserve(ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	size_t size);
+static void ngx_http_ctpp2_tmpl_uri_delete(ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn);
+static void ngx_http_ctpp2_tmpl_uri_free(ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn);
+static void ngx_http_ctpp2_tmpl_uri_cleanup(void *data);
+
+
+char *
+ngx_http_ctpp2_tmpl_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_ctpp2_loc_conf_t *lcf = conf;
+
+	ngx_str_t                         *value, s;
+	ngx_uint_t                         i;
+	time_t                             valid;
+	ngx_http_compile_complex_value_t   ccv;
+
+	if (lcf->tmpl_uri) return "is duplicate";
+	if (lcf->tmpl) return "conflicts with \"template\"";
+
+	value = cf->args->elts;
+	valid = 60;
+
+	for (i = 2; i < cf->args->nelts; i++) {
+
+		if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			valid = ngx_parse_time(&s, 1);
+			if (valid == (time_t) NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid time \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	lcf->tmpl_uri = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+	if (lcf->tmpl_uri == NULL) return NGX_CONF_ERROR;
+
+	ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+	ccv.cf = cf;
+	ccv.value = &value[1];
+	ccv.zero = 1;
+	ccv.complex_value = lcf->tmpl_uri;
+
+	if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	lcf->tmpl_uri_valid = valid;
+
+	return NGX_CONF_OK;
+}
+
+
+ngx_http_ctpp2_tmpl_uri_cache_t *
+ngx_http_ctpp2_tmpl_uri_create(ngx_conf_t *cf, size_t size)
+{
+	ngx_http_ctpp2_tmpl_uri_cache_t  *cache;
+
+	cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_ctpp2_tmpl_uri_cache_t));
+	if (cache == NULL) return NULL;
+
+	ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_str_rbtree_insert_value);
+	ngx_queue_init(&cache->queue);
+	cache->max_size = size;
+
+	return cache;
+}
+
+
+/*
+ * Takes the template of ctx->tmpl_path from the cache, or issues the
+ * subrequest for it.  The request waits for the subrequest in the latter
+ * case, ctx->template_ready isn't set.
+ */
+ngx_int_t
+ngx_http_ctpp2_tmpl_uri_fetch(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx)
+{
+	ngx_http_ctpp2_main_conf_t       *mcf;
+	ngx_http_ctpp2_tmpl_uri_cache_t  *cache;
+	ngx_http_ctpp2_tmpl_uri_node_t   *tn;
+	ngx_http_ctpp2_fetch_t           *fetch;
+
+	mcf = ngx_http_get_module_main_conf(r, ngx_http_ctpp2_filter_module);
+	cache = mcf->tmpl_uri_cache;
+
+	tn = ngx_http_ctpp2_tmpl_uri_lookup(cache, &ctx->tmpl_path,
+		ngx_crc32_short(ctx->tmpl_path.data, ctx->tmpl_path.len));
+
+	if (tn && ngx_time() < tn->expire) {
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http ctpp2 template uri: \"%V\" found", &ctx->tmpl_path);
+		return ngx_http_ctpp2_tmpl_uri_use(r, cache, tn, ctx);
+	}
+
+	fetch = ngx_http_ctpp2_fetch_create(r, ctx, &ctx->tmpl_path);
+	if (fetch == NULL) return NGX_ERROR;
+
+	fetch->max_size = cache->max_size;
+	fetch->handler = ngx_http_ctpp2_tmpl_uri_done;
+
+	if (tn) {
+		/* it's kept until the request ends, as it may be used still */
+		if (ngx_http_ctpp2_tmpl_uri_pin(r, cache, tn) != NGX_OK) return NGX_ERROR;
+		fetch->data = tn;
+	}
+
+	if (ngx_http_ctpp2_fetch(r, fetch, NGX_HTTP_SUBREQUEST_WAITED) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ctx->fetch = fetch;
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"http ctpp2 template uri: \"%V\" is fetched, %s", &ctx->tmpl_path,
+		tn ? "revalidated" : "missed");
+
+	return ngx_http_ctpp2_tmpl_uri_conditions(fetch->request, tn);
+}
+
+
+/*
+ * The subrequest gets conditions of the template cached.
+ */
+static ngx_int_t
+ngx_http_ctpp2_tmpl_uri_conditions(ngx_http_request_t *sr, ngx_http_ctpp2_tmpl_uri_node_t *tn)
+{
+	ngx_table_elt_t  *h;
+	u_char           *p;
+
+	if (tn == NULL) return NGX_OK;
+
+	if (tn->etag.len) {
+		h = ngx_http_ctpp2_fetch_push(sr, "If-None-Match", "if-none-match");
+		if (h == NULL) return NGX_ERROR;
+
+		h->value = tn->etag;
+		sr->headers_in.if_none_match = h;
+	}
+
+	if (tn->last_modified != -1) {
+		h = ngx_http_ctpp2_fetch_push(sr, "If-Modified-Since", "if-modified-since");
+		if (h == NULL) return NGX_ERROR;
+
+		p = ngx_pnalloc(sr->pool, sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1);
+		if (p == NULL) return NGX_ERROR;
+
+		h->value.data = p;
+		h->value.len = ngx_http_time(p, tn->last_modified) - p;
+		sr->headers_in.if_modified_since = h;
+	}
+
+	return NGX_OK;
+}
+
+
+/*
+ * The fetch handler, the request is woken up after it.  If the template
+ * can't be fetched the stale one is used for another "valid" time.
+ */
+static ngx_int_t
+ngx_http_ctpp2_tmpl_uri_done(ngx_http_request_t *r, ngx_http_ctpp2_fetch_t *fetch,
+	ngx_int_t rc)
+{
+	ngx_http_ctpp2_main_conf_t       *mcf;
+	ngx_http_ctpp2_loc_conf_t        *conf;
+	ngx_http_ctpp2_tmpl_uri_cache_t  *cache;
+	ngx_http_ctpp2_tmpl_uri_node_t   *tn;
+	ngx_http_ctpp2_ctx_t             *ctx;
+	ngx_http_request_t               *pr;
+	ngx_str_t                        *uri;
+	ngx_int_t                         status;
+	size_t                            size;
+
+	pr = r->parent;
+	mcf = ngx_http_get_module_main_conf(pr, ngx_http_ctpp2_filter_module);
+	conf = ngx_http_get_module_loc_conf(pr, ngx_http_ctpp2_filter_module);
+
+	cache = mcf->tmpl_uri_cache;
+	uri = &fetch->ctx->tmpl_path;
+	tn = fetch->data;
+	status = (rc == NGX_OK) ? (ngx_int_t) r->headers_out.status : rc;
+	size = fetch->last - fetch->start;
+
+	if (status == NGX_HTTP_OK && !fetch->failed) {
+		if (tn && (size_t) (tn->tmpl.last - tn->tmpl.pos) == size
+		    && ngx_memcmp(tn->tmpl.pos, fetch->start, size) == 0)
+		{
+			status = NGX_HTTP_NOT_MODIFIED;
+
+		} else {
+			switch (ngx_http_ctpp2_tmpl_uri_store(r, cache, fetch, &tn)) {
+				case NGX_OK:
+					ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"http ctpp2 template uri: \"%V\" stored, %uz bytes", uri, size);
+					tn->expire = ngx_time() + conf->tmpl_uri_valid;
+					goto found;
+				case NGX_DECLINED:
+					/* used by this request only, the buffer is freed with it */
+					ctx = fetch->ctx;
+					ctx->tmpl = ngx_calloc_buf(pr->pool);
+					if (ctx->tmpl == NULL) goto failed;
+
+					ctx->tmpl->start = fetch->start;
+					ctx->tmpl->pos = fetch->start;
+					ctx->tmpl->last = fetch->last;
+					ctx->tmpl->end = fetch->end;
+					ctx->tmpl->memory = 1;
+					ctx->tmpl_uniq = ngx_crc32_long(fetch->start, size);
+					ctx->tmpl_mtime = r->headers_out.last_modified_time;
+					ctx->template_ready = 1;
+					return rc;
+				default:
+					fetch->failed = 1;
+			}
+		}
+	}
+
+	if (tn && status == NGX_HTTP_NOT_MODIFIED) {
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"http ctpp2 template uri: \"%V\" revalidated", uri);
+
+	} else if (tn) {
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"Fetching template \"%V\" failed (%i), the stale one is used", uri, status);
+
+	} else {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"Fetching template \"%V\" failed (%i)", uri, status);
+		fetch->failed = 1;
+		return rc;
+	}
+
+	tn->expire = ngx_time() + conf->tmpl_uri_valid;
+
+found:
+
+	if (ngx_http_ctpp2_tmpl_uri_use(pr, cache, tn, fetch->ctx) == NGX_OK) return rc;
+
+failed:
+
+	/* the request is woken up and finalized then */
+	fetch->failed = 1;
+
+	return NGX_ERROR;
+}
+
+
+/*
+ * Tests the template received once and caches it, the buffer is taken over.
+ * NGX_DECLINED means the template is fine but doesn't fit into the cache.
+ */
+static ngx_int_t
+ngx_http_ctpp2_tmpl_uri_store(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_fetch_t *fetch, ngx_http_ctpp2_tmpl_uri_node_t **node)
+{
+	ngx_http_ctpp2_tmpl_uri_node_t  *tn;
+	ngx_str_t                       *uri, etag;
+	ngx_buf_t                        b;
+	uint32_t                         hash;
+	size_t                           len, size;
+	u_char                          *p;
+
+	uri = &fetch->ctx->tmpl_path;
+	size = fetch->last - fetch->start;
+
+	if (size == 0) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"Template \"%V\" has zero size", uri);
+		return NGX_ERROR;
+	}
+
+	if (fetch->last != fetch->end) {
+		/* the buffer of a response without length grows twice at a time */
+		p = realloc(fetch->start, size);
+		if (p) {
+			fetch->start = p;
+			fetch->last = p + size;
+			fetch->end = fetch->last;
+		}
+	}
+
+	ngx_memzero(&b, sizeof(ngx_buf_t));
+	b.start = fetch->start;
+	b.end = fetch->end;
+	b.pos = fetch->start;
+	b.last = fetch->last;
+	b.memory = 1;
+
+	if (ctpp2_tmpltest(&b, 1, r->connection->log) != NGX_OK) return NGX_ERROR;
+
+	if (r->headers_out.etag) {
+		etag = r->headers_out.etag->value;
+	} else {
+		ngx_str_null(&etag);
+	}
+
+	hash = ngx_crc32_short(uri->data, uri->len);
+
+	tn = ngx_http_ctpp2_tmpl_uri_lookup(cache, uri, hash);
+	if (tn) ngx_http_ctpp2_tmpl_uri_delete(cache, tn);
+
+	len = sizeof(ngx_http_ctpp2_tmpl_uri_node_t) + uri->len + 1 + etag.len;
+
+	/* the whole buffer is charged, if it couldn't be shrunk */
+	if (ngx_http_ctpp2_tmpl_uri_reserve(cache, len + (fetch->end - fetch->start)) != NGX_OK) {
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"Template \"%V\" (%uz bytes) doesn't fit into ctpp2 template uri cache",
+			uri, size);
+		return NGX_DECLINED;
+	}
+
+	tn = ngx_alloc(len, r->connection->log);
+	if (tn == NULL) return NGX_ERROR;
+
+	ngx_memzero(tn, sizeof(ngx_http_ctpp2_tmpl_uri_node_t));
+
+	p = (u_char *) tn + sizeof(ngx_http_ctpp2_tmpl_uri_node_t);
+
+	tn->sn.str.data = p;
+	tn->sn.str.len = uri->len;
+	p = ngx_cpymem(p, uri->data, uri->len);
+	*p++ = '\0';
+
+	tn->etag.data = p;
+	tn->etag.len = etag.len;
+	ngx_memcpy(p, etag.data, etag.len);
+
+	tn->sn.node.key = hash;
+	tn->last_modified = r->headers_out.last_modified_time;
+	tn->crc = ngx_crc32_long(fetch->start, size);
+	tn->size = len + (fetch->end - fetch->start);
+	tn->tmpl = b;
+
+	fetch->start = NULL;
+
+	cache->size += tn->size;
+
+	ngx_rbtree_insert(&cache->rbtree, &tn->sn.node);
+	ngx_queue_insert_head(&cache->queue, &tn->queue);
+
+	*node = tn;
+
+	return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_tmpl_uri_use(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn, ngx_http_ctpp2_ctx_t *ctx)
+{
+	if (ngx_http_ctpp2_tmpl_uri_pin(r, cache, tn) != NGX_OK) return NGX_ERROR;
+
+	if (!tn->deleted) {
+		ngx_queue_remove(&tn->queue);
+		ngx_queue_insert_head(&cache->queue, &tn->queue);
+	}
+
+	ctx->tmpl = &tn->tmpl;
+	ctx->tmpl_uniq = tn->crc;
+	ctx->tmpl_mtime = tn->last_modified;
+	ctx->template_ready = 1;
+
+	return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_tmpl_uri_pin(ngx_http_request_t *r, ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn)
+{
+	ngx_http_ctpp2_tmpl_uri_cleanup_t  *ucln;
+	ngx_pool_cleanup_t                 *cln;
+
+	cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_ctpp2_tmpl_uri_cleanup_t));
+	if (cln == NULL) return NGX_ERROR;
+
+	ucln = cln->data;
+	ucln->cache = cache;
+	ucln->node = tn;
+	cln->handler = ngx_http_ctpp2_tmpl_uri_cleanup;
+
+	tn->count++;
+
+	return NGX_OK;
+}
+
+
+static ngx_http_ctpp2_tmpl_uri_node_t *
+ngx_http_ctpp2_tmpl_uri_lookup(ngx_http_ctpp2_tmpl_uri_cache_t *cache, ngx_str_t *uri,
+	uint32_t hash)
+{
+	return (ngx_http_ctpp2_tmpl_uri_node_t *)
+		ngx_str_rbtree_lookup(&cache->rbtree, uri, hash);
+}
+
+
+static ngx_int_t
+ngx_http_ctpp2_tmpl_uri_reserve(ngx_http_ctpp2_tmpl_uri_cache_t *cache, size_t size)
+{
+	ngx_queue_t                     *q, *prev;
+	ngx_http_ctpp2_tmpl_uri_node_t  *tn;
+
+	if (size > cache->max_size) return NGX_DECLINED;
+
+	q = ngx_queue_last(&cache->queue);
+
+	while (cache->size + size > cache->max_size) {
+		if (q == ngx_queue_sentinel(&cache->queue)) return NGX_DECLINED;
+
+		prev = ngx_queue_prev(q);
+		tn = ngx_queue_data(q, ngx_http_ctpp2_tmpl_uri_node_t, queue);
+
+		if (tn->count == 0) ngx_http_ctpp2_tmpl_uri_delete(cache, tn);
+
+		q = prev;
+	}
+
+	return NGX_OK;
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_uri_delete(ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn)
+{
+	ngx_rbtree_delete(&cache->rbtree, &tn->sn.node);
+	ngx_queue_remove(&tn->queue);
+
+	if (tn->count) {
+		tn->deleted = 1;
+		return;
+	}
+
+	ngx_http_ctpp2_tmpl_uri_free(cache, tn);
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_uri_free(ngx_http_ctpp2_tmpl_uri_cache_t *cache,
+	ngx_http_ctpp2_tmpl_uri_node_t *tn)
+{
+	cache->size -= tn->size;
+
+	ngx_free(tn->tmpl.start);
+	ngx_free(tn);
+}
+
+
+static void
+ngx_http_ctpp2_tmpl_uri_cleanup(void *data)
+{
+	ngx_http_ctpp2_tmpl_uri_cleanup_t  *ucln = data;
+
+	ucln->node->count--;
+
+	if (ucln->node->deleted && ucln->node->count == 0) {
+		ngx_http_ctpp2_tmpl_uri_free(ucln->cache, ucln->node);
+	}
+}
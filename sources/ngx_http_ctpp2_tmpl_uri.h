@@ -0,0 +1,20 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#ifndef _NGX_HTTP_CTPP2_TMPL_URI_H_INCLUDED_
+#define _NGX_HTTP_CTPP2_TMPL_URI_H_INCLUDED_
+
+
+#include "ngx_http_ctpp2_fetch.h"
+
+
+char *ngx_http_ctpp2_tmpl_uri(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_http_ctpp2_tmpl_uri_cache_t *ngx_http_ctpp2_tmpl_uri_create(ngx_conf_t *cf, size_t size);
+ngx_int_t ngx_http_ctpp2_tmpl_uri_fetch(ngx_http_request_t *r, ngx_http_ctpp2_ctx_t *ctx);
+
+
+#endif /* _NGX_HTTP_CTPP2_TMPL_URI_H_INCLUDED_ */
@@ -13,7 +13,7 @@ use Test::Nginx;
 
 use constant CONTENT => 'x' x 1024;
 
-my $t = Test::Nginx->new()->has(qw/http proxy/)->plan(14);
+my $t = Test::Nginx->new()->has(qw/http proxy/)->plan(18);
 
 $t->write_file_expand('nginx.conf', <<'CONF');
 
@@ -39,6 +39,11 @@ http {
 		}
 		location /conf {
 			ctpp2_data_buffer  1k;
+			ctpp2_max_data_size  1k;
+			proxy_pass  http://127.0.0.1:8081;
+		}
+		location /grow {
+			ctpp2_data_buffer  100;
 			proxy_pass  http://127.0.0.1:8081;
 		}
 		location /empty.json {}
@@ -82,6 +87,14 @@ ok check_log(1), 'Error: H</C! (log)';
 like http_get('/conf'), $e500, 'Error: H!/C< (header)';
 ok check_log(2), 'Error: H!/C< (log)';
 
+$r = http_get('/grow');
+like $r, $ok200, 'Ok: H!/C<, growing buffer (header)';
+is get_content($r), CONTENT, 'Ok: H!/C<, growing buffer (content)';
+
+$r = http_get('/grow');
+like $r, $ok200, 'Ok: H!/C<, estimated buffer (header)';
+is get_content($r), CONTENT, 'Ok: H!/C<, estimated buffer (content)';
+
 $r = http_get('/empty.json');
 like  $r, $ok200, 'Empty output (response)';
 like  $r, qr/^Content-Length: 0\r$/im, 'Empty output (content-lenght)';
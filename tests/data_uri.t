@@ -0,0 +1,125 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http proxy/)->plan(7);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+
+	types {
+		application/json     json;
+		application/msgpack  msgpack;
+	}
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		root  %%TESTDIR%%;
+
+		location / {
+			ctpp2  on;
+			template  %%TESTDIR%%/test.ct2;
+			ctpp2_data  user  /data/user.json;
+			ctpp2_data  info  /data/$arg_i.msgpack;
+			try_files  /hw.json =404;
+		}
+		location /incremental {
+			ctpp2  on;
+			template  %%TESTDIR%%/test.ct2;
+			ctpp2_json_parser  incremental;
+			ctpp2_data  user  /data/user.json;
+			ctpp2_data  info  /data/info.msgpack;
+			try_files  /hw.json =404;
+		}
+		location /binary {
+			ctpp2  on;
+			template  %%TESTDIR%%/test.ct2;
+			ctpp2_data  user  /data/user.json;
+			ctpp2_data  info  /data/info.msgpack;
+			try_files  /hw.msgpack =404;
+		}
+		location /slow {
+			ctpp2  on;
+			template  %%TESTDIR%%/test.ct2;
+			ctpp2_data  user  /data/user.json;
+			ctpp2_data  info  /backend/;
+			ctpp2_data_timeout  500ms;
+			try_files  /hw.json =404;
+		}
+		location /data/ {
+			internal;
+			alias  %%TESTDIR%%/;
+		}
+		location /backend/ {
+			internal;
+			proxy_pass  http://127.0.0.1:8081;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '[<TMPL_var second>|<TMPL_var user.name>|<TMPL_var info.x>]');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('hw.json', '{"second":"world"}');
+$t->write_file('hw.msgpack', pack('CCa*Ca*', 0x81, 0xa6, 'second', 0xa5, 'world'));
+$t->write_file('user.json', '{"name":"Jane"}');
+$t->write_file('info.msgpack', pack('CCa*Ca*', 0x81, 0xa1, 'x', 0xa1, 'y'));
+
+$t->run_daemon(\&http_daemon);
+$t->run();
+
+like http_get('/?i=info'),      qr/^\[world\|Jane\|y\]$/m,  'Branches';
+like http_get('/incremental'),  qr/^\[world\|Jane\|y\]$/m,  'Branches with incremental JSON parser';
+like http_get('/binary'),       qr/^\[world\|Jane\|y\]$/m,  'Branches of MessagePack data';
+like http_get('/?i=none'),      qr/^\[world\|Jane\|\]$/m,   'Missing branch';
+ok `grep -cF 'Fetching data "info" failed (404)' '$d/error.log'` > 0, 'Missing branch (log)';
+like http_get('/slow'),         qr/^\[world\|Jane\|\]$/m,   'Branch timed out';
+ok `grep -cF 'Fetching data "info" timed out' '$d/error.log'` > 0, 'Branch timed out (log)';
+
+sub http_daemon {
+	my $server = IO::Socket::INET->new(
+		Proto => 'tcp',
+		LocalHost => '127.0.0.1:8081',
+		Listen => 5,
+		ReuseAddr => 1
+	) or die "Can't create listening socket: $!\n";
+
+	while (my $client = $server->accept()) {
+		while (<$client>) {
+			last if /^\r\n$/;
+		}
+
+		sleep 2;
+
+		print $client "HTTP/1.1 200 OK\r\n"
+			. "Content-Type: application/json\r\n"
+			. "Connection: close\r\n\r\n"
+			. '{"x":"late"}';
+
+		close $client;
+	}
+}
@@ -0,0 +1,111 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(8);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	default_type  text/html;
+
+	types {
+		application/json     json;
+		application/msgpack  msgpack;
+		application/cbor     cbor;
+	}
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+		template   test.ct2;
+
+		location / {
+			try_files  /$arg_f =404;
+		}
+		location /incremental {
+			ctpp2_json_parser  incremental;
+			try_files  /$arg_f =404;
+		}
+		location /typed {
+			ctpp2_content_type  text/xml;
+			try_files  /$arg_f =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '[<TMPL_var s>|<TMPL_var i>|<TMPL_var f>|<TMPL_var t>|<TMPL_var n>|'
+	. '<TMPL_loop l><TMPL_var v>,</TMPL_loop>|<TMPL_var h.x>]');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('data.json', '{"s":"str","i":-300,"f":1.5,"t":true,"n":null,'
+	. '"l":[{"v":1},{"v":"two"}],"h":{"x":"y"}}');
+
+# the same data in MessagePack and CBOR
+
+$t->write_file('data.msgpack', pack('C', 0x87)
+	. pack('Ca*Ca*', 0xa1, 's', 0xa3, 'str')
+	. pack('Ca*Cn!', 0xa1, 'i', 0xd1, -300)
+	. pack('Ca*Cd>', 0xa1, 'f', 0xcb, 1.5)
+	. pack('Ca*C', 0xa1, 't', 0xc3)
+	. pack('Ca*C', 0xa1, 'n', 0xc0)
+	. pack('Ca*C', 0xa1, 'l', 0x92)
+		. pack('CCa*C', 0x81, 0xa1, 'v', 0x01)
+		. pack('CCa*Ca*', 0x81, 0xa1, 'v', 0xa3, 'two')
+	. pack('Ca*CCa*Ca*', 0xa1, 'h', 0x81, 0xa1, 'x', 0xa1, 'y'));
+
+$t->write_file('data.cbor', pack('C', 0xa7)
+	. pack('Ca*Ca*', 0x61, 's', 0x63, 'str')
+	. pack('Ca*Cn', 0x61, 'i', 0x39, 299)
+	. pack('Ca*Cd>', 0x61, 'f', 0xfb, 1.5)
+	. pack('Ca*C', 0x61, 't', 0xf5)
+	. pack('Ca*C', 0x61, 'n', 0xf6)
+	. pack('Ca*C', 0x61, 'l', 0x9f)
+		. pack('CCa*C', 0xa1, 0x61, 'v', 0x01)
+		. pack('CCa*Ca*', 0xa1, 0x61, 'v', 0x63, 'two')
+		. pack('C', 0xff)
+	. pack('Ca*CCa*Ca*', 0x61, 'h', 0xa1, 0x61, 'x', 0x61, 'y'));
+
+$t->write_file('bad.msgpack', pack('CCa*Ca*', 0x81, 0xa1, 's', 0xa5, 'str'));
+
+$t->run();
+
+my ($json) = http_get('/?f=data.json') =~ /(\[.*\])/s;
+like $json, qr/^\[str\|-300\|1\.5\|1\|\|1,two,\|y\]$/, 'JSON';
+
+my ($r) = http_get('/?f=data.msgpack') =~ /(\[.*\])/s;
+is $r, $json, 'MessagePack';
+($r) = http_get('/?f=data.cbor') =~ /(\[.*\])/s;
+is $r, $json, 'CBOR';
+($r) = http_get('/incremental?f=data.cbor') =~ /(\[.*\])/s;
+is $r, $json, 'CBOR with incremental JSON parser';
+
+like http_get('/?f=data.msgpack'),    qr{^Content-Type: text/html\r?$}mi,  'MessagePack output type';
+like http_get('/typed?f=data.cbor'),  qr{^Content-Type: text/xml\r?$}mi,   'CBOR output type';
+
+like http_get('/?f=bad.msgpack'), qr{^HTTP/1\.[01] 500}i, 'Truncated MessagePack';
+ok `grep -cF 'MessagePack error: truncated data' '$d/error.log'` > 0, 'Truncated MessagePack (log)';
@@ -0,0 +1,72 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(4);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_fragment_cache  1m;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+
+		location / {
+			template  test.ct2;
+			try_files  /$arg_f =404;
+		}
+		location /short {
+			template  short.ct2;
+			try_files  /$arg_f =404;
+		}
+		location /unpaired {
+			template  unpaired.ct2;
+			try_files  /$arg_f =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '<TMPL_if FRAGMENT_BEGIN("f", 3600)>[<TMPL_var v>]'
+	. '<TMPL_var FRAGMENT_END()></TMPL_if><TMPL_var v>');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+$t->write_file('short.tmpl', '<TMPL_if FRAGMENT_BEGIN("s", 0)>[<TMPL_var v>]'
+	. '<TMPL_var FRAGMENT_END()></TMPL_if><TMPL_var v>');
+system("ctpp2c '$d/short.tmpl' '$d/short.ct2'") == 0 or die "Can't compile short template\n";
+$t->write_file('unpaired.tmpl', '<TMPL_var FRAGMENT_END()>');
+system("ctpp2c '$d/unpaired.tmpl' '$d/unpaired.ct2'") == 0 or die "Can't compile unpaired template\n";
+
+$t->write_file('one.json', '{"v":"one"}');
+$t->write_file('two.json', '{"v":"two"}');
+
+$t->run();
+
+like http_get('/?f=one.json'), qr/\[one\]one$/, 'Fragment rendered';
+like http_get('/?f=two.json'), qr/\[one\]two$/, 'Fragment cached';
+like http_get('/short?f=two.json'), qr/\[two\]two$/, 'Zero ttl is not cached';
+like http_get('/unpaired?f=one.json'), qr/^HTTP\/1\.[01] 500/, 'Unpaired end';
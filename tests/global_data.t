@@ -0,0 +1,80 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(5);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	template  %%TESTDIR%%/test.ct2;
+	ctpp2_global_data  %%TESTDIR%%/global.json;
+
+	types {
+		application/json     json;
+		application/msgpack  msgpack;
+	}
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		root  %%TESTDIR%%;
+
+		location / {
+			try_files  /hw.json =404;
+		}
+		location /incremental {
+			ctpp2_json_parser  incremental;
+			try_files  /hw.json =404;
+		}
+		location /binary {
+			try_files  /hw.msgpack =404;
+		}
+		location /empty {
+			try_files  /empty.json =404;
+		}
+		location /off {
+			ctpp2_global_data  off;
+			try_files  /hw.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '[<TMPL_var second>|<TMPL_var site>|<TMPL_var menu.x>]');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('global.json', '{"site":"Example","second":"everyone","menu":{"x":"y"}}');
+$t->write_file('hw.json', '{"second":"world"}');
+$t->write_file('hw.msgpack', pack('CCa*Ca*', 0x81, 0xa6, 'second', 0xa5, 'world'));
+$t->write_file('empty.json', '{}');
+
+$t->run();
+
+like http_get('/'),            qr/^\[world\|Example\|y\]$/m,     'Global data';
+like http_get('/incremental'), qr/^\[world\|Example\|y\]$/m,     'Global data with incremental JSON parser';
+like http_get('/binary'),      qr/^\[world\|Example\|y\]$/m,     'Global data with MessagePack';
+like http_get('/empty'),       qr/^\[everyone\|Example\|y\]$/m,  'Global data only';
+like http_get('/off'),         qr/^\[world\|\|\]$/m,             'Global data off';
@@ -0,0 +1,200 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+use IO::Socket::INET;
+use Time::HiRes qw/sleep/;
+
+use constant DATA => '{"s":"a\"b\\\\cé😀","i":-12,"f":2.5e1,"t":true,"n":null,'
+	. '"l":[{"v":1},{"v":"two"},{"v":[]}],"h":{"x":{"y":"z"}}}';
+
+my $t = Test::Nginx->new()->has(qw/http proxy/)->plan(20);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+		template   test.ct2;
+
+		location /classic {
+			try_files  /data.json =404;
+		}
+		location /incremental {
+			ctpp2_json_parser  incremental;
+			try_files  /data.json =404;
+		}
+		location /incremental_bad {
+			ctpp2_json_parser  incremental;
+			try_files  /bad.json =404;
+		}
+		location /incremental_short {
+			ctpp2_json_parser  incremental;
+			try_files  /short.json =404;
+		}
+		location /simd {
+			ctpp2_json_parser  simd;
+			try_files  /data.json =404;
+		}
+		location /incremental_ctrl {
+			ctpp2_json_parser  incremental;
+			try_files  /ctrl.json =404;
+		}
+		location /simd_ctrl {
+			ctpp2_json_parser  simd;
+			try_files  /ctrl.json =404;
+		}
+		location /simd_bad_utf8 {
+			ctpp2_json_parser  simd;
+			try_files  /bad_utf8.json =404;
+		}
+		location /utf8/ {
+			ctpp2_json_utf8  on;
+
+			location /utf8/classic {
+				try_files  /bad_utf8.json =404;
+			}
+			location /utf8/incremental {
+				ctpp2_json_parser  incremental;
+				try_files  /bad_utf8.json =404;
+			}
+			location /utf8/simd {
+				ctpp2_json_parser  simd;
+				try_files  /bad_utf8.json =404;
+			}
+			location /utf8/split {
+				ctpp2_json_parser  simd;
+				proxy_buffering  off;
+				proxy_pass  http://127.0.0.1:8081;
+			}
+		}
+		location /split {
+			ctpp2_json_parser  incremental;
+			proxy_buffering  off;
+			proxy_pass  http://127.0.0.1:8081;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '[<TMPL_var s>|<TMPL_var i>|<TMPL_var f>|<TMPL_var t>|<TMPL_var n>|'
+	. '<TMPL_loop l><TMPL_var v>,</TMPL_loop>|<TMPL_var h.x.y>]');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('data.json', DATA);
+$t->write_file('bad.json', '{"s":[1,2}');
+$t->write_file('short.json', '{"s":"abc"');
+$t->write_file('bad_utf8.json', "{\"s\":\"\xed\xa0\x80\"}");
+$t->write_file('ctrl.json', "{\"s\":\"" . ('x' x 40) . "\tb\"}");
+
+$t->run_daemon(\&http_daemon);
+$t->run();
+
+my $e500 = qr{^HTTP/1\.[01] 500}i;
+
+my ($classic) = http_get('/classic') =~ /(\[.*\])/s;
+ok defined $classic, 'Classic parser';
+
+my ($r) = http_get('/incremental') =~ /(\[.*\])/s;
+is $r, $classic, 'Incremental parser';
+like $r, qr/^\[a"b\\c\x{c3}\x{a9}\x{f0}\x{9f}\x{98}\x{80}\|-12\|25\|1\|\|1,two,/, 'Incremental parser values';
+
+($r) = http_get('/simd') =~ /(\[.*\])/s;
+is $r, $classic, 'SIMD parser';
+
+like http_get('/simd_bad_utf8'), qr{^HTTP/1\.[01] 200}i, 'Invalid UTF-8 not checked';
+
+like http_get('/utf8/classic'), $e500, 'Invalid UTF-8 with classic parser';
+like http_get('/utf8/incremental'), $e500, 'Invalid UTF-8 with incremental parser';
+like http_get('/utf8/simd'), $e500, 'Invalid UTF-8 with SIMD parser';
+ok check_log('invalid UTF-8 sequence'), 'Invalid UTF-8 (log)';
+
+($r) = http_get('/utf8/split') =~ /(\[.*\])/s;
+is $r, $classic, 'UTF-8 split in pieces';
+
+($r) = http_get('/split') =~ /(\[.*\])/s;
+is $r, $classic, 'Data split in pieces';
+
+# pieces of many requests are parsed in turn
+my @s = map { http_get('/split', start => 1) } 1 .. 32;
+is_deeply [ map { (http_end($_) =~ /(\[.*\])/s)[0] } @s ], [ ($classic) x 32 ],
+	'Overlapping requests';
+
+like http_get('/incremental_bad'), $e500, 'Syntax error';
+ok check_log('brackets mismatch'), 'Syntax error (log)';
+
+like http_get('/incremental_short'), $e500, 'Unexpected end of data';
+ok check_log('unexpected end of JSON data'), 'Unexpected end of data (log)';
+
+like http_get('/split?bad'), $e500, 'Syntax error in a piece';
+
+like http_get('/incremental_ctrl'), $e500, 'Control character in string';
+like http_get('/simd_ctrl'), $e500, 'Control character in string with SIMD parser';
+ok check_log('unescaped control character in string'), 'Control character in string (log)';
+
+sub check_log {
+	my $e = $d . '/error.log';
+	return `grep -cF '$_[0]' '$e'` > 0;
+}
+
+sub http_daemon {
+	my $server = IO::Socket::INET->new(
+		Proto => 'tcp',
+		LocalHost => '127.0.0.1:8081',
+		Listen => 64,
+		ReuseAddr => 1
+	) or die "Can't create listening socket: $!\n";
+
+	local $SIG{PIPE} = 'IGNORE';
+	local $SIG{CHLD} = 'IGNORE';
+
+	while (my $client = $server->accept()) {
+		if (fork()) {
+			close $client;
+			next;
+		}
+
+		$client->autoflush(1);
+
+		my ($r) = <$client> =~ m{^GET (.+) HTTP/1\.[01]\r$};
+		while (<$client>) {
+			last if /^\r\n$/;
+		}
+
+		my $content = ($r =~ /bad$/) ? '{"a":' . ('1' x 16) . ',]}' : DATA;
+
+		print $client "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n";
+		while (length $content) {
+			print $client substr($content, 0, 7, '');
+			sleep(0.01);
+		}
+
+		close $client;
+		exit 0;
+	}
+}
@@ -17,7 +17,7 @@ BEGIN {
 	} else { unified_diff(); }
 }
 
-my $t = Test::Nginx->new()->has(qw/http/)->plan(9);
+my $t = Test::Nginx->new()->has(qw/http/)->plan(11);
 
 my $aio = $t->has_module('--with-file-aio') ? <<'AIO' : '';
 location /aio/ {
@@ -65,6 +65,17 @@ http {
 			template  lebowski-bench-loop.ct2;
 			alias %%TESTDIR%%/;
 		}
+		location /incremental/ {
+			ctpp2_json_parser  incremental;
+			template  lebowski-bench-loop.ct2;
+			alias %%TESTDIR%%/;
+		}
+		location /simd/ {
+			ctpp2_json_parser  simd;
+			template  lebowski-bench-loop.ct2;
+			alias %%TESTDIR%%/;
+		}
+
 		location /bigbuf/ {
 			output_buffers  5 8m;
 			template  lebowski-bench-loop.ct2;
@@ -103,6 +114,11 @@ eq_or_diff $b, $r, 'Content check (small buffer)';
 ($h, $b) = http_sepget('/bigbuf/lebowski-bench.json');
 eq_or_diff $b, $r, 'Content check (big buffer)';
 
+($h, $b) = http_sepget('/incremental/lebowski-bench.json');
+eq_or_diff $b, $r, 'Content check (incremental parser)';
+($h, $b) = http_sepget('/simd/lebowski-bench.json');
+eq_or_diff $b, $r, 'Content check (simd parser)';
+
 SKIP: {
 	skip 'AIO', 1 unless $aio;
 	($h, $b) = http_sepget('/aio/lebowski-bench.json');
@@ -0,0 +1,69 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(4);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	templates_root  %%TESTDIR%%;
+	ctpp2_template_worker_cache  1m;
+	ctpp2_preload  .  sub/*.ct2;
+	open_file_cache_valid  60;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		location / {
+			template   $arg_t.ct2;
+			try_files  /hw.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+mkdir("$d/sub") or die "Can't create directory\n";
+$t->write_file('hw.tmpl', 'Hello <TMPL_var second>!');
+system("ctpp2c '$d/hw.tmpl' '$d/hw.ct2'") == 0 or die "Can't compile 'Hello world' template\n";
+$t->write_file('bye.tmpl', 'Goodbye <TMPL_var second>!');
+system("ctpp2c '$d/bye.tmpl' '$d/sub/bye.ct2'") == 0 or die "Can't compile 'Goodbye world' template\n";
+$t->write_file('hw.json', '{"second":"world"}');
+
+$t->run();
+
+like http_get('/?t=hw'),      qr/^Hello world!$/m,    'Preloaded template';
+like http_get('/?t=sub/bye'), qr/^Goodbye world!$/m,  'Preloaded template by pattern';
+
+$t->stop();
+
+like $t->read_file('error.log'), qr/ctpp2: 2 templates preloaded/, 'Templates preloaded';
+
+$t->run();
+
+system("ctpp2c '$d/bye.tmpl' '$d/new.ct2' && mv '$d/new.ct2' '$d/hw.ct2'") == 0
+	or die "Can't replace 'Hello world' template\n";
+
+like http_get('/?t=hw'),      qr/^Goodbye world!$/m,  'Preloaded template is checked';
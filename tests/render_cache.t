@@ -0,0 +1,86 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(10);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+		template   test.ct2;
+
+		add_header  X-Cache  $ctpp2_render_cache_status;
+
+		location / {
+			ctpp2_render_cache  zone=render:1m;
+			try_files  /$arg_f =404;
+		}
+		location /incremental {
+			ctpp2_render_cache  zone=render;
+			ctpp2_json_parser   incremental;
+			try_files  /$arg_f =404;
+		}
+		location /key {
+			ctpp2_render_cache  zone=render key=$arg_k valid=1h;
+			try_files  /$arg_f =404;
+		}
+		location /off {
+			ctpp2_render_cache  off;
+			try_files  /$arg_f =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '<TMPL_var v>');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('one.json', '{"v":"one"}');
+$t->write_file('two.json', '{"v":"two"}');
+
+$t->run();
+
+my $r = http_get('/?f=one.json');
+like $r, qr/X-Cache: MISS.*one$/s, 'Miss';
+like http_get('/?f=one.json'), qr/X-Cache: HIT.*one$/s, 'Hit';
+like http_get('/?f=two.json'), qr/X-Cache: MISS.*two$/s, 'Other data';
+like http_get('/?f=two.json'), qr/Content-Length: 3\r.*X-Cache: HIT.*two$/si, 'Hit length';
+
+$r = http_get('/incremental?f=one.json');
+like $r, qr/X-Cache: HIT.*one$/s, 'Shared zone';
+
+like http_get('/key?k=a&f=one.json'), qr/X-Cache: MISS.*one$/s, 'Key miss';
+like http_get('/key?k=a&f=two.json'), qr/X-Cache: HIT.*one$/s, 'Key hit';
+like http_get('/key?k=b&f=two.json'), qr/X-Cache: MISS.*two$/s, 'Other key';
+
+$r = http_get('/off?f=one.json');
+like $r, qr/one$/, 'Off';
+unlike $r, qr/X-Cache/, 'Off (no status)';
+
@@ -0,0 +1,73 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+use constant CONTENT => 'x' x 1024;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(5);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_slice_steps  16;
+	ctpp2_steps_limit  4096;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		location / {
+			template  %%TESTDIR%%/test.ct2;
+		}
+		location /stream {
+			ctpp2_stream on;
+			template  %%TESTDIR%%/test.ct2;
+			try_files  /big.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '<TMPL_loop l><TMPL_var t></TMPL_loop>');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('small.json', '{"l":[{"t":"' . CONTENT . '"}]}');
+$t->write_file('big.json', '{"l":[' . join(',', ('{"t":"' . CONTENT . '"}') x 64) . ']}');
+$t->write_file('endless.json', '{"l":[' . join(',', ('{"t":"x"}') x 4096) . ']}');
+
+$t->run();
+
+is get_content(http_get('/small.json')), CONTENT, 'Single slice';
+
+my $r = http_get('/big.json');
+like $r, qr/^Content-Length: 65536\r$/im, 'Many slices (content-length)';
+is get_content($r), CONTENT x 64, 'Many slices';
+
+is get_content(http_get('/stream')), CONTENT x 64, 'Many slices streamed';
+like http_get('/endless.json'), qr{^HTTP/1\.[01] 500}i, 'Steps limit';
+
+sub get_content {
+	my ($c) = shift =~ /^.+?\r\n\r\n(.*)$/s;
+	return $c;
+}
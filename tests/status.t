@@ -0,0 +1,93 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(10);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_steps_limit  30;
+	ctpp2_status_zone  stats:1m;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+
+		location / {
+			template   hw.ct2;
+			try_files  /hw.json =404;
+		}
+
+		location /label {
+			template   "q\"t\tb.ct2";
+			try_files  /hw.json =404;
+		}
+
+		location /steps_limit {
+			template   loop.ct2;
+			try_files  /array.json =404;
+		}
+
+		location /status {
+			ctpp2_status;
+		}
+		location /metrics {
+			ctpp2_status  prometheus;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('hw.tmpl', 'Hello <TMPL_var second>!');
+system("ctpp2c '$d/hw.tmpl' '$d/hw.ct2'") == 0 or die "Can't compile 'Hello world' template\n";
+$t->write_file('hw.json', '{"second":"world"}');
+system("cp '$d/hw.ct2' '$d/q\"t\tb.ct2'") == 0 or die "Can't copy 'Hello world' template\n";
+
+$t->write_file('loop.tmpl', '<TMPL_loop array><TMPL_var __COUNTER__><br></TMPL_loop>');
+system("ctpp2c '$d/loop.tmpl' '$d/loop.ct2'") == 0 or die "Can't compile array template\n";
+$t->write_file('array.json', '{"array":[""' . ',""' x 30 . ']}');
+
+$t->run();
+
+like http_get('/'), qr/^Hello world!$/m, 'Render';
+like http_get('/'), qr/^Hello world!$/m, 'Render again';
+like http_get('/label'), qr/^Hello world!$/m, 'Render of a template with quotes';
+like http_get('/steps_limit'), qr/500 Internal/, 'Failed render';
+
+my $s = http_get('/status');
+
+like $s, qr!"[^"]*/hw\.ct2":\{"renders":2,"errors":\{"data":0,"vm":0,"stack":0,"steps":0!,
+	'JSON renders';
+like $s, qr!"data_bytes":36,"output_bytes":24,!, 'JSON sizes';
+like $s, qr!"[^"]*/loop\.ct2":\{"renders":1,"errors":\{[^}]*"steps":1!, 'JSON errors';
+
+my $m = http_get('/metrics');
+
+like $m, qr!^ctpp2_renders_total\{template="[^"]*/hw\.ct2"\} 2$!m, 'Prometheus counter';
+like $m, qr!^ctpp2_render_seconds_count\{template="[^"]*/hw\.ct2"\} 2$!m,
+	'Prometheus histogram';
+like $m, qr!^ctpp2_renders_total\{template="[^"]*/q\\"t\tb\.ct2"\} 1$!m, 'Prometheus label';
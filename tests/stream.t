@@ -0,0 +1,134 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+use constant CONTENT => 'x' x 1024;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(12);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_stream on;
+	ctpp2_steps_limit 0;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		location / {
+			template  %%TESTDIR%%/test.ct2;
+		}
+		location /empty.json {
+			template  %%TESTDIR%%/empty.ct2;
+		}
+		location /buffered {
+			ctpp2_stream off;
+			template  %%TESTDIR%%/test.ct2;
+			try_files  /big.json =404;
+		}
+		location /small_buffers {
+			ctpp2_output_buffers  2 1k;
+			template  %%TESTDIR%%/test.ct2;
+			try_files  /big.json =404;
+		}
+		location /huge {
+			template  %%TESTDIR%%/huge.ct2;
+			try_files  /huge.json =404;
+		}
+		location /throttled {
+			limit_rate  256k;
+			template  %%TESTDIR%%/huge.ct2;
+			try_files  /huge.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '<TMPL_loop l><TMPL_var t></TMPL_loop>');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+$t->write_file('empty.tmpl', '<TMPL_var nothing>');
+system("ctpp2c '$d/empty.tmpl' '$d/empty.ct2'") == 0 or die "Can't compile empty template\n";
+
+# 16 megabytes of output out of 256 kilobytes of data
+$t->write_file('huge.tmpl', '<TMPL_loop l>' . ('<TMPL_var t>' x 64) . '</TMPL_loop>');
+system("ctpp2c '$d/huge.tmpl' '$d/huge.ct2'") == 0 or die "Can't compile huge template\n";
+
+$t->write_file('small.json', '{"l":[{"t":"' . CONTENT . '"}]}');
+$t->write_file('big.json', '{"l":[' . join(',', ('{"t":"' . CONTENT . '"}') x 64) . ']}');
+$t->write_file('empty.json', '{}');
+$t->write_file('huge.json', '{"l":[' . join(',', ('{"t":"' . CONTENT . '"}') x 256) . ']}');
+
+$t->run();
+
+my $r = http_get('/small.json');
+is get_content($r), CONTENT, 'Small output';
+unlike $r, qr/^Content-Length:/im, 'Small output (no content-length)';
+
+$r = http_get('/big.json');
+is get_content($r), CONTENT x 64, 'Output of many buffers';
+unlike $r, qr/^Content-Length:/im, 'Output of many buffers (no content-length)';
+
+$r = http_get('/empty.json');
+like $r, qr{^HTTP/1\.[01] 200}i, 'Empty output';
+
+$r = http_get('/buffered');
+is get_content($r), CONTENT x 64, 'Buffered output';
+like $r, qr/^Content-Length: 65536\r$/im, 'Buffered output (content-length)';
+
+is get_content(http_get('/small_buffers')), CONTENT x 64, 'Small output buffers';
+is get_content(http_get('/small_buffers')), CONTENT x 64, 'Small output buffers reused';
+
+SKIP: {
+	skip 'no /proc', 2 unless -e "/proc/$$/status";
+
+	my $pid = $t->read_file('nginx.pid');
+	chomp $pid;
+
+	my $rss = rss($pid);
+	my $s = http_get('/throttled', start => 1);
+	select undef, undef, undef, 1.5;
+
+	cmp_ok rss($pid) - $rss, '<', 8192, 'Throttled output (memory bounded)';
+
+	my $head = '';
+	$s->sysread($head, 512);
+	like $head, qr{^HTTP/1\.[01] 200}i, 'Throttled output';
+
+	close $s;
+}
+
+is length(get_content(http_get('/huge'))), 16777216, 'Huge output';
+
+sub rss {
+	my ($pid) = @_;
+	open my $fh, '<', "/proc/$pid/status" or return 0;
+	my ($kb) = map { /^VmRSS:\s+(\d+)/ ? $1 : () } <$fh>;
+	return $kb || 0;
+}
+
+sub get_content {
+	my ($c) = shift =~ /^.+?\r\n\r\n(.*)$/s;
+	return $c;
+}
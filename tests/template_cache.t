@@ -0,0 +1,139 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(15);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_template_cache  zone=tmpls:1m;
+	ctpp2_template_worker_cache  1m;
+	open_file_cache_valid  0;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+
+		location / {
+			template   $arg_t.ct2;
+			try_files  /hw.json =404;
+		}
+		location /check {
+			templates_check on;
+			template   $arg_t.ct2;
+			try_files  /hw.json =404;
+		}
+
+		location /mmap {
+			templates_mmap   on;
+			templates_check  on;
+			template   $arg_t.ct2;
+			try_files  /hw.json =404;
+		}
+		location /mmap_cached {
+			templates_mmap  on;
+			template   cached bye.ct2;
+			try_files  /hw.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('hw.tmpl', 'Hello <TMPL_var second>!');
+system("ctpp2c '$d/hw.tmpl' '$d/hw.ct2'") == 0 or die "Can't compile 'Hello world' template\n";
+$t->write_file('bye.tmpl', 'Goodbye <TMPL_var second>!');
+system("ctpp2c '$d/bye.tmpl' '$d/bye.ct2'") == 0 or die "Can't compile 'Goodbye world' template\n";
+system("cp '$d/hw.ct2' '$d/crc.ct2'") == 0 or die "Can't copy 'Hello world' template\n";
+$t->write_file('hallo.tmpl', 'Hallo <TMPL_var second>!');
+system("ctpp2c '$d/hallo.tmpl' '$d/hallo.ct2'") == 0 or die "Can't compile 'Hallo world' template\n";
+corrupt("$d/hw.ct2", "$d/lvl.ct2");
+$t->write_file('hw.json', '{"second":"world"}');
+
+# templates written this second aren't cached
+my $old = time() - 60;
+utime $old, $old, map { "$d/$_.ct2" } qw/hw bye crc lvl/;
+
+$t->run();
+
+like http_get('/check?t=crc'),  qr/^Hello world!$/m,  'Template CRC checksum';
+
+like http_get('/?t=hw'),  qr/^Hello world!$/m,    'Template loaded';
+
+# rewritten in place keeping inode, size and mtime: only a cache has the old one
+-s "$d/hallo.ct2" == -s "$d/hw.ct2" or die "Templates differ in size\n";
+system("cat '$d/hallo.ct2' > '$d/hw.ct2'") == 0 or die "Can't rewrite template\n";
+utime $old, $old, "$d/hw.ct2";
+
+like http_get('/?t=hw'),  qr/^Hello world!$/m,    'Template from cache';
+like http_get('/?t=bye'), qr/^Goodbye world!$/m,  'Another template';
+
+like http_get('/mmap?t=hw'),     qr/^Hello world!$/m,    'Mapped template';
+like http_get('/mmap?t=hw'),     qr/^Hello world!$/m,    'Mapped template from cache';
+like http_get('/mmap_cached'),   qr/^Goodbye world!$/m,  'Mapped cached template';
+
+# cached by a location without CRC check, it is checked when another one wants
+
+http_get('/?t=lvl');
+like http_get('/check?t=lvl'),  qr/500 Internal/,  'Cached template checked';
+like http_get('/check?t=lvl'),  qr/500 Internal/,  'Cached template checked again';
+
+system("ctpp2c '$d/bye.tmpl' '$d/new.ct2' && mv '$d/new.ct2' '$d/hw.ct2'") == 0
+	or die "Can't replace 'Hello world' template\n";
+
+like http_get('/?t=hw'),       qr/^Goodbye world!$/m,  'Replaced template';
+like http_get('/check?t=hw'),  qr/^Goodbye world!$/m,  'Template check with cache';
+
+# the CRC checksum is tested for every new version, even a memoized path
+
+corrupt("$d/bye.ct2", "$d/new.ct2");
+system("mv '$d/new.ct2' '$d/hw.ct2'") == 0 or die "Can't replace 'Hello world' template\n";
+
+like http_get('/check?t=hw'),  qr/500 Internal/,  'Replaced corrupted template';
+like http_get('/check?t=hw'),  qr/500 Internal/,  'Replaced corrupted template again';
+ok `grep -cF 'CRC checksum invalid' '$d/error.log'` >= 2, 'Corrupted template (log)';
+
+# rewritten in place within a second: same inode, size and maybe mtime
+
+system("cp '$d/bye.ct2' '$d/crc.ct2'") == 0 or die "Can't rewrite template\n";
+like http_get('/check?t=crc'),  qr/^Goodbye world!$/m,  'Rewritten template';
+corrupt("$d/bye.ct2", "$d/crc.ct2");
+unlike http_get('/check?t=crc'),  qr/^Goodbye world!$/m,  'Rewritten corrupted template';
+
+sub corrupt {
+	my ($from, $to) = @_;
+
+	open my $in, '<:raw', $from or die "Can't open $from: $!\n";
+	my $ct2 = do { local $/; <$in> };
+	close $in;
+
+	# the checksum covers the whole image but its own field
+	substr($ct2, -1, 1) = chr(ord(substr($ct2, -1, 1)) ^ 0xff);
+
+	open my $out, '+<:raw', $to or open $out, '>:raw', $to or die "Can't open $to: $!\n";
+	print $out $ct2;
+	close $out;
+}
@@ -0,0 +1,97 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http proxy/)->plan(8);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+
+	log_format  store  $status;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		root  %%TESTDIR%%;
+
+		location / {
+			ctpp2  on;
+			template_uri  /tmpl/$arg_t.ct2 valid=1s;
+			try_files  /hw.json =404;
+		}
+		location /proxied {
+			ctpp2  on;
+			template_uri  /store/$arg_t.ct2?v=1 valid=1s;
+			try_files  /hw.json =404;
+		}
+		location /missing {
+			ctpp2  on;
+			template_uri  /tmpl/none.ct2;
+			try_files  /hw.json =404;
+		}
+		location /tmpl/ {
+			internal;
+			alias  %%TESTDIR%%/;
+		}
+		location /store/ {
+			internal;
+			proxy_pass  http://127.0.0.1:8081/;
+		}
+	}
+
+	server {
+		listen       127.0.0.1:8081;
+		server_name  localhost;
+
+		root  %%TESTDIR%%;
+		access_log  %%TESTDIR%%/store.log  store;
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('hw.tmpl', 'Hello <TMPL_var second>!');
+system("ctpp2c '$d/hw.tmpl' '$d/hw.ct2'") == 0 or die "Can't compile 'Hello world' template\n";
+$t->write_file('bye.tmpl', 'Goodbye <TMPL_var second>!');
+system("ctpp2c '$d/bye.tmpl' '$d/bye.ct2'") == 0 or die "Can't compile 'Goodbye world' template\n";
+$t->write_file('hw.json', '{"second":"world"}');
+
+$t->run();
+
+like http_get('/?t=hw'),         qr/^Hello world!$/m,  'Template fetched';
+like http_get('/?t=hw'),         qr/^Hello world!$/m,  'Template from cache';
+like http_get('/proxied?t=hw'),  qr/^Hello world!$/m,  'Template proxied';
+like http_get('/proxied?t=hw'),  qr/^Hello world!$/m,  'Proxied template from cache';
+
+is $t->read_file('store.log'), "200\n", 'Fetched once';
+
+select undef, undef, undef, 1.1;
+
+http_get('/proxied?t=hw');
+is $t->read_file('store.log'), "200\n304\n", 'Revalidated';
+
+system("mv '$d/bye.ct2' '$d/hw.ct2'") == 0 or die "Can't replace 'Hello world' template\n";
+
+like http_get('/?t=hw'),         qr/^Goodbye world!$/m,  'Replaced template';
+like http_get('/missing'),       qr/500 Internal/,       'Missing template';
@@ -0,0 +1,76 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+plan(skip_all => 'inotify is Linux only') unless $^O eq 'linux';
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(5);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_template_worker_cache  1m;
+	ctpp2_template_watch  on;
+	open_file_cache_valid  1h;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+
+		location / {
+			template   $arg_t.ct2;
+			try_files  /hw.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('hw.tmpl', 'Hello <TMPL_var second>!');
+system("ctpp2c '$d/hw.tmpl' '$d/hw.ct2'") == 0 or die "Can't compile 'Hello world' template\n";
+$t->write_file('bye.tmpl', 'Goodbye <TMPL_var second>!');
+system("ctpp2c '$d/bye.tmpl' '$d/bye.ct2'") == 0 or die "Can't compile 'Goodbye world' template\n";
+$t->write_file('hw.json', '{"second":"world"}');
+
+$t->run();
+
+like http_get('/?t=hw'),  qr/^Hello world!$/m,    'Template loaded';
+like http_get('/?t=hw'),  qr/^Hello world!$/m,    'Template from cache';
+
+system("cp '$d/hw.ct2' '$d/old.ct2' && mv '$d/bye.ct2' '$d/hw.ct2'") == 0
+	or die "Can't replace 'Hello world' template\n";
+select undef, undef, undef, 0.2;
+
+like http_get('/?t=hw'),  qr/^Goodbye world!$/m,  'Replaced template';
+
+system("cat '$d/old.ct2' > '$d/hw.ct2'") == 0 or die "Can't rewrite 'Hello world' template\n";
+select undef, undef, undef, 0.2;
+
+like http_get('/?t=hw'),  qr/^Hello world!$/m,    'Rewritten template';
+
+unlink("$d/hw.ct2");
+select undef, undef, undef, 0.2;
+
+unlike http_get('/?t=hw'), qr/Hello world!/,      'Removed template';
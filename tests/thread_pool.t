@@ -0,0 +1,93 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+use constant CONTENT => 'x' x 1024;
+
+my $t = Test::Nginx->new()->has(qw/http/);
+
+plan(skip_all => 'no threads') unless $t->has_module('threads');
+
+$t->plan(7)->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+thread_pool  ctpp2 threads=2;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_thread_pool ctpp2;
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		location / {
+			template  %%TESTDIR%%/test.ct2;
+		}
+		location /stream {
+			ctpp2_stream on;
+			ctpp2_output_buffers  2 1k;
+			template  %%TESTDIR%%/test.ct2;
+			try_files  /big.json =404;
+		}
+		location /error.json {
+			template  %%TESTDIR%%/test.ct2;
+		}
+		location /var {
+			template  %%TESTDIR%%/var.ct2;
+			try_files  /small.json =404;
+		}
+		location /sync {
+			ctpp2_thread_pool off;
+			template  %%TESTDIR%%/test.ct2;
+			try_files  /big.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '<TMPL_loop l><TMPL_var t></TMPL_loop>');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+$t->write_file('var.tmpl', '[<TMPL_var NGINX_VAR("host")>]');
+system("ctpp2c '$d/var.tmpl' '$d/var.ct2'") == 0 or die "Can't compile var template\n";
+
+$t->write_file('small.json', '{"l":[{"t":"' . CONTENT . '"}]}');
+$t->write_file('big.json', '{"l":[' . join(',', ('{"t":"' . CONTENT . '"}') x 64) . ']}');
+$t->write_file('error.json', '{"l":[');
+
+$t->run();
+
+is get_content(http_get('/small.json')), CONTENT, 'Small output';
+
+my $r = http_get('/big.json');
+like $r, qr/^Content-Length: 65536\r$/im, 'Output of many buffers (content-length)';
+is get_content($r), CONTENT x 64, 'Output of many buffers';
+
+is get_content(http_get('/stream')), CONTENT x 64, 'Not streamed';
+like http_get('/error.json'), qr{^HTTP/1\.[01] 500}i, 'Parse error';
+is get_content(http_get('/var')), '[]', 'No variables';
+is get_content(http_get('/sync')), CONTENT x 64, 'Thread pool off';
+
+sub get_content {
+	my ($c) = shift =~ /^.+?\r\n\r\n(.*)$/s;
+	return $c;
+}
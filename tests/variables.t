@@ -0,0 +1,118 @@
+#!/usr/bin/env perl
+
+#
+# Copyright (C) Valentin V. Bartenev
+#
+
+use strict;
+use warnings;
+
+use Test::More;
+use Test::Nginx;
+
+my $t = Test::Nginx->new()->has(qw/http/)->plan(12);
+
+$t->write_file_expand('nginx.conf', <<'CONF');
+
+%%TEST_GLOBALS%%
+
+master_process off;
+daemon         off;
+
+events {
+}
+
+http {
+	%%TEST_GLOBALS_HTTP%%
+	ctpp2 on;
+	ctpp2_fragment_cache  1m;
+
+	log_format  stats  "$ctpp2_template $ctpp2_data_size $ctpp2_output_size $ctpp2_vm_steps "
+	                   "$ctpp2_parse_time $ctpp2_render_time";
+
+	server {
+		listen       127.0.0.1:8080;
+		server_name  localhost;
+
+		templates_root  %%TESTDIR%%;
+		template   test.ct2;
+
+		location / {
+			set  $custom  "value";
+			try_files  /data.json =404;
+		}
+
+		location /stats {
+			template   hw.ct2;
+			access_log  %%TESTDIR%%/stats.log  stats;
+			try_files  /hw.json =404;
+		}
+
+		location /cached {
+			template   arg.ct2;
+			ctpp2_render_cache  zone=render:1m;
+			add_header  X-Cache  $ctpp2_render_cache_status;
+			try_files  /data.json =404;
+		}
+		location /unknown {
+			template   unknown.ct2;
+			try_files  /data.json =404;
+		}
+	}
+}
+
+CONF
+
+my $d = $t->testdir();
+
+$t->write_file('test.tmpl', '<TMPL_var NGINX_VAR("host")>|<TMPL_var NGINX_VAR("arg_page")>|'
+	. '<TMPL_var NGINX_VAR("Cookie_s")>|<TMPL_var NGINX_VAR("custom")>|'
+	. '<TMPL_if NGINX_VAR("arg_none")>set<TMPL_else>unset</TMPL_if>');
+system("ctpp2c '$d/test.tmpl' '$d/test.ct2'") == 0 or die "Can't compile test template\n";
+
+$t->write_file('arg.tmpl', '<TMPL_if FRAGMENT_BEGIN("a", 3600)>[<TMPL_var NGINX_VAR("arg_a")>]'
+	. '<TMPL_var FRAGMENT_END()></TMPL_if>');
+system("ctpp2c '$d/arg.tmpl' '$d/arg.ct2'") == 0 or die "Can't compile arg template\n";
+$t->write_file('unknown.tmpl', '[<TMPL_var NGINX_VAR("no_such_variable")>]');
+system("ctpp2c '$d/unknown.tmpl' '$d/unknown.ct2'") == 0 or die "Can't compile unknown template\n";
+
+$t->write_file('data.json', '{}');
+
+$t->write_file('hw.tmpl', 'Hello <TMPL_var second>!');
+system("ctpp2c '$d/hw.tmpl' '$d/hw.ct2'") == 0 or die "Can't compile 'Hello world' template\n";
+$t->write_file('hw.json', '{"second":"world"}');
+
+$t->run();
+
+my $r = http(<<EOF);
+GET /?page=2 HTTP/1.0
+Host: example.com
+Cookie: s=abc
+
+EOF
+
+my ($c) = $r =~ /\r\n\r\n(.*)$/s;
+my @v = split /\|/, $c;
+
+is $v[0], 'example.com', 'Host';
+is $v[1], '2', 'Argument';
+is $v[2], 'abc', 'Cookie';
+is "$v[3]|$v[4]", 'value|unset', 'Custom and missing';
+
+# the output depends on the request, neither it nor the fragment is cached
+
+like http_get('/cached?a=1'), qr/^\[1\]$/m, 'Render with variable';
+like http_get('/cached?a=2'), qr/^\[2\]$/m, 'Render with variable not cached';
+like http_get('/cached?a=3'), qr/^X-Cache: BYPASS/m, 'Render with variable bypasses cache';
+
+like http_get('/unknown'), qr/^\[\]$/m, 'Unknown variable';
+
+like http_get('/stats'), qr/^Hello world!$/m, 'Render';
+
+$t->stop();
+
+my @s = split / /, $t->read_file('stats.log');
+
+like $s[0], qr!/hw\.ct2$!, 'Template variable';
+is "$s[1] $s[2]", '18 12', 'Data and output size variables';
+ok $s[3] > 0 && $s[4] =~ /^\d+\.\d{6}$/ && $s[5] =~ /^\d+\.\d{6}$/, 'Steps and time variables';
@@ -0,0 +1,586 @@
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+/*
+ * Renders a template the way the filter does, phase by phase, many times and
+ * reports time, heap allocations and allocated bytes per render:
+ *
+ *   parse   - JSON data into CDT (within the render for the classic parser),
+ *   render  - VM execution and output collection,
+ *   output  - getting output buffers, a part of render,
+ *   free    - destroying the data tree, the VM state and the request pool.
+ *
+ * Allocations are counted by replacing global operator new and delete, the
+ * shared libctpp2 and libstdc++ get the replacements too, and by wrapping
+ * malloc() of the statically linked objects, i.e. of the module and the
+ * nginx core.  C allocations made within shared libraries aren't counted.
+ */
+
+#include "ctpp2_process.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <new>
+#include <string>
+
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *p, size_t size);
+}
+
+typedef struct {
+	uint64_t  ns;
+	uint64_t  allocs;
+	uint64_t  bytes;
+} ctpp2_bench_phase_t;
+
+enum {
+	CTPP2_BENCH_PARSE = 0,
+	CTPP2_BENCH_RENDER,
+	CTPP2_BENCH_OUTPUT,
+	CTPP2_BENCH_FREE,
+	CTPP2_BENCH_TOTAL,
+	CTPP2_BENCH_PHASES
+};
+
+static const char  *ctpp2_bench_names[] = {
+	"parse", "render", "output", "free", "total"
+};
+
+static struct {
+	ngx_uint_t  iterations;
+	ngx_uint_t  scale;
+	ngx_uint_t  parser;
+	ngx_uint_t  steps;
+	ngx_uint_t  slice;
+	ngx_uint_t  stream;
+	size_t      buffer_size;
+	const char *output;
+} ctpp2_bench_conf = { 10000, 0, 0, 10000000, 0, 0, 0, NULL };
+
+static uint64_t    ctpp2_bench_allocs;
+static uint64_t    ctpp2_bench_bytes;
+
+static ctpp2_bench_phase_t  ctpp2_bench_output;
+static FILE                *ctpp2_bench_out;
+
+
+void *
+__wrap_malloc(size_t size)
+{
+	ctpp2_bench_allocs++;
+	ctpp2_bench_bytes += size;
+
+	return __real_malloc(size);
+}
+
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+	ctpp2_bench_allocs++;
+	ctpp2_bench_bytes += n * size;
+
+	return __real_calloc(n, size);
+}
+
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+	ctpp2_bench_allocs++;
+	ctpp2_bench_bytes += size;
+
+	return __real_realloc(p, size);
+}
+
+
+/* not wrapped: references from shared libraries aren't rewritten by --wrap */
+
+void *
+operator new(size_t size) /*throw(std::bad_alloc)*/
+{
+	void  *p;
+
+	ctpp2_bench_allocs++;
+	ctpp2_bench_bytes += size;
+
+	p = __real_malloc(size ? size : 1);
+	if (p == NULL) throw std::bad_alloc();
+
+	return p;
+}
+
+
+void *
+operator new[](size_t size) /*throw(std::bad_alloc)*/
+{
+	return operator new(size);
+}
+
+
+void *
+operator new(size_t size, const std::nothrow_t &) throw()
+{
+	ctpp2_bench_allocs++;
+	ctpp2_bench_bytes += size;
+
+	return __real_malloc(size ? size : 1);
+}
+
+
+void *
+operator new[](size_t size, const std::nothrow_t &tag) throw()
+{
+	return operator new(size, tag);
+}
+
+
+void
+operator delete(void *p) throw()
+{
+	free(p);
+}
+
+
+void
+operator delete[](void *p) throw()
+{
+	free(p);
+}
+
+
+void
+operator delete(void *p, const std::nothrow_t &) throw()
+{
+	free(p);
+}
+
+
+void
+operator delete[](void *p, const std::nothrow_t &) throw()
+{
+	free(p);
+}
+
+#if __cplusplus >= 201402L
+
+void
+operator delete(void *p, size_t) throw()
+{
+	free(p);
+}
+
+
+void
+operator delete[](void *p, size_t) throw()
+{
+	free(p);
+}
+
+#endif
+
+
+static uint64_t
+ctpp2_bench_now(void)
+{
+	struct timespec  ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void
+ctpp2_bench_start(ctpp2_bench_phase_t *snap)
+{
+	snap->allocs = ctpp2_bench_allocs;
+	snap->bytes = ctpp2_bench_bytes;
+	snap->ns = ctpp2_bench_now();
+}
+
+
+static void
+ctpp2_bench_stop(ctpp2_bench_phase_t *phase, ctpp2_bench_phase_t *snap)
+{
+	phase->ns += ctpp2_bench_now() - snap->ns;
+	phase->allocs += ctpp2_bench_allocs - snap->allocs;
+	phase->bytes += ctpp2_bench_bytes - snap->bytes;
+}
+
+
+/* the same as ngx_http_ctpp2_output_alloc() does with an empty cache */
+static ngx_chain_t *
+ctpp2_bench_alloc(void *data)
+{
+	ctpp2_render_t       *render = (ctpp2_render_t *) data;
+	ngx_buf_t            *b;
+	ngx_chain_t          *cl;
+	ctpp2_bench_phase_t   snap;
+
+	ctpp2_bench_start(&snap);
+
+	cl = NULL;
+	b = ngx_create_temp_buf(render->pool, ctpp2_bench_conf.buffer_size);
+	if (b) {
+		cl = ngx_alloc_chain_link(render->pool);
+		if (cl) cl->buf = b;
+	}
+
+	ctpp2_bench_stop(&ctpp2_bench_output, &snap);
+
+	return cl;
+}
+
+
+/* streaming to a client that keeps up: the buffer is sent and reused at once */
+static ngx_int_t
+ctpp2_bench_flush(void *data, ngx_chain_t *out)
+{
+	ctpp2_render_t  *render = (ctpp2_render_t *) data;
+
+	if (ctpp2_bench_out) {
+		fwrite(out->buf->pos, 1, out->buf->last - out->buf->pos, ctpp2_bench_out);
+	}
+
+	out->next = render->free;
+	render->free = out;
+
+	return NGX_OK;
+}
+
+
+static u_char *
+ctpp2_bench_read(const char *name, size_t *size)
+{
+	FILE         *f;
+	u_char       *p;
+	struct stat   st;
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		perror(name);
+		return NULL;
+	}
+
+	p = NULL;
+	if (fstat(fileno(f), &st) == 0) {
+		p = (u_char *) malloc(st.st_size ? st.st_size : 1);
+		if (p && fread(p, 1, st.st_size, f) != (size_t) st.st_size) {
+			perror(name);
+			free(p);
+			p = NULL;
+		}
+		*size = st.st_size;
+	}
+
+	fclose(f);
+	return p;
+}
+
+
+/*
+ * Data of the "Lebowski bench" shape, every loop of the template gets
+ * "scale" items.
+ */
+static std::string
+ctpp2_bench_synthetic(ngx_uint_t scale)
+{
+	std::string  s;
+	char         item[512];
+	ngx_uint_t   i;
+
+	s.append("{\"adverts\":[");
+	for (i = 0; i < scale; i++) {
+		snprintf(item, sizeof(item),
+			"%s{\"title\":\"Advert #%lu\",\"text\":\"Where's the money, <Lebowski> & Co?\","
+			"\"url\":\"http://www.example.com/adverts/%lu\"}",
+			i ? "," : "", (unsigned long) i, (unsigned long) i);
+		s.append(item);
+	}
+
+	s.append("],\"sections\":[");
+	for (i = 0; i < scale; i++) {
+		snprintf(item, sizeof(item), "%s{\"id\":%lu,\"title\":\"Section \\\"%lu\\\"\",\"rip\":%s}",
+			i ? "," : "", (unsigned long) i, (unsigned long) i, (i % 7) ? "0" : "1");
+		s.append(item);
+	}
+
+	snprintf(item, sizeof(item), "],\"total\":%lu,\"online\":[", (unsigned long) scale * 10);
+	s.append(item);
+	for (i = 0; i < scale; i++) {
+		snprintf(item, sizeof(item), "%s{\"name\":\"user\\u00e9%lu\"}",
+			i ? "," : "", (unsigned long) i);
+		s.append(item);
+	}
+
+	s.append("],\"news\":[");
+	for (i = 0; i < scale; i++) {
+		snprintf(item, sizeof(item),
+			"%s{\"id\":%lu,\"time\":\"2010-03-%02lu 12:00\",\"title\":\"News %lu\","
+			"\"text\":\"The Dude abides. I don't know about you, but I take comfort in that.\"}",
+			i ? "," : "", (unsigned long) i, (unsigned long) (i % 28 + 1), (unsigned long) i);
+		s.append(item);
+	}
+	s.append("]}");
+
+	return s;
+}
+
+
+static ngx_int_t
+ctpp2_bench_run(ngx_buf_t *tmpl, u_char *data, size_t size, ngx_log_t *log,
+	ctpp2_bench_phase_t *phases, FILE *out)
+{
+	ngx_pool_t           *pool;
+	ngx_buf_t            *b;
+	ngx_chain_t          *cl;
+	ctpp2_json_t         *json;
+	ctpp2_render_t        render;
+	ctpp2_bench_phase_t   total, snap;
+	ngx_int_t             rc;
+
+	pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+	if (pool == NULL) return NGX_ERROR;
+
+	/* the request body */
+	b = ngx_create_temp_buf(pool, size);
+	if (b == NULL) {
+		ngx_destroy_pool(pool);
+		return NGX_ERROR;
+	}
+	b->last = ngx_cpymem(b->pos, data, size);
+
+	ngx_memzero(&render, sizeof(ctpp2_render_t));
+	render.pool = pool;
+	render.log = log;
+	render.alloc = ctpp2_bench_alloc;
+	render.data = &render;
+	render.tag = (ngx_buf_tag_t) &ctpp2_bench_conf;
+	if (ctpp2_bench_conf.stream) render.flush = ctpp2_bench_flush;
+
+	ctpp2_bench_out = out;
+
+	ctpp2_bench_start(&total);
+
+	json = NULL;
+	rc = NGX_OK;
+
+	if (ctpp2_bench_conf.parser) {
+		ctpp2_bench_start(&snap);
+
+		json = ctpp2_json_create(pool, ctpp2_bench_conf.parser == 2, 0);
+		if (json == NULL) {
+			rc = NGX_ERROR;
+		} else {
+			rc = ctpp2_json_parse(json, b->pos, b->last, log);
+			if (rc == NGX_OK) rc = ctpp2_json_done(json, log);
+		}
+
+		ctpp2_bench_stop(&phases[CTPP2_BENCH_PARSE], &snap);
+	}
+
+	if (rc == NGX_OK) {
+		ctpp2_bench_start(&snap);
+
+		/* suspended after every "-l" steps, resumed at once */
+		do {
+			rc = ctpp2_process(tmpl, b, json, &render);
+		} while (rc == NGX_AGAIN);
+
+		ctpp2_bench_stop(&phases[CTPP2_BENCH_RENDER], &snap);
+
+		if (json == NULL) {
+			/* the classic parser is timed by the render only */
+			phases[CTPP2_BENCH_PARSE].ns += render.parse_time * 1000;
+			phases[CTPP2_BENCH_RENDER].ns -= render.parse_time * 1000;
+		}
+	}
+
+	if (rc == NGX_DONE && out) {
+		for (cl = render.out; cl; cl = cl->next) {
+			fwrite(cl->buf->pos, 1, cl->buf->last - cl->buf->pos, out);
+		}
+	}
+
+	ctpp2_bench_start(&snap);
+	ngx_destroy_pool(pool);
+	ctpp2_bench_stop(&phases[CTPP2_BENCH_FREE], &snap);
+
+	ctpp2_bench_stop(&phases[CTPP2_BENCH_TOTAL], &total);
+
+	return (rc == NGX_DONE) ? NGX_OK : NGX_ERROR;
+}
+
+
+static size_t
+ctpp2_bench_size(const char *s)
+{
+	char    *end;
+	size_t   size;
+
+	size = strtoul(s, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': size *= 1024; break;
+		case 'm': case 'M': size *= 1024 * 1024; break;
+	}
+
+	return size;
+}
+
+
+static void
+ctpp2_bench_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] template.ct2 [data.json]\n"
+		"\n"
+		"Options:\n"
+		"  -n <num>   : number of renders (default 10000)\n"
+		"  -s <num>   : synthetic data with <num> items per loop instead of data.json\n"
+		"  -p <name>  : JSON parser, \"classic\", \"incremental\" or \"simd\" (default classic)\n"
+		"  -b <size>  : size of output buffers (default page size)\n"
+		"  -S <num>   : limit of VM steps (default 10000000)\n"
+		"  -l <num>   : suspend the render every <num> steps, as \"ctpp2_slice_steps\" does\n"
+		"  -f         : stream the output, as \"ctpp2_stream\" does\n"
+		"  -o <file>  : write output of the last render to <file>\n",
+		name);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	ngx_log_t            log;
+	ngx_buf_t            tmpl;
+	ngx_uint_t           i;
+	u_char              *data, *code;
+	size_t               size, code_size;
+	std::string          synthetic;
+	ctpp2_bench_phase_t  phases[CTPP2_BENCH_PHASES];
+	FILE                *out;
+	int                  opt;
+
+	ngx_pagesize = getpagesize();
+	ctpp2_bench_conf.buffer_size = ngx_pagesize;
+
+	while ((opt = getopt(argc, argv, "hfn:s:p:b:S:l:o:")) != -1) {
+		switch (opt) {
+			case 'n': ctpp2_bench_conf.iterations = strtoul(optarg, NULL, 10); break;
+			case 's': ctpp2_bench_conf.scale = strtoul(optarg, NULL, 10); break;
+			case 'b': ctpp2_bench_conf.buffer_size = ctpp2_bench_size(optarg); break;
+			case 'S': ctpp2_bench_conf.steps = strtoul(optarg, NULL, 10); break;
+			case 'l': ctpp2_bench_conf.slice = strtoul(optarg, NULL, 10); break;
+			case 'f': ctpp2_bench_conf.stream = 1; break;
+			case 'o': ctpp2_bench_conf.output = optarg; break;
+			case 'p':
+				if (strcmp(optarg, "classic") == 0) {
+					ctpp2_bench_conf.parser = 0;
+				} else if (strcmp(optarg, "incremental") == 0) {
+					ctpp2_bench_conf.parser = 1;
+				} else if (strcmp(optarg, "simd") == 0) {
+					ctpp2_bench_conf.parser = 2;
+				} else {
+					ctpp2_bench_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'h':
+				ctpp2_bench_usage(argv[0]);
+				return 0;
+			default:
+				ctpp2_bench_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc || (ctpp2_bench_conf.scale == 0 && optind + 2 != argc)
+	    || ctpp2_bench_conf.iterations == 0 || ctpp2_bench_conf.buffer_size < sizeof(u_char *))
+	{
+		ctpp2_bench_usage(argv[0]);
+		return 1;
+	}
+
+	log.log_level = NGX_LOG_ERR;
+
+	code = ctpp2_bench_read(argv[optind], &code_size);
+	if (code == NULL) return 1;
+
+	ngx_memzero(&tmpl, sizeof(ngx_buf_t));
+	tmpl.start = tmpl.pos = code;
+	tmpl.end = tmpl.last = code + code_size;
+
+	if (ctpp2_tmpltest(&tmpl, 1, &log) != NGX_OK) return 1;
+
+	if (ctpp2_bench_conf.scale) {
+		synthetic = ctpp2_bench_synthetic(ctpp2_bench_conf.scale);
+		data = (u_char *) synthetic.data();
+		size = synthetic.size();
+	} else {
+		data = ctpp2_bench_read(argv[optind + 1], &size);
+		if (data == NULL) return 1;
+	}
+
+	if (ctpp2_init(8192, 8192, 100, ctpp2_bench_conf.steps, ctpp2_bench_conf.slice, 0) != NGX_OK) {
+		fprintf(stderr, "could not initialize VM\n");
+		return 1;
+	}
+
+	/* warm up: the VM, lazily allocated tables and the output file */
+	out = NULL;
+	if (ctpp2_bench_conf.output) {
+		out = fopen(ctpp2_bench_conf.output, "wb");
+		if (out == NULL) {
+			perror(ctpp2_bench_conf.output);
+			return 1;
+		}
+	}
+
+	memset(phases, 0, sizeof(phases));
+	if (ctpp2_bench_run(&tmpl, data, size, &log, phases, out) != NGX_OK) {
+		fprintf(stderr, "render failed\n");
+		return 1;
+	}
+	if (out) fclose(out);
+
+	memset(phases, 0, sizeof(phases));
+	memset(&ctpp2_bench_output, 0, sizeof(ctpp2_bench_phase_t));
+
+	for (i = 0; i < ctpp2_bench_conf.iterations; i++) {
+		if (ctpp2_bench_run(&tmpl, data, size, &log, phases, NULL) != NGX_OK) {
+			fprintf(stderr, "render #%lu failed\n", (unsigned long) i);
+			return 1;
+		}
+	}
+
+	phases[CTPP2_BENCH_OUTPUT] = ctpp2_bench_output;
+
+	printf("data: %lu bytes, renders: %lu, parser: %s\n\n",
+		(unsigned long) size, (unsigned long) ctpp2_bench_conf.iterations,
+		ctpp2_bench_conf.parser == 0 ? "classic" :
+		    (ctpp2_bench_conf.parser == 1 ? "incremental" : "simd"));
+	printf("%-8s %14s %14s %14s\n", "phase", "ns/op", "allocs/op", "bytes/op");
+
+	for (i = 0; i < CTPP2_BENCH_PHASES; i++) {
+		printf("%-8s %14.0f %14.1f %14.0f\n", ctpp2_bench_names[i],
+			(double) phases[i].ns / ctpp2_bench_conf.iterations,
+			(double) phases[i].allocs / ctpp2_bench_conf.iterations,
+			(double) phases[i].bytes / ctpp2_bench_conf.iterations);
+	}
+
+	return 0;
+}
@@ -0,0 +1,388 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <stdio.h>
+
+
+static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
+static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static u_char *ngx_bench_vslprintf(u_char *buf, u_char *last, const char *fmt,
+	va_list args);
+
+
+ngx_uint_t  ngx_pagesize;
+
+static const char  *err_levels[] = {
+	"", "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug"
+};
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, ...)
+{
+	u_char   errstr[2048], *p, *last;
+	va_list  args;
+
+	last = errstr + sizeof(errstr) - 1;
+
+	p = errstr + snprintf((char *) errstr, sizeof(errstr), "[%s] ",
+		err_levels[level < 9 ? level : 8]);
+
+	va_start(args, fmt);
+	p = ngx_bench_vslprintf(p, last, fmt, args);
+	va_end(args);
+
+	if (err) {
+		p += snprintf((char *) p, last - p, " (%d: %s)", err, strerror(err));
+	}
+
+	*p++ = '\n';
+
+	(void) fwrite(errstr, 1, p - errstr, stderr);
+}
+
+
+/*
+ * Formats used by the render only: %s, %V, %d, %D, %i, %ui, %uz, %XD and
+ * %08XD-like widths.
+ */
+static u_char *
+ngx_bench_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
+{
+	char        spec[16];
+	int         width, hex, sign;
+	size_t      len;
+	ngx_str_t  *v;
+
+	while (*fmt && buf < last) {
+
+		if (*fmt != '%') {
+			*buf++ = *fmt++;
+			continue;
+		}
+
+		fmt++;
+		width = 0;
+		hex = 0;
+		sign = 1;
+
+		while (*fmt >= '0' && *fmt <= '9') {
+			width = width * 10 + *fmt++ - '0';
+		}
+
+		for ( ;; ) {
+			if (*fmt == 'u') {
+				sign = 0;
+			} else if (*fmt == 'X' || *fmt == 'x') {
+				hex = 1;
+				sign = 0;
+			} else {
+				break;
+			}
+			fmt++;
+		}
+
+		len = last - buf;
+
+		switch (*fmt) {
+
+		case 's':
+			buf += snprintf((char *) buf, len, "%s", va_arg(args, char *));
+			break;
+
+		case 'V':
+			v = va_arg(args, ngx_str_t *);
+			buf += snprintf((char *) buf, len, "%.*s", (int) v->len, v->data);
+			break;
+
+		case 'D':
+			(void) snprintf(spec, sizeof(spec), "%%0%d%s", width,
+				hex ? "X" : (sign ? "d" : "u"));
+			buf += snprintf((char *) buf, len, spec, va_arg(args, int32_t));
+			break;
+
+		case 'd':
+			buf += snprintf((char *) buf, len, sign ? "%d" : "%u", va_arg(args, int));
+			break;
+
+		case 'i':
+			buf += snprintf((char *) buf, len, sign ? "%ld" : "%lu",
+				(long) va_arg(args, ngx_int_t));
+			break;
+
+		case 'z':
+			buf += snprintf((char *) buf, len, "%zu", va_arg(args, size_t));
+			break;
+
+		case 'L':
+			buf += snprintf((char *) buf, len, sign ? "%lld" : "%llu",
+				(long long) va_arg(args, int64_t));
+			break;
+
+		case '%':
+			*buf++ = '%';
+			break;
+
+		default:
+			*buf++ = '%';
+			continue;
+		}
+
+		if (buf > last) {
+			buf = last;
+		}
+
+		fmt++;
+	}
+
+	return buf;
+}
+
+
+ngx_pool_t *
+ngx_create_pool(size_t size, ngx_log_t *log)
+{
+	ngx_pool_t  *p;
+
+	p = malloc(size);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p->d.last = (u_char *) p + sizeof(ngx_pool_t);
+	p->d.end = (u_char *) p + size;
+	p->d.next = NULL;
+
+	size = size - sizeof(ngx_pool_t);
+	p->max = (size < ngx_pagesize - 1) ? size : ngx_pagesize - 1;
+
+	p->current = p;
+	p->chain = NULL;
+	p->large = NULL;
+	p->cleanup = NULL;
+	p->log = log;
+
+	return p;
+}
+
+
+void
+ngx_destroy_pool(ngx_pool_t *pool)
+{
+	ngx_pool_t          *p, *n;
+	ngx_pool_large_t    *l;
+	ngx_pool_cleanup_t  *c;
+
+	for (c = pool->cleanup; c; c = c->next) {
+		if (c->handler) {
+			c->handler(c->data);
+		}
+	}
+
+	for (l = pool->large; l; l = l->next) {
+		if (l->alloc) {
+			free(l->alloc);
+		}
+	}
+
+	for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
+		free(p);
+
+		if (n == NULL) {
+			break;
+		}
+	}
+}
+
+
+void *
+ngx_palloc(ngx_pool_t *pool, size_t size)
+{
+	u_char      *m;
+	ngx_pool_t  *p;
+
+	if (size <= pool->max) {
+
+		p = pool->current;
+
+		do {
+			m = ngx_align_ptr(p->d.last, NGX_ALIGNMENT);
+
+			if ((size_t) (p->d.end - m) >= size) {
+				p->d.last = m + size;
+				return m;
+			}
+
+			p = p->d.next;
+
+		} while (p);
+
+		return ngx_palloc_block(pool, size);
+	}
+
+	return ngx_palloc_large(pool, size);
+}
+
+
+void *
+ngx_pcalloc(ngx_pool_t *pool, size_t size)
+{
+	void  *p;
+
+	p = ngx_palloc(pool, size);
+	if (p) {
+		ngx_memzero(p, size);
+	}
+
+	return p;
+}
+
+
+static void *
+ngx_palloc_block(ngx_pool_t *pool, size_t size)
+{
+	u_char      *m;
+	size_t       psize;
+	ngx_pool_t  *p, *new;
+
+	psize = (size_t) (pool->d.end - (u_char *) pool);
+
+	m = malloc(psize);
+	if (m == NULL) {
+		return NULL;
+	}
+
+	new = (ngx_pool_t *) m;
+
+	new->d.end = m + psize;
+	new->d.next = NULL;
+
+	m += sizeof(ngx_pool_data_t);
+	m = ngx_align_ptr(m, NGX_ALIGNMENT);
+	new->d.last = m + size;
+
+	for (p = pool->current; p->d.next; p = p->d.next) { /* void */ }
+
+	p->d.next = new;
+
+	return m;
+}
+
+
+static void *
+ngx_palloc_large(ngx_pool_t *pool, size_t size)
+{
+	void              *p;
+	ngx_pool_large_t  *large;
+
+	p = malloc(size);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
+	if (large == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	large->alloc = p;
+	large->next = pool->large;
+	pool->large = large;
+
+	return p;
+}
+
+
+ngx_int_t
+ngx_pfree(ngx_pool_t *pool, void *p)
+{
+	ngx_pool_large_t  *l;
+
+	for (l = pool->large; l; l = l->next) {
+		if (p == l->alloc) {
+			free(l->alloc);
+			l->alloc = NULL;
+
+			return NGX_OK;
+		}
+	}
+
+	return NGX_DECLINED;
+}
+
+
+ngx_pool_cleanup_t *
+ngx_pool_cleanup_add(ngx_pool_t *p, size_t size)
+{
+	ngx_pool_cleanup_t  *c;
+
+	c = ngx_palloc(p, sizeof(ngx_pool_cleanup_t));
+	if (c == NULL) {
+		return NULL;
+	}
+
+	if (size) {
+		c->data = ngx_palloc(p, size);
+		if (c->data == NULL) {
+			return NULL;
+		}
+
+	} else {
+		c->data = NULL;
+	}
+
+	c->handler = NULL;
+	c->next = p->cleanup;
+
+	p->cleanup = c;
+
+	return c;
+}
+
+
+ngx_buf_t *
+ngx_create_temp_buf(ngx_pool_t *pool, size_t size)
+{
+	ngx_buf_t  *b;
+
+	b = ngx_calloc_buf(pool);
+	if (b == NULL) {
+		return NULL;
+	}
+
+	b->start = ngx_palloc(pool, size);
+	if (b->start == NULL) {
+		return NULL;
+	}
+
+	b->pos = b->start;
+	b->last = b->start;
+	b->end = b->last + size;
+	b->temporary = 1;
+
+	return b;
+}
+
+
+ngx_chain_t *
+ngx_alloc_chain_link(ngx_pool_t *pool)
+{
+	ngx_chain_t  *cl;
+
+	cl = pool->chain;
+
+	if (cl) {
+		pool->chain = cl->next;
+		return cl;
+	}
+
+	return ngx_palloc(pool, sizeof(ngx_chain_t));
+}
@@ -0,0 +1,47 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+/*
+ * Just enough of nginx to build the render outside of it, see ngx_core.h.
+ */
+
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) \
+    || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define NGX_HAVE_LITTLE_ENDIAN  1
+#endif
+
+#if defined(CLOCK_MONOTONIC)
+#define NGX_HAVE_CLOCK_MONOTONIC  1
+#endif
+
+
+typedef intptr_t   ngx_int_t;
+typedef uintptr_t  ngx_uint_t;
+typedef intptr_t   ngx_flag_t;
+
+#define NGX_ALIGNMENT   sizeof(unsigned long)
+
+#define ngx_align(d, a)     (((d) + (a - 1)) & ~(a - 1))
+#define ngx_align_ptr(p, a)                                                   \
+	(u_char *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
+
+
+#endif /* _NGX_CONFIG_H_INCLUDED_ */
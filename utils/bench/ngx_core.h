@@ -0,0 +1,160 @@
+
+/*
+ * Copyright (C) Valentin V. Bartenev
+ */
+
+
+/*
+ * The part of nginx core used by the render: pools, buffers, chains and
+ * logging.  Pools allocate small blocks from chunks and large ones from
+ * the heap the same way nginx does, so allocation counts are comparable.
+ */
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+
+
+typedef unsigned char  u_char;
+typedef int            ngx_err_t;
+
+typedef struct ngx_pool_s          ngx_pool_t;
+typedef struct ngx_chain_s         ngx_chain_t;
+typedef struct ngx_log_s           ngx_log_t;
+typedef struct ngx_pool_large_s    ngx_pool_large_t;
+typedef struct ngx_pool_cleanup_s  ngx_pool_cleanup_t;
+
+
+#define NGX_OK          0
+#define NGX_ERROR      -1
+#define NGX_AGAIN      -2
+#define NGX_BUSY       -3
+#define NGX_DONE       -4
+#define NGX_DECLINED   -5
+#define NGX_ABORT      -6
+
+
+typedef struct {
+	size_t      len;
+	u_char     *data;
+} ngx_str_t;
+
+
+#define NGX_LOG_STDERR            0
+#define NGX_LOG_EMERG             1
+#define NGX_LOG_ALERT             2
+#define NGX_LOG_CRIT              3
+#define NGX_LOG_ERR               4
+#define NGX_LOG_WARN              5
+#define NGX_LOG_NOTICE            6
+#define NGX_LOG_INFO              7
+#define NGX_LOG_DEBUG             8
+
+#define NGX_LOG_DEBUG_HTTP        0x100
+
+struct ngx_log_s {
+	ngx_uint_t  log_level;
+};
+
+#define ngx_log_error(level, log, ...)                                        \
+	if ((log)->log_level >= level) ngx_log_error_core(level, log, __VA_ARGS__)
+
+#define ngx_log_debug0(level, log, err, fmt)
+
+void ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, ...);
+
+
+typedef void (*ngx_pool_cleanup_pt)(void *data);
+
+struct ngx_pool_cleanup_s {
+	ngx_pool_cleanup_pt   handler;
+	void                 *data;
+	ngx_pool_cleanup_t   *next;
+};
+
+struct ngx_pool_large_s {
+	ngx_pool_large_t     *next;
+	void                 *alloc;
+};
+
+typedef struct {
+	u_char               *last;
+	u_char               *end;
+	ngx_pool_t           *next;
+} ngx_pool_data_t;
+
+struct ngx_pool_s {
+	ngx_pool_data_t       d;
+	size_t                max;
+	ngx_pool_t           *current;
+	ngx_chain_t          *chain;
+	ngx_pool_large_t     *large;
+	ngx_pool_cleanup_t   *cleanup;
+	ngx_log_t            *log;
+};
+
+#define NGX_DEFAULT_POOL_SIZE    (16 * 1024)
+
+ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
+void ngx_destroy_pool(ngx_pool_t *pool);
+void *ngx_palloc(ngx_pool_t *pool, size_t size);
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
+ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
+
+
+typedef void *  ngx_buf_tag_t;
+
+typedef struct {
+	u_char          *pos;
+	u_char          *last;
+	off_t            file_pos;
+	off_t            file_last;
+
+	u_char          *start;
+	u_char          *end;
+	ngx_buf_tag_t    tag;
+
+	unsigned         temporary:1;
+	unsigned         memory:1;
+	unsigned         flush:1;
+	unsigned         last_buf:1;
+} ngx_buf_t;
+
+struct ngx_chain_s {
+	ngx_buf_t    *buf;
+	ngx_chain_t  *next;
+};
+
+#define ngx_calloc_buf(pool) ngx_pcalloc(pool, sizeof(ngx_buf_t))
+
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *pool, size_t size);
+ngx_chain_t *ngx_alloc_chain_link(ngx_pool_t *pool);
+
+#define ngx_free_chain(pool, cl)                                              \
+	(cl)->next = (pool)->chain;                                               \
+	(pool)->chain = (cl)
+
+
+#define ngx_strlen(s)       strlen((const char *) s)
+#define ngx_memzero(buf, n) (void) memset(buf, 0, n)
+#define ngx_memcpy(dst, src, n)  (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n)  (((u_char *) memcpy(dst, src, n)) + (n))
+
+#define ngx_gettimeofday(tp)  (void) gettimeofday(tp, NULL)
+
+
+#define ngx_crc32_init(crc)                                                   \
+	crc = 0xffffffff
+
+#define ngx_crc32_final(crc)                                                  \
+	crc ^= 0xffffffff
+
+
+extern ngx_uint_t  ngx_pagesize;
+
+
+#endif /* _NGX_CORE_H_INCLUDED_ */